@@ -0,0 +1,437 @@
+/*
+ * Checks that every vectorised row kernel the CPU supports converts frames
+ * bit for bit like the scalar reference, through FormatConverter for every
+ * pixel format it accepts. Widths cover no, one and two full vectors with
+ * every remainder, strides are padded to odd sizes, and the output is also
+ * scaled, mirrored and rotated. The per format kernels are also checked
+ * against the generic ones they replaced.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <QBuffer>
+#include <QImage>
+#include <QTest>
+
+#include <libcamera/formats.h>
+#include <libcamera/framebuffer.h>
+
+#include "format_converter.h"
+#include "format_converter_simd.h"
+#include "generic_converter.h"
+#include "image.h"
+
+using FormatConverterSimd::SimdLevel;
+
+namespace {
+
+enum class Layout {
+    RGB,
+    YUVPacked,
+    YUVSemiPlanar,
+    YUVPlanar,
+    Raw,
+    MJPEG,
+};
+
+struct FormatInfo {
+    const char *name;
+    libcamera::PixelFormat format;
+    Layout layout;
+    /* Bytes per pixel for RGB, bits per sample for Raw */
+    unsigned int depth;
+    unsigned int horzSubSample;
+    unsigned int vertSubSample;
+};
+
+const std::vector<FormatInfo> formatInfos = {
+    { "NV12", libcamera::formats::NV12, Layout::YUVSemiPlanar, 0, 2, 2 },
+    { "NV21", libcamera::formats::NV21, Layout::YUVSemiPlanar, 0, 2, 2 },
+    { "NV16", libcamera::formats::NV16, Layout::YUVSemiPlanar, 0, 2, 1 },
+    { "NV61", libcamera::formats::NV61, Layout::YUVSemiPlanar, 0, 2, 1 },
+    { "NV24", libcamera::formats::NV24, Layout::YUVSemiPlanar, 0, 1, 1 },
+    { "NV42", libcamera::formats::NV42, Layout::YUVSemiPlanar, 0, 1, 1 },
+    { "YUV420", libcamera::formats::YUV420, Layout::YUVPlanar, 0, 2, 2 },
+    { "YVU420", libcamera::formats::YVU420, Layout::YUVPlanar, 0, 2, 2 },
+    { "YUV422", libcamera::formats::YUV422, Layout::YUVPlanar, 0, 2, 1 },
+    { "YUYV", libcamera::formats::YUYV, Layout::YUVPacked, 0, 2, 1 },
+    { "YVYU", libcamera::formats::YVYU, Layout::YUVPacked, 0, 2, 1 },
+    { "UYVY", libcamera::formats::UYVY, Layout::YUVPacked, 0, 2, 1 },
+    { "VYUY", libcamera::formats::VYUY, Layout::YUVPacked, 0, 2, 1 },
+    { "R8", libcamera::formats::R8, Layout::RGB, 1, 1, 1 },
+    { "RGB888", libcamera::formats::RGB888, Layout::RGB, 3, 1, 1 },
+    { "BGR888", libcamera::formats::BGR888, Layout::RGB, 3, 1, 1 },
+    { "ARGB8888", libcamera::formats::ARGB8888, Layout::RGB, 4, 1, 1 },
+    { "XRGB8888", libcamera::formats::XRGB8888, Layout::RGB, 4, 1, 1 },
+    { "RGBA8888", libcamera::formats::RGBA8888, Layout::RGB, 4, 1, 1 },
+    { "RGBX8888", libcamera::formats::RGBX8888, Layout::RGB, 4, 1, 1 },
+    { "ABGR8888", libcamera::formats::ABGR8888, Layout::RGB, 4, 1, 1 },
+    { "XBGR8888", libcamera::formats::XBGR8888, Layout::RGB, 4, 1, 1 },
+    { "BGRA8888", libcamera::formats::BGRA8888, Layout::RGB, 4, 1, 1 },
+    { "BGRX8888", libcamera::formats::BGRX8888, Layout::RGB, 4, 1, 1 },
+    { "SBGGR8", libcamera::formats::SBGGR8, Layout::Raw, 8, 1, 1 },
+    { "SGBRG8", libcamera::formats::SGBRG8, Layout::Raw, 8, 1, 1 },
+    { "SGRBG8", libcamera::formats::SGRBG8, Layout::Raw, 8, 1, 1 },
+    { "SRGGB8", libcamera::formats::SRGGB8, Layout::Raw, 8, 1, 1 },
+    { "SBGGR10_CSI2P", libcamera::formats::SBGGR10_CSI2P, Layout::Raw, 10, 1, 1 },
+    { "SGBRG10_CSI2P", libcamera::formats::SGBRG10_CSI2P, Layout::Raw, 10, 1, 1 },
+    { "SGRBG10_CSI2P", libcamera::formats::SGRBG10_CSI2P, Layout::Raw, 10, 1, 1 },
+    { "SRGGB10_CSI2P", libcamera::formats::SRGGB10_CSI2P, Layout::Raw, 10, 1, 1 },
+    { "SBGGR12_CSI2P", libcamera::formats::SBGGR12_CSI2P, Layout::Raw, 12, 1, 1 },
+    { "SGBRG12_CSI2P", libcamera::formats::SGBRG12_CSI2P, Layout::Raw, 12, 1, 1 },
+    { "SGRBG12_CSI2P", libcamera::formats::SGRBG12_CSI2P, Layout::Raw, 12, 1, 1 },
+    { "SRGGB12_CSI2P", libcamera::formats::SRGGB12_CSI2P, Layout::Raw, 12, 1, 1 },
+    { "MJPEG", libcamera::formats::MJPEG, Layout::MJPEG, 0, 1, 1 },
+};
+
+/* All row kernels handle 16 pixels per iteration */
+constexpr unsigned int VectorWidth = 16;
+
+constexpr unsigned int FrameHeight = 6;
+
+/* Odd paddings make the strides odd wherever the row size is even */
+const unsigned int stridePaddings[] = { 0, 1, 7 };
+
+/* Vectorised levels the CPU runs, each compared to SimdLevel::None */
+QList<SimdLevel> vectorLevels()
+{
+    switch (FormatConverterSimd::detectSimdLevel()) {
+    case SimdLevel::AVX2:
+        return { SimdLevel::SSE2, SimdLevel::AVX2 };
+    case SimdLevel::SSE2:
+        return { SimdLevel::SSE2 };
+    case SimdLevel::NEON:
+        return { SimdLevel::NEON };
+    case SimdLevel::None:
+    default:
+        return {};
+    }
+}
+
+/*
+ * Every remainder with no, one and two full vectors, YUV and Bayer rows
+ * are in pixel pairs. MJPEG only runs through libjpeg, a few sizes do.
+ */
+std::vector<unsigned int> testWidths(const FormatInfo &info)
+{
+    std::vector<unsigned int> widths;
+
+    if (info.layout == Layout::MJPEG)
+        return { 1, 17, 40 };
+
+    for (unsigned int width = 1; width <= 3 * VectorWidth; width++) {
+        if (info.layout == Layout::RGB || width % 2 == 0)
+            widths.push_back(width);
+    }
+
+    return widths;
+}
+
+unsigned int rowBytes(const FormatInfo &info, unsigned int width)
+{
+    switch (info.layout) {
+    case Layout::RGB:
+        return width * info.depth;
+    case Layout::YUVPacked:
+        return width * 2;
+    case Layout::Raw:
+        /* CSI-2 packing, a last pair of 10-bit samples keeps its LSB byte */
+        if (info.depth == 10)
+            return (width + 3) / 4 * 5;
+        if (info.depth == 12)
+            return width / 2 * 3;
+        return width;
+    default:
+        return width;
+    }
+}
+
+void fillRandom(uint8_t *data, size_t size, uint32_t seed)
+{
+    uint32_t state = seed | 1;
+
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state;
+    }
+}
+
+QByteArray makeJpeg(unsigned int width, unsigned int height)
+{
+    QImage image(width, height, QImage::Format_RGB32);
+
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++)
+            image.setPixel(x, y, qRgb(x * 37, y * 53, (x ^ y) * 11));
+    }
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "JPG", 90);
+
+    return data;
+}
+
+/* A frame in a memfd, with its planes laid out like the camera does */
+struct Frame {
+    std::unique_ptr<libcamera::FrameBuffer> buffer;
+    std::unique_ptr<Image> image;
+    size_t bytesUsed = 0;
+};
+
+std::unique_ptr<Frame> makeFrame(const FormatInfo &info, unsigned int width,
+                                 unsigned int stride, uint32_t seed)
+{
+    std::vector<size_t> planes;
+    QByteArray jpeg;
+
+    if (info.layout == Layout::MJPEG) {
+        jpeg = makeJpeg(width, FrameHeight);
+        if (jpeg.isEmpty())
+            return nullptr;
+        planes.push_back(jpeg.size());
+    } else {
+        planes.push_back(static_cast<size_t>(stride) * FrameHeight);
+
+        if (info.layout == Layout::YUVSemiPlanar) {
+            planes.push_back(static_cast<size_t>(stride) * 2 / info.horzSubSample *
+                             (FrameHeight / info.vertSubSample));
+        } else if (info.layout == Layout::YUVPlanar) {
+            size_t chroma = static_cast<size_t>(stride / 2) * (FrameHeight / info.vertSubSample);
+            planes.push_back(chroma);
+            planes.push_back(chroma);
+        }
+    }
+
+    size_t total = 0;
+    for (size_t plane : planes)
+        total += plane;
+
+    int fd = memfd_create("formatconvertertest", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, total) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+
+    libcamera::SharedFD sharedFd(std::move(fd));
+    std::vector<libcamera::FrameBuffer::Plane> fbPlanes;
+    size_t offset = 0;
+
+    for (size_t plane : planes) {
+        libcamera::FrameBuffer::Plane fbPlane;
+        fbPlane.fd = sharedFd;
+        fbPlane.offset = offset;
+        fbPlane.length = plane;
+        fbPlanes.push_back(fbPlane);
+        offset += plane;
+    }
+
+    auto frame = std::make_unique<Frame>();
+    frame->buffer = std::make_unique<libcamera::FrameBuffer>(fbPlanes);
+    frame->image = Image::fromFrameBuffer(frame->buffer.get(), Image::MapMode::ReadWrite);
+    frame->bytesUsed = total;
+    if (!frame->image)
+        return nullptr;
+
+    for (unsigned int i = 0; i < frame->image->numPlanes(); i++) {
+        libcamera::Span<uint8_t> data = frame->image->data(i);
+
+        if (info.layout == Layout::MJPEG)
+            memcpy(data.data(), jpeg.constData(), jpeg.size());
+        else
+            fillRandom(data.data(), data.size(), seed + i);
+    }
+
+    return frame;
+}
+
+enum class Scale {
+    None,
+    Box,
+    Bilinear,
+};
+
+struct Variant {
+    libcamera::Orientation orientation;
+    bool mirror;
+    Scale scale;
+    bool edgeAware;
+};
+
+QImage convertFrame(const FormatInfo &info, const Frame &frame, unsigned int width,
+                    unsigned int stride, const Variant &variant, SimdLevel level)
+{
+    FormatConverter converter;
+    converter.setSimdLevel(level);
+
+    if (converter.configure(info.format, QSize(width, FrameHeight), stride,
+                            libcamera::ColorSpace::Rec709) < 0)
+        return QImage();
+
+    if (variant.edgeAware) {
+        FormatConverter::BayerParameters params;
+        params.demosaic = FormatConverter::Demosaic::EdgeAware;
+        converter.setBayerParameters(params);
+    }
+
+    converter.setOrientation(variant.orientation, variant.mirror);
+
+    if (variant.scale != Scale::None) {
+        converter.setOutputSize(QSize(std::max(1u, width * 2 / 3), FrameHeight / 2),
+                                variant.scale == Scale::Box ? FormatConverter::Scaling::Box
+                                                            : FormatConverter::Scaling::Bilinear);
+    }
+
+    QImage dst(converter.outputSize(), QImage::Format_RGB32);
+    dst.fill(0);
+    converter.convert(frame.image.get(), frame.bytesUsed, &dst);
+
+    return dst;
+}
+
+QString firstDifference(const QImage &a, const QImage &b)
+{
+    if (a.size() != b.size())
+        return QStringLiteral("size %1x%2 vs %3x%4")
+            .arg(a.width()).arg(a.height()).arg(b.width()).arg(b.height());
+
+    for (int y = 0; y < a.height(); y++) {
+        for (int x = 0; x < a.width(); x++) {
+            if (a.pixel(x, y) != b.pixel(x, y))
+                return QStringLiteral("pixel %1,%2: %3 vs %4")
+                    .arg(x).arg(y)
+                    .arg(a.pixel(x, y), 8, 16, QLatin1Char('0'))
+                    .arg(b.pixel(x, y), 8, 16, QLatin1Char('0'));
+        }
+    }
+
+    return QString();
+}
+
+} /* namespace */
+
+Q_DECLARE_METATYPE(libcamera::Orientation)
+Q_DECLARE_METATYPE(Scale)
+
+class FormatConverterTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void vectorMatchesScalar_data();
+    void vectorMatchesScalar();
+    void specialisedMatchesGeneric();
+};
+
+void FormatConverterTest::vectorMatchesScalar_data()
+{
+    QTest::addColumn<int>("formatIndex");
+    QTest::addColumn<libcamera::Orientation>("orientation");
+    QTest::addColumn<bool>("mirror");
+    QTest::addColumn<Scale>("scale");
+    QTest::addColumn<bool>("edgeAware");
+
+    using libcamera::Orientation;
+
+    for (size_t i = 0; i < formatInfos.size(); i++) {
+        const FormatInfo &info = formatInfos[i];
+        const int index = static_cast<int>(i);
+
+        QTest::addRow("%s-plain", info.name) << index << Orientation::Rotate0 << false << Scale::None << false;
+        QTest::addRow("%s-mirrored", info.name) << index << Orientation::Rotate0 << true << Scale::None << false;
+        QTest::addRow("%s-rotated", info.name) << index << Orientation::Rotate90 << false << Scale::None << false;
+        QTest::addRow("%s-box", info.name) << index << Orientation::Rotate0 << false << Scale::Box << false;
+        QTest::addRow("%s-bilinear", info.name) << index << Orientation::Rotate0 << false << Scale::Bilinear << false;
+        QTest::addRow("%s-bilinear-mirrored", info.name) << index << Orientation::Rotate0 << true << Scale::Bilinear << false;
+
+        if (info.layout == Layout::Raw) {
+            QTest::addRow("%s-edge-aware", info.name) << index << Orientation::Rotate0 << false << Scale::None << true;
+            QTest::addRow("%s-edge-aware-box", info.name) << index << Orientation::Rotate0 << false << Scale::Box << true;
+        }
+    }
+}
+
+void FormatConverterTest::vectorMatchesScalar()
+{
+    QFETCH(int, formatIndex);
+    QFETCH(libcamera::Orientation, orientation);
+    QFETCH(bool, mirror);
+    QFETCH(Scale, scale);
+    QFETCH(bool, edgeAware);
+
+    const QList<SimdLevel> levels = vectorLevels();
+    if (levels.isEmpty())
+        QSKIP("No vectorised kernels on this CPU");
+
+    const FormatInfo &info = formatInfos[formatIndex];
+    const Variant variant = { orientation, mirror, scale, edgeAware };
+
+    for (unsigned int width : testWidths(info)) {
+        for (unsigned int padding : stridePaddings) {
+            const unsigned int stride = rowBytes(info, width) + padding;
+
+            std::unique_ptr<Frame> frame = makeFrame(info, width, stride, width * 131 + padding);
+            QVERIFY2(frame, "Unable to allocate a frame");
+
+            const QImage reference = convertFrame(info, *frame, width, stride, variant, SimdLevel::None);
+            QVERIFY2(!reference.isNull(), "Format rejected");
+
+            for (SimdLevel level : levels) {
+                const QImage result = convertFrame(info, *frame, width, stride, variant, level);
+                const QString difference = firstDifference(result, reference);
+
+                QVERIFY2(difference.isEmpty(),
+                         qPrintable(QStringLiteral("%1 differs from scalar at width %2, stride %3, %4")
+                                        .arg(QLatin1String(FormatConverterSimd::simdLevelName(level)))
+                                        .arg(width).arg(stride).arg(difference)));
+            }
+        }
+    }
+}
+
+void FormatConverterTest::specialisedMatchesGeneric()
+{
+    const Variant plain = { libcamera::Orientation::Rotate0, false, Scale::None, false };
+
+    for (const FormatInfo &info : formatInfos) {
+        if (info.layout != Layout::RGB && info.layout != Layout::YUVPacked)
+            continue;
+
+        for (unsigned int width : testWidths(info)) {
+            const unsigned int stride = rowBytes(info, width) + 1;
+
+            std::unique_ptr<Frame> frame = makeFrame(info, width, stride, width);
+            QVERIFY2(frame, "Unable to allocate a frame");
+
+            GenericConverter converter;
+            QVERIFY(converter.configure(info.format, QSize(width, FrameHeight), stride,
+                                        libcamera::ColorSpace::Rec709));
+            QImage generic(width, FrameHeight, QImage::Format_RGB32);
+            generic.fill(0);
+            converter.convert(frame->image.get(), &generic);
+
+            const QImage specialised = convertFrame(info, *frame, width, stride, plain,
+                                                    SimdLevel::None);
+            const QString difference = firstDifference(specialised, generic);
+
+            QVERIFY2(difference.isEmpty(),
+                     qPrintable(QStringLiteral("%1 differs from the generic kernel at width %2, %3")
+                                    .arg(QLatin1String(info.name)).arg(width).arg(difference)));
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(FormatConverterTest)
+
+#include "formatconvertertest.moc"
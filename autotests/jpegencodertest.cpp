@@ -0,0 +1,354 @@
+/*
+ * Checks that stills compressed as strips on several threads and stitched
+ * together decode to the same pixels as a single pass. Heights cover whole
+ * and partial last MCU rows, and MCU row counts the strip count divides and
+ * doesn't, through the raw YUV path, the RGB path and with and without an
+ * EXIF APP1 segment in the headers of the first strip.
+ */
+
+#include <memory>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <libcamera/color_space.h>
+#include <libcamera/formats.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/orientation.h>
+#include <libcamera/stream.h>
+
+#include <jpeglib.h>
+
+#include "encoder_jpeg.h"
+#include "exifwriter.h"
+#include "image.h"
+
+namespace {
+
+enum class Layout {
+    YUVSemiPlanar,
+    YUVPlanar,
+    RGB,
+};
+
+/*
+ * Rec601 4:2:0 goes straight to libjpeg, other matrices, other formats and
+ * oriented stills go through RGB
+ */
+struct SourceInfo {
+    const char *name;
+    libcamera::PixelFormat format;
+    Layout layout;
+    libcamera::ColorSpace colorSpace;
+    libcamera::Orientation orientation;
+};
+
+const std::vector<SourceInfo> sourceInfos = {
+    { "NV12-full", libcamera::formats::NV12, Layout::YUVSemiPlanar,
+      libcamera::ColorSpace::Sycc, libcamera::Orientation::Rotate0 },
+    { "NV12-limited", libcamera::formats::NV12, Layout::YUVSemiPlanar,
+      libcamera::ColorSpace::Smpte170m, libcamera::Orientation::Rotate0 },
+    { "YUV420-full", libcamera::formats::YUV420, Layout::YUVPlanar,
+      libcamera::ColorSpace::Sycc, libcamera::Orientation::Rotate0 },
+    { "NV12-rgb", libcamera::formats::NV12, Layout::YUVSemiPlanar,
+      libcamera::ColorSpace::Sycc, libcamera::Orientation::Rotate180 },
+    { "BGRX8888", libcamera::formats::BGRX8888, Layout::RGB,
+      libcamera::ColorSpace::Sycc, libcamera::Orientation::Rotate0 },
+};
+
+/* A whole number of MCUs wide, where full range luma is read in place, and not */
+const unsigned int widths[] = { 64, 72 };
+
+/*
+ * Enough MCU rows for every thread to get a strip. 64 rows split evenly in
+ * 4 strips but not in 3, 65 and 71 in neither, and end in a partial row.
+ */
+const unsigned int heights[] = { 64 * 16, 64 * 16 + 5, 70 * 16 + 9 };
+
+const unsigned int threadCounts[] = { 3, 4 };
+
+/* Random samples in every byte of the planes, padding included */
+void fillRandom(uint8_t *data, size_t size, uint32_t seed)
+{
+    uint32_t state = seed | 1;
+
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state;
+    }
+}
+
+/* A frame in a memfd, with its planes laid out like the camera does */
+struct Frame {
+    libcamera::StreamConfiguration cfg;
+    std::unique_ptr<libcamera::FrameBuffer> buffer;
+    std::unique_ptr<Image> image;
+};
+
+std::unique_ptr<Frame> makeFrame(const SourceInfo &info, unsigned int width,
+                                 unsigned int height, uint32_t seed)
+{
+    auto frame = std::make_unique<Frame>();
+    frame->cfg.pixelFormat = info.format;
+    frame->cfg.size = libcamera::Size(width, height);
+    frame->cfg.colorSpace = info.colorSpace;
+
+    std::vector<size_t> planes;
+    const unsigned int chromaHeight = (height + 1) / 2;
+
+    switch (info.layout) {
+    case Layout::YUVSemiPlanar:
+        frame->cfg.stride = width + 8;
+        planes.push_back(static_cast<size_t>(frame->cfg.stride) * height);
+        planes.push_back(static_cast<size_t>(frame->cfg.stride) * chromaHeight);
+        break;
+    case Layout::YUVPlanar:
+        frame->cfg.stride = width + 16;
+        planes.push_back(static_cast<size_t>(frame->cfg.stride) * height);
+        planes.push_back(static_cast<size_t>(frame->cfg.stride / 2) * chromaHeight);
+        planes.push_back(static_cast<size_t>(frame->cfg.stride / 2) * chromaHeight);
+        break;
+    case Layout::RGB:
+        frame->cfg.stride = width * 4 + 12;
+        planes.push_back(static_cast<size_t>(frame->cfg.stride) * height);
+        break;
+    }
+
+    size_t total = 0;
+    for (size_t plane : planes)
+        total += plane;
+
+    int fd = memfd_create("jpegencodertest", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, total) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+
+    libcamera::SharedFD sharedFd(std::move(fd));
+    std::vector<libcamera::FrameBuffer::Plane> fbPlanes;
+    size_t offset = 0;
+
+    for (size_t plane : planes) {
+        libcamera::FrameBuffer::Plane fbPlane;
+        fbPlane.fd = sharedFd;
+        fbPlane.offset = offset;
+        fbPlane.length = plane;
+        fbPlanes.push_back(fbPlane);
+        offset += plane;
+    }
+
+    frame->buffer = std::make_unique<libcamera::FrameBuffer>(fbPlanes);
+    frame->image = Image::fromFrameBuffer(frame->buffer.get(), Image::MapMode::ReadWrite);
+    if (!frame->image)
+        return nullptr;
+
+    for (unsigned int i = 0; i < frame->image->numPlanes(); i++) {
+        libcamera::Span<uint8_t> data = frame->image->data(i);
+        fillRandom(data.data(), data.size(), seed + i);
+    }
+
+    return frame;
+}
+
+struct DecoderErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void decoderErrorExit(j_common_ptr cinfo)
+{
+    longjmp(reinterpret_cast<DecoderErrorManager *>(cinfo->err)->jump, 1);
+}
+
+/* A JPEG decoded to RGB by libjpeg, with what its headers held */
+struct Decoded {
+    bool ok = false;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int restartInterval = 0;
+    bool exif = false;
+    std::vector<uint8_t> pixels;
+};
+
+Decoded decode(const QString &fileName)
+{
+    Decoded decoded;
+
+    FILE *file = fopen(QFile::encodeName(fileName).constData(), "rb");
+    if (!file)
+        return decoded;
+
+    jpeg_decompress_struct cinfo;
+    DecoderErrorManager error;
+
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = decoderErrorExit;
+
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        decoded.ok = false;
+        return decoded;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+    jpeg_read_header(&cinfo, TRUE);
+
+    for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker; marker = marker->next) {
+        if (marker->marker == JPEG_APP0 + 1 && marker->data_length >= 6 &&
+            memcmp(marker->data, "Exif\0\0", 6) == 0)
+            decoded.exif = true;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.dct_method = JDCT_ISLOW;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+
+    decoded.width = cinfo.output_width;
+    decoded.height = cinfo.output_height;
+    decoded.restartInterval = cinfo.restart_interval;
+    decoded.pixels.resize(static_cast<size_t>(cinfo.output_width) * cinfo.output_height * 3);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &decoded.pixels[static_cast<size_t>(cinfo.output_scanline) *
+                                       cinfo.output_width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+
+    decoded.ok = true;
+    return decoded;
+}
+
+QString firstDifference(const Decoded &a, const Decoded &b)
+{
+    if (a.width != b.width || a.height != b.height)
+        return QStringLiteral("size %1x%2 vs %3x%4")
+            .arg(a.width).arg(a.height).arg(b.width).arg(b.height);
+
+    for (size_t i = 0; i < a.pixels.size(); i++) {
+        if (a.pixels[i] != b.pixels[i]) {
+            const size_t pixel = i / 3;
+            return QStringLiteral("pixel %1,%2 channel %3: %4 vs %5")
+                .arg(pixel % a.width).arg(pixel / a.width).arg(i % 3)
+                .arg(a.pixels[i]).arg(b.pixels[i]);
+        }
+    }
+
+    return QString();
+}
+
+bool encodeFrame(const SourceInfo &info, Frame &frame, unsigned int threads,
+                 const ExifWriter *exif, const QString &fileName)
+{
+    EncoderJpeg encoder;
+    encoder.setParallelism(threads);
+    encoder.setOrientation(info.orientation);
+
+    return encoder.encode(frame.cfg, frame.buffer.get(), frame.image.get(),
+                          QFile::encodeName(fileName).toStdString(), exif);
+}
+
+} /* namespace */
+
+class JpegEncoderTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void stripsMatchSinglePass_data();
+    void stripsMatchSinglePass();
+};
+
+void JpegEncoderTest::stripsMatchSinglePass_data()
+{
+    QTest::addColumn<int>("sourceIndex");
+    QTest::addColumn<unsigned int>("width");
+    QTest::addColumn<unsigned int>("height");
+    QTest::addColumn<unsigned int>("threads");
+    QTest::addColumn<bool>("exif");
+
+    for (size_t i = 0; i < sourceInfos.size(); i++) {
+        const SourceInfo &info = sourceInfos[i];
+        const int index = static_cast<int>(i);
+
+        for (unsigned int width : widths) {
+            for (unsigned int height : heights) {
+                for (unsigned int threads : threadCounts) {
+                    QTest::addRow("%s-%ux%u-%u-threads", info.name, width, height, threads)
+                        << index << width << height << threads << false;
+                    QTest::addRow("%s-%ux%u-%u-threads-exif", info.name, width, height, threads)
+                        << index << width << height << threads << true;
+                }
+            }
+        }
+    }
+}
+
+void JpegEncoderTest::stripsMatchSinglePass()
+{
+    QFETCH(int, sourceIndex);
+    QFETCH(unsigned int, width);
+    QFETCH(unsigned int, height);
+    QFETCH(unsigned int, threads);
+    QFETCH(bool, exif);
+
+    const SourceInfo &info = sourceInfos[sourceIndex];
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    std::unique_ptr<Frame> frame = makeFrame(info, width, height, width * 131 + height);
+    QVERIFY2(frame, "Unable to allocate a frame");
+
+    ExifWriter tags;
+    tags.setModel("jpegencodertest");
+    const ExifWriter *writer = exif ? &tags : nullptr;
+
+    const QString singleName = dir.filePath(QStringLiteral("single.jpg"));
+    const QString stripsName = dir.filePath(QStringLiteral("strips.jpg"));
+
+    QVERIFY(encodeFrame(info, *frame, 1, writer, singleName));
+    QVERIFY(encodeFrame(info, *frame, threads, writer, stripsName));
+
+    const Decoded single = decode(singleName);
+    const Decoded strips = decode(stripsName);
+    QVERIFY2(single.ok, "Single pass JPEG doesn't decode");
+    QVERIFY2(strips.ok, "Stitched JPEG doesn't decode");
+
+    // Only stitched strips carry restart markers, so they were used
+    QCOMPARE(single.restartInterval, 0u);
+    QVERIFY(strips.restartInterval > 0);
+
+    QCOMPARE(single.exif, exif);
+    QCOMPARE(strips.exif, exif);
+
+    QCOMPARE(single.width, width);
+    QCOMPARE(single.height, height);
+
+    const QString difference = firstDifference(strips, single);
+    QVERIFY2(difference.isEmpty(),
+             qPrintable(QStringLiteral("Strips differ from a single pass at %1").arg(difference)));
+}
+
+QTEST_GUILESS_MAIN(JpegEncoderTest)
+
+#include "jpegencodertest.moc"
@@ -0,0 +1,102 @@
+/*
+ * Checks that WakeNotifier never loses a wake. A producer thread queues
+ * short bursts through an SpscRing, waking the consumer after each entry,
+ * and waits for every burst to be drained before the next. A wake coalesced
+ * into one whose drain missed its entry leaves the burst undelivered, as
+ * nothing else is pushed to wake the consumer again.
+ */
+
+#include <atomic>
+#include <memory>
+
+#include <QElapsedTimer>
+#include <QTest>
+#include <QThread>
+
+#include "spscring.h"
+#include "wakenotifier.h"
+
+namespace {
+
+constexpr int Bursts = 20000;
+constexpr int MaxBurst = 4;
+// Ample for the consumer's event loop to drain a burst
+constexpr int DrainTimeoutMs = 5000;
+
+} /* namespace */
+
+class WakeNotifierTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void everyEntryDelivered();
+};
+
+void WakeNotifierTest::everyEntryDelivered()
+{
+    SpscRing<int> ring;
+    ring.reset(MaxBurst);
+
+    WakeNotifier notifier;
+    std::atomic<int> received{0};
+    int expected = 0;
+    bool ordered = true;
+
+    connect(&notifier, &WakeNotifier::woken, this, [&]() {
+        int value;
+        while (ring.pop(&value)) {
+            ordered = ordered && value == expected;
+            expected++;
+            received.fetch_add(1, std::memory_order_release);
+        }
+    });
+
+    std::atomic<int> sent{0};
+    std::atomic<bool> stalled{false};
+    std::atomic<bool> overflowed{false};
+    std::atomic<bool> done{false};
+
+    std::unique_ptr<QThread> producer(QThread::create([&]() {
+        for (int burst = 0; burst < Bursts; burst++) {
+            // Bursts of one to MaxBurst entries, each woken for separately
+            const int count = burst % MaxBurst + 1;
+            for (int i = 0; i < count; i++) {
+                const int value = sent.load(std::memory_order_relaxed);
+                if (!ring.push(value)) {
+                    overflowed = true;
+                    done = true;
+                    return;
+                }
+                sent.store(value + 1, std::memory_order_relaxed);
+                notifier.wake();
+            }
+
+            // Idle until drained, so the next burst wakes a sleeping consumer
+            QElapsedTimer timer;
+            timer.start();
+            while (received.load(std::memory_order_acquire) != sent.load(std::memory_order_relaxed)) {
+                if (timer.elapsed() > DrainTimeoutMs) {
+                    stalled = true;
+                    done = true;
+                    return;
+                }
+                QThread::yieldCurrentThread();
+            }
+        }
+        done = true;
+    }));
+    producer->start();
+
+    QTRY_VERIFY_WITH_TIMEOUT(done.load(), 60000);
+    producer->wait();
+
+    QVERIFY(!overflowed);
+    QVERIFY2(!stalled, qPrintable(QStringLiteral("Entry %1 was never delivered").arg(received.load())));
+    QCOMPARE(received.load(), sent.load());
+    QVERIFY(ordered);
+}
+
+QTEST_GUILESS_MAIN(WakeNotifierTest)
+
+#include "wakenotifiertest.moc"
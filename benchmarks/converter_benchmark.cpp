@@ -0,0 +1,740 @@
+/*
+ * Standalone benchmark of the frame processing paths: FormatConverter for
+ * every supported format, with and without downscaling to the viewfinder,
+ * and through the generic kernels the per format ones replaced,
+ * Image::fromFrameBuffer, EncoderJpeg and every registered StillEncoder.
+ * Frames are synthetic and live in memfd backed FrameBuffers, like dmabufs
+ * from the camera. Frames the camera saved as raw dumps can be run too.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QThread>
+
+#include <libcamera/formats.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+#include "encoder_jpeg.h"
+#include "format_converter.h"
+#include "format_converter_simd.h"
+#include "generic_converter.h"
+#include "image.h"
+#include "rawdump.h"
+#include "stillencoder.h"
+
+/*
+ * Count every heap allocation of the process. With glibc, malloc itself is
+ * interposed so allocations made by Qt's containers are seen too. Other C
+ * libraries only get operator new counted.
+ */
+static std::atomic<unsigned long> allocationCount{ 0 };
+
+#if defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+}
+#else
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = ::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    ::free(ptr);
+}
+#endif
+
+namespace {
+
+enum class Layout {
+    RGB,
+    YUVPacked,
+    YUVSemiPlanar,
+    YUVPlanar,
+    Raw,
+    MJPEG,
+};
+
+struct FormatInfo {
+    const char *name;
+    libcamera::PixelFormat format;
+    Layout layout;
+    /* Bytes per pixel of the first plane, as a fraction */
+    unsigned int bytesNum;
+    unsigned int bytesDen;
+    unsigned int horzSubSample;
+    unsigned int vertSubSample;
+};
+
+const std::vector<FormatInfo> formatInfos = {
+    { "NV12", libcamera::formats::NV12, Layout::YUVSemiPlanar, 1, 1, 2, 2 },
+    { "NV21", libcamera::formats::NV21, Layout::YUVSemiPlanar, 1, 1, 2, 2 },
+    { "NV16", libcamera::formats::NV16, Layout::YUVSemiPlanar, 1, 1, 2, 1 },
+    { "NV61", libcamera::formats::NV61, Layout::YUVSemiPlanar, 1, 1, 2, 1 },
+    { "NV24", libcamera::formats::NV24, Layout::YUVSemiPlanar, 1, 1, 1, 1 },
+    { "NV42", libcamera::formats::NV42, Layout::YUVSemiPlanar, 1, 1, 1, 1 },
+    { "YUV420", libcamera::formats::YUV420, Layout::YUVPlanar, 1, 1, 2, 2 },
+    { "YVU420", libcamera::formats::YVU420, Layout::YUVPlanar, 1, 1, 2, 2 },
+    { "YUV422", libcamera::formats::YUV422, Layout::YUVPlanar, 1, 1, 2, 1 },
+    { "YUYV", libcamera::formats::YUYV, Layout::YUVPacked, 2, 1, 2, 1 },
+    { "YVYU", libcamera::formats::YVYU, Layout::YUVPacked, 2, 1, 2, 1 },
+    { "UYVY", libcamera::formats::UYVY, Layout::YUVPacked, 2, 1, 2, 1 },
+    { "VYUY", libcamera::formats::VYUY, Layout::YUVPacked, 2, 1, 2, 1 },
+    { "R8", libcamera::formats::R8, Layout::RGB, 1, 1, 1, 1 },
+    { "RGB888", libcamera::formats::RGB888, Layout::RGB, 3, 1, 1, 1 },
+    { "BGR888", libcamera::formats::BGR888, Layout::RGB, 3, 1, 1, 1 },
+    { "ARGB8888", libcamera::formats::ARGB8888, Layout::RGB, 4, 1, 1, 1 },
+    { "XRGB8888", libcamera::formats::XRGB8888, Layout::RGB, 4, 1, 1, 1 },
+    { "RGBA8888", libcamera::formats::RGBA8888, Layout::RGB, 4, 1, 1, 1 },
+    { "RGBX8888", libcamera::formats::RGBX8888, Layout::RGB, 4, 1, 1, 1 },
+    { "ABGR8888", libcamera::formats::ABGR8888, Layout::RGB, 4, 1, 1, 1 },
+    { "XBGR8888", libcamera::formats::XBGR8888, Layout::RGB, 4, 1, 1, 1 },
+    { "BGRA8888", libcamera::formats::BGRA8888, Layout::RGB, 4, 1, 1, 1 },
+    { "BGRX8888", libcamera::formats::BGRX8888, Layout::RGB, 4, 1, 1, 1 },
+    { "SBGGR8", libcamera::formats::SBGGR8, Layout::Raw, 1, 1, 1, 1 },
+    { "SGBRG8", libcamera::formats::SGBRG8, Layout::Raw, 1, 1, 1, 1 },
+    { "SGRBG8", libcamera::formats::SGRBG8, Layout::Raw, 1, 1, 1, 1 },
+    { "SRGGB8", libcamera::formats::SRGGB8, Layout::Raw, 1, 1, 1, 1 },
+    { "SBGGR10_CSI2P", libcamera::formats::SBGGR10_CSI2P, Layout::Raw, 5, 4, 1, 1 },
+    { "SGBRG10_CSI2P", libcamera::formats::SGBRG10_CSI2P, Layout::Raw, 5, 4, 1, 1 },
+    { "SGRBG10_CSI2P", libcamera::formats::SGRBG10_CSI2P, Layout::Raw, 5, 4, 1, 1 },
+    { "SRGGB10_CSI2P", libcamera::formats::SRGGB10_CSI2P, Layout::Raw, 5, 4, 1, 1 },
+    { "SBGGR12_CSI2P", libcamera::formats::SBGGR12_CSI2P, Layout::Raw, 3, 2, 1, 1 },
+    { "SGBRG12_CSI2P", libcamera::formats::SGBRG12_CSI2P, Layout::Raw, 3, 2, 1, 1 },
+    { "SGRBG12_CSI2P", libcamera::formats::SGRBG12_CSI2P, Layout::Raw, 3, 2, 1, 1 },
+    { "SRGGB12_CSI2P", libcamera::formats::SRGGB12_CSI2P, Layout::Raw, 3, 2, 1, 1 },
+    { "MJPEG", libcamera::formats::MJPEG, Layout::MJPEG, 0, 1, 1, 1 },
+};
+
+struct SizeInfo {
+    const char *name;
+    QSize size;
+};
+
+const std::vector<SizeInfo> sizeInfos = {
+    { "VGA", QSize(640, 480) },
+    { "720p", QSize(1280, 720) },
+    { "1080p", QSize(1920, 1080) },
+    { "12MP", QSize(4000, 3000) },
+    { "48MP", QSize(8000, 6000) },
+};
+
+/*
+ * One representative format per converted family for the slow end to end
+ * paths. Formats the encoder takes zero-copy need the bytesused of a
+ * completed request, which synthetic buffers don't have.
+ */
+const QStringList encoderFormats = {
+    QStringLiteral("NV12"),
+    QStringLiteral("YUV420"),
+    QStringLiteral("YUYV"),
+    QStringLiteral("SBGGR10_CSI2P"),
+};
+
+const QSize viewfinderSize(1280, 720);
+
+/* A frame in a memfd, planes laid out like the camera does. */
+struct Frame {
+    std::unique_ptr<libcamera::FrameBuffer> buffer;
+    std::unique_ptr<Image> image;
+    unsigned int stride = 0;
+    size_t bytesUsed = 0;
+    libcamera::ColorSpace colorSpace = libcamera::ColorSpace::Sycc;
+    /* Loaded from a raw dump, whose content must be kept */
+    bool captured = false;
+};
+
+unsigned int alignUp(unsigned int value, unsigned int alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void fillRandom(uint8_t *data, size_t size)
+{
+    uint32_t state = 0x12345678;
+
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        data[i] = state;
+    }
+}
+
+/*
+ * Overwrite every plane with smooth gradients under light noise, closer to
+ * a photo than fillRandom() for comparing compressed sizes. Each plane is
+ * taken as rows of stride bytes, whatever its layout.
+ */
+void fillScene(Frame &frame)
+{
+    uint32_t state = 0x12345678;
+
+    for (unsigned int i = 0; i < frame.image->numPlanes(); i++) {
+        libcamera::Span<uint8_t> data = frame.image->data(i);
+
+        for (size_t offset = 0; offset < data.size(); offset++) {
+            unsigned int x = offset % frame.stride;
+            unsigned int y = offset / frame.stride;
+
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            data[offset] = (x / 8 + y / 4 + (i + 1) * 40 + (state & 7)) & 0xff;
+        }
+    }
+}
+
+QByteArray makeJpeg(const QSize &size)
+{
+    QImage image(size, QImage::Format_RGB32);
+
+    for (int y = 0; y < size.height(); y++) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size.width(); x++)
+            line[x] = qRgb(x * 255 / size.width(), y * 255 / size.height(), (x ^ y) & 0xff);
+    }
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "JPG", 92);
+
+    return data;
+}
+
+std::unique_ptr<Frame> makeFrame(const FormatInfo &info, const QSize &size)
+{
+    auto frame = std::make_unique<Frame>();
+    std::vector<size_t> planes;
+    QByteArray jpeg;
+
+    if (info.layout == Layout::MJPEG) {
+        jpeg = makeJpeg(size);
+        planes.push_back(jpeg.size());
+    } else {
+        unsigned int width = size.width();
+        unsigned int height = size.height();
+
+        frame->stride = alignUp(width * info.bytesNum / info.bytesDen, 64);
+        planes.push_back(static_cast<size_t>(frame->stride) * height);
+
+        if (info.layout == Layout::YUVSemiPlanar) {
+            planes.push_back(static_cast<size_t>(frame->stride) * 2 / info.horzSubSample *
+                             (height / info.vertSubSample));
+        } else if (info.layout == Layout::YUVPlanar) {
+            size_t chroma = static_cast<size_t>(frame->stride / info.horzSubSample) *
+                            (height / info.vertSubSample);
+            planes.push_back(chroma);
+            planes.push_back(chroma);
+        }
+    }
+
+    size_t total = 0;
+    for (size_t plane : planes)
+        total += plane;
+
+    int fd = memfd_create("benchmark-frame", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, total) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+
+    libcamera::SharedFD sharedFd(std::move(fd));
+    std::vector<libcamera::FrameBuffer::Plane> fbPlanes;
+    size_t offset = 0;
+
+    for (size_t plane : planes) {
+        libcamera::FrameBuffer::Plane fbPlane;
+        fbPlane.fd = sharedFd;
+        fbPlane.offset = offset;
+        fbPlane.length = plane;
+        fbPlanes.push_back(fbPlane);
+        offset += plane;
+    }
+
+    frame->buffer = std::make_unique<libcamera::FrameBuffer>(fbPlanes);
+    frame->image = Image::fromFrameBuffer(frame->buffer.get(), Image::MapMode::ReadWrite);
+    frame->bytesUsed = total;
+    if (!frame->image)
+        return nullptr;
+
+    for (unsigned int i = 0; i < frame->image->numPlanes(); i++) {
+        libcamera::Span<uint8_t> data = frame->image->data(i);
+
+        if (info.layout == Layout::MJPEG)
+            memcpy(data.data(), jpeg.constData(), jpeg.size());
+        else
+            fillRandom(data.data(), data.size());
+    }
+
+    return frame;
+}
+
+struct Result {
+    QString suite;
+    QString format;
+    QString size;
+    QSize resolution;
+    unsigned int iterations;
+    double nsPerCall;
+    double allocationsPerCall;
+    /* Still encoder cases only */
+    QString encoder;
+    qint64 outputBytes;
+};
+
+class Benchmark
+{
+public:
+    Benchmark(std::chrono::milliseconds minTime, unsigned int threads)
+        : m_minTime(minTime), m_threads(threads)
+    {
+    }
+
+    unsigned int threads() const { return m_threads; }
+
+    /*
+     * Call fn once to warm caches and lazily allocated state, then
+     * repeatedly for at least the minimum time and three iterations.
+     * Encoding cases name the encoder and the file it writes, whose size
+     * is reported.
+     */
+    void measure(const QString &suite, const QString &format, const SizeInfo &size,
+                 const std::function<void()> &fn, const QString &encoder = QString(),
+                 const QString &output = QString())
+    {
+        using clock = std::chrono::steady_clock;
+
+        fn();
+
+        unsigned long allocations = allocationCount.load();
+        unsigned int iterations = 0;
+        clock::time_point start = clock::now();
+        clock::duration elapsed;
+
+        do {
+            fn();
+            iterations++;
+            elapsed = clock::now() - start;
+        } while (elapsed < m_minTime || iterations < 3);
+
+        allocations = allocationCount.load() - allocations;
+
+        Result result;
+        result.suite = suite;
+        result.format = format;
+        result.size = QLatin1String(size.name);
+        result.resolution = size.size;
+        result.iterations = iterations;
+        result.nsPerCall = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        result.allocationsPerCall = static_cast<double>(allocations) / iterations;
+        result.encoder = encoder;
+        result.outputBytes = output.isEmpty() ? 0 : QFileInfo(output).size();
+
+        m_results.push_back(result);
+
+        if (m_progress)
+            printResult(result);
+    }
+
+    void setProgress(bool progress) { m_progress = progress; }
+
+    void printHeader() const
+    {
+        QTextStream out(stdout);
+        out << QStringLiteral("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+                   .arg(QStringLiteral("suite"), -10)
+                   .arg(QStringLiteral("format"), -14)
+                   .arg(QStringLiteral("size"), -6)
+                   .arg(QStringLiteral("MPix/s"), 10)
+                   .arg(QStringLiteral("ns/px"), 8)
+                   .arg(QStringLiteral("ms/call"), 10)
+                   .arg(QStringLiteral("allocs"), 8)
+                   .arg(QStringLiteral("encoder"), -8)
+                   .arg(QStringLiteral("KiB"), 8);
+    }
+
+    void printResult(const Result &r) const
+    {
+        double pixels = static_cast<double>(r.resolution.width()) * r.resolution.height();
+        QTextStream out(stdout);
+
+        out << QStringLiteral("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+                   .arg(r.suite, -10)
+                   .arg(r.format, -14)
+                   .arg(r.size, -6)
+                   .arg(pixels / r.nsPerCall * 1000.0, 10, 'f', 1)
+                   .arg(r.nsPerCall / pixels, 8, 'f', 3)
+                   .arg(r.nsPerCall / 1e6, 10, 'f', 3)
+                   .arg(r.allocationsPerCall, 8, 'f', 1)
+                   .arg(r.encoder.isEmpty() ? QStringLiteral("-") : r.encoder, -8)
+                   .arg(r.outputBytes ? QString::number(r.outputBytes / 1024) : QStringLiteral("-"), 8);
+        out.flush();
+    }
+
+    QJsonDocument toJson() const
+    {
+        QJsonArray results;
+
+        for (const Result &r : m_results) {
+            double pixels = static_cast<double>(r.resolution.width()) * r.resolution.height();
+            QJsonObject o;
+
+            o[QStringLiteral("suite")] = r.suite;
+            o[QStringLiteral("format")] = r.format;
+            o[QStringLiteral("size")] = r.size;
+            o[QStringLiteral("width")] = r.resolution.width();
+            o[QStringLiteral("height")] = r.resolution.height();
+            o[QStringLiteral("iterations")] = static_cast<int>(r.iterations);
+            o[QStringLiteral("mpixPerSecond")] = pixels / r.nsPerCall * 1000.0;
+            o[QStringLiteral("nsPerPixel")] = r.nsPerCall / pixels;
+            o[QStringLiteral("msPerCall")] = r.nsPerCall / 1e6;
+            o[QStringLiteral("allocationsPerCall")] = r.allocationsPerCall;
+            if (!r.encoder.isEmpty()) {
+                o[QStringLiteral("encoder")] = r.encoder;
+                o[QStringLiteral("outputBytes")] = r.outputBytes;
+            }
+            results.append(o);
+        }
+
+        FormatConverterSimd::SimdLevel level = FormatConverterSimd::detectSimdLevel();
+        QJsonObject root;
+        root[QStringLiteral("threads")] = static_cast<int>(m_threads);
+        root[QStringLiteral("simd")] = QLatin1String(FormatConverterSimd::simdLevelName(level));
+        root[QStringLiteral("minTimeMs")] = static_cast<int>(m_minTime.count());
+        root[QStringLiteral("results")] = results;
+
+        return QJsonDocument(root);
+    }
+
+private:
+    std::chrono::milliseconds m_minTime;
+    unsigned int m_threads;
+    bool m_progress = true;
+    std::vector<Result> m_results;
+};
+
+/* Keep the converters' configuration chatter out of the results. */
+void quietMessageHandler(QtMsgType type, const QMessageLogContext &, const QString &msg)
+{
+    if (type == QtDebugMsg || type == QtInfoMsg)
+        return;
+
+    QTextStream(stderr) << msg << "\n";
+}
+
+void runConvert(Benchmark &bench, const FormatInfo &info, const SizeInfo &size,
+                Frame &frame, bool scaled)
+{
+    FormatConverter converter;
+    converter.setParallelism(bench.threads());
+
+    if (converter.configure(info.format, size.size, frame.stride, frame.colorSpace) < 0) {
+        qWarning() << "Unable to configure" << info.name;
+        return;
+    }
+
+    if (scaled) {
+        QSize fit = size.size.scaled(viewfinderSize, Qt::KeepAspectRatio);
+        bool reduce = fit.width() * 2 <= size.size.width();
+
+        converter.setOutputSize(fit, reduce ? FormatConverter::Scaling::Box
+                                            : FormatConverter::Scaling::Bilinear);
+    }
+
+    QImage dst(converter.outputSize(), QImage::Format_RGB32);
+
+    bench.measure(scaled ? QStringLiteral("scale") : QStringLiteral("convert"),
+                  QLatin1String(info.name), size, [&]() {
+        converter.convert(frame.image.get(), frame.bytesUsed, &dst);
+    });
+}
+
+void runGeneric(Benchmark &bench, const FormatInfo &info, const SizeInfo &size, Frame &frame)
+{
+    GenericConverter converter;
+    converter.setParallelism(bench.threads());
+
+    if (!converter.configure(info.format, size.size, frame.stride, frame.colorSpace))
+        return;
+
+    QImage dst(size.size, QImage::Format_RGB32);
+
+    bench.measure(QStringLiteral("generic"), QLatin1String(info.name), size, [&]() {
+        converter.convert(frame.image.get(), &dst);
+    });
+}
+
+void runMap(Benchmark &bench, const FormatInfo &info, const SizeInfo &size, Frame &frame)
+{
+    bench.measure(QStringLiteral("map"), QLatin1String(info.name), size, [&]() {
+        std::unique_ptr<Image> image =
+            Image::fromFrameBuffer(frame.buffer.get(), Image::MapMode::ReadOnly);
+    });
+}
+
+void runEncode(Benchmark &bench, const FormatInfo &info, const SizeInfo &size,
+               Frame &frame, const QString &dir)
+{
+    libcamera::StreamConfiguration cfg;
+    cfg.pixelFormat = info.format;
+    cfg.size = libcamera::Size(size.size.width(), size.size.height());
+    cfg.stride = frame.stride;
+    cfg.colorSpace = frame.colorSpace;
+
+    EncoderJpeg encoder;
+    std::string path = (dir + QStringLiteral("/encode.jpg")).toStdString();
+
+    encoder.setParallelism(bench.threads());
+    bench.measure(QStringLiteral("encode"), QLatin1String(info.name), size, [&]() {
+        encoder.encode(cfg, frame.buffer.get(), frame.image.get(), path);
+    });
+
+    /* The single threaded baseline the strip encoding speedup is relative to */
+    if (bench.threads() > 1) {
+        encoder.setParallelism(1);
+        bench.measure(QStringLiteral("encode1"), QLatin1String(info.name), size, [&]() {
+            encoder.encode(cfg, frame.buffer.get(), frame.image.get(), path);
+        });
+    }
+}
+
+/* A frame saved by the camera, cfg gets its format and size */
+std::unique_ptr<Frame> loadFrame(const QString &fileName, libcamera::StreamConfiguration *cfg)
+{
+    std::unique_ptr<RawDump> dump = RawDump::load(fileName);
+    if (!dump)
+        return nullptr;
+
+    auto frame = std::make_unique<Frame>();
+    frame->buffer = std::move(dump->buffer);
+    frame->image = std::move(dump->image);
+    frame->stride = dump->config.stride;
+    frame->bytesUsed = dump->bytesUsed;
+    if (dump->config.colorSpace)
+        frame->colorSpace = *dump->config.colorSpace;
+    frame->captured = true;
+    *cfg = dump->config;
+
+    return frame;
+}
+
+/*
+ * Every registered still encoder on the same frame, at its default quality
+ * and at 100, which is lossless for WebP and the slowest, smallest PNG.
+ */
+void runStills(Benchmark &bench, const FormatInfo &info, const SizeInfo &size,
+               Frame &frame, const QString &dir)
+{
+    libcamera::StreamConfiguration cfg;
+    cfg.pixelFormat = info.format;
+    cfg.size = libcamera::Size(size.size.width(), size.size.height());
+    cfg.stride = frame.stride;
+    cfg.colorSpace = frame.colorSpace;
+
+    if (!frame.captured)
+        fillScene(frame);
+
+    for (const QString &name : StillEncoder::names()) {
+        std::unique_ptr<StillEncoder> encoder = StillEncoder::create(name);
+        const QString path = dir + QStringLiteral("/still") + StillEncoder::suffix(name);
+        const std::string file = path.toStdString();
+
+        encoder->setParallelism(bench.threads());
+
+        for (int quality : { -1, 100 }) {
+            encoder->setQuality(quality);
+            int effective = quality < 0 ? StillEncoder::defaultQuality(name) : quality;
+
+            bench.measure(QStringLiteral("still"), QLatin1String(info.name), size, [&]() {
+                encoder->encode(cfg, frame.buffer.get(), frame.image.get(), file);
+            }, QStringLiteral("%1/%2").arg(name).arg(effective), path);
+        }
+    }
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("shutter-benchmark"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Benchmark frame conversion and encoding"));
+    parser.addHelpOption();
+
+    QCommandLineOption jsonOption(QStringLiteral("json"),
+                                  QStringLiteral("Write the results as JSON to <file>, - for stdout."),
+                                  QStringLiteral("file"));
+    QCommandLineOption formatOption(QStringLiteral("format"),
+                                    QStringLiteral("Only run <format>, may be repeated."),
+                                    QStringLiteral("format"));
+    QCommandLineOption sizeOption(QStringLiteral("size"),
+                                  QStringLiteral("Only run <size> (VGA, 720p, 1080p, 12MP, 48MP), may be repeated."),
+                                  QStringLiteral("size"));
+    QCommandLineOption suiteOption(QStringLiteral("suite"),
+                                   QStringLiteral("Only run <suite> (convert, generic, scale, map, encode, encode1, still), may be repeated."),
+                                   QStringLiteral("suite"));
+    QCommandLineOption threadsOption(QStringLiteral("threads"),
+                                     QStringLiteral("Conversion threads, defaults to all cores."),
+                                     QStringLiteral("count"),
+                                     QString::number(QThread::idealThreadCount()));
+    QCommandLineOption minTimeOption(QStringLiteral("min-time"),
+                                     QStringLiteral("Minimum measuring time per case."),
+                                     QStringLiteral("ms"), QStringLiteral("250"));
+    QCommandLineOption rawOption(QStringLiteral("raw"),
+                                 QStringLiteral("Run on the raw dump <file> saved by the camera instead of synthetic frames, may be repeated."),
+                                 QStringLiteral("file"));
+    QCommandLineOption verboseOption(QStringLiteral("verbose"),
+                                     QStringLiteral("Keep debug output."));
+
+    parser.addOptions({ jsonOption, formatOption, sizeOption, suiteOption,
+                        threadsOption, minTimeOption, rawOption, verboseOption });
+    parser.process(app);
+
+    if (!parser.isSet(verboseOption))
+        qInstallMessageHandler(quietMessageHandler);
+
+    QStringList formats = parser.values(formatOption);
+    QStringList sizes = parser.values(sizeOption);
+    QStringList suites = parser.values(suiteOption);
+    bool jsonToStdout = parser.value(jsonOption) == QLatin1String("-");
+
+    auto selected = [](const QStringList &filter, const char *name) {
+        return filter.isEmpty() || filter.contains(QLatin1String(name), Qt::CaseInsensitive);
+    };
+
+    Benchmark bench(std::chrono::milliseconds(parser.value(minTimeOption).toUInt()),
+                    std::max(parser.value(threadsOption).toUInt(), 1u));
+    bench.setProgress(!jsonToStdout);
+    if (!jsonToStdout)
+        bench.printHeader();
+
+    QTemporaryDir dir;
+
+    auto runSuites = [&](const FormatInfo &info, const SizeInfo &size, Frame &frame) {
+        if (selected(suites, "convert"))
+            runConvert(bench, info, size, frame, false);
+        // Only RGB and packed YUV have generic kernels to compare with
+        if (selected(suites, "generic") &&
+            (info.layout == Layout::RGB || info.layout == Layout::YUVPacked))
+            runGeneric(bench, info, size, frame);
+        if (selected(suites, "scale") && size.size.height() > viewfinderSize.height())
+            runConvert(bench, info, size, frame, true);
+        if (selected(suites, "map"))
+            runMap(bench, info, size, frame);
+        if ((selected(suites, "encode") || selected(suites, "encode1")) &&
+            encoderFormats.contains(QLatin1String(info.name)))
+            runEncode(bench, info, size, frame, dir.path());
+        if (selected(suites, "still") && encoderFormats.contains(QLatin1String(info.name)))
+            runStills(bench, info, size, frame, dir.path());
+    };
+
+    const QStringList rawFiles = parser.values(rawOption);
+
+    for (const QString &fileName : rawFiles) {
+        libcamera::StreamConfiguration cfg;
+        std::unique_ptr<Frame> frame = loadFrame(fileName, &cfg);
+        if (!frame)
+            continue;
+
+        auto info = std::find_if(formatInfos.begin(), formatInfos.end(),
+                                 [&](const FormatInfo &f) { return f.format == cfg.pixelFormat; });
+        if (info == formatInfos.end()) {
+            qWarning() << "Unsupported format" << QString::fromStdString(cfg.pixelFormat.toString())
+                       << "in" << fileName;
+            continue;
+        }
+
+        // Named after the file, the results tell the dumps apart
+        const QByteArray name = QFileInfo(fileName).fileName().toUtf8();
+        const SizeInfo size = { name.constData(), QSize(cfg.size.width, cfg.size.height) };
+        runSuites(*info, size, *frame);
+    }
+
+    for (const SizeInfo &size : sizeInfos) {
+        if (!rawFiles.isEmpty() || !selected(sizes, size.name))
+            continue;
+
+        for (const FormatInfo &info : formatInfos) {
+            if (!selected(formats, info.name))
+                continue;
+
+            std::unique_ptr<Frame> frame = makeFrame(info, size.size);
+            if (!frame) {
+                qWarning() << "Unable to allocate" << info.name << size.name;
+                continue;
+            }
+
+            runSuites(info, size, *frame);
+        }
+    }
+
+    if (parser.isSet(jsonOption)) {
+        QByteArray json = bench.toJson().toJson();
+
+        if (jsonToStdout) {
+            QTextStream(stdout) << json;
+        } else {
+            QFile file(parser.value(jsonOption));
+            if (!file.open(QIODevice::WriteOnly)) {
+                qWarning() << "Unable to write" << file.fileName();
+                return 1;
+            }
+            file.write(json);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "generic_converter.h"
+
+#include <algorithm>
+
+#include <QImage>
+
+#include <libcamera/formats.h>
+
+#include "format_converter.h"
+#include "image.h"
+#include "workerpool.h"
+
+bool GenericConverter::configure(const libcamera::PixelFormat &format, const QSize &size,
+                                 unsigned int stride, const libcamera::ColorSpace &colorSpace)
+{
+    struct RGBLayout {
+        libcamera::PixelFormat format;
+        unsigned int bpp, r, g, b;
+    };
+    static const RGBLayout rgbLayouts[] = {
+        { libcamera::formats::R8, 1, 0, 0, 0 },
+        { libcamera::formats::RGB888, 3, 2, 1, 0 },
+        { libcamera::formats::BGR888, 3, 0, 1, 2 },
+        { libcamera::formats::ARGB8888, 4, 2, 1, 0 },
+        { libcamera::formats::XRGB8888, 4, 2, 1, 0 },
+        { libcamera::formats::RGBA8888, 4, 3, 2, 1 },
+        { libcamera::formats::RGBX8888, 4, 3, 2, 1 },
+        { libcamera::formats::ABGR8888, 4, 0, 1, 2 },
+        { libcamera::formats::XBGR8888, 4, 0, 1, 2 },
+        { libcamera::formats::BGRA8888, 4, 1, 2, 3 },
+        { libcamera::formats::BGRX8888, 4, 1, 2, 3 },
+    };
+
+    struct YUVLayout {
+        libcamera::PixelFormat format;
+        unsigned int y, cb;
+    };
+    static const YUVLayout yuvLayouts[] = {
+        { libcamera::formats::VYUY, 1, 2 },
+        { libcamera::formats::YVYU, 0, 3 },
+        { libcamera::formats::UYVY, 1, 0 },
+        { libcamera::formats::YUYV, 0, 1 },
+    };
+
+    auto rgb = std::find_if(std::begin(rgbLayouts), std::end(rgbLayouts),
+                            [&](const RGBLayout &l) { return l.format == format; });
+    auto yuv = std::find_if(std::begin(yuvLayouts), std::end(yuvLayouts),
+                            [&](const YUVLayout &l) { return l.format == format; });
+
+    if (rgb != std::end(rgbLayouts)) {
+        m_yuv = false;
+        m_bpp = rgb->bpp;
+        m_rPos = rgb->r;
+        m_gPos = rgb->g;
+        m_bPos = rgb->b;
+    } else if (yuv != std::end(yuvLayouts)) {
+        m_yuv = true;
+        m_yPos = yuv->y;
+        m_cbPos = yuv->cb;
+    } else {
+        return false;
+    }
+
+    m_width = size.width();
+    m_height = size.height();
+    m_stride = stride;
+    m_yuvTables.build(FormatConverter::yuvCoefficients(colorSpace));
+
+    return true;
+}
+
+void GenericConverter::setParallelism(unsigned int threads)
+{
+    m_threads = std::max(threads, 1u);
+}
+
+void GenericConverter::convert(const Image *src, QImage *dst) const
+{
+    unsigned char *bits = dst->bits();
+    const unsigned int bands = std::min({ m_threads, std::max(m_height / 32, 1u),
+                                          WorkerPool::instance()->threadCount() });
+    const unsigned int bandHeight = (m_height + bands - 1) / bands;
+
+    WorkerPool::instance()->run(bands, [&](unsigned int band) {
+        const unsigned int top = std::min(band * bandHeight, m_height);
+        const unsigned int bottom = std::min(top + bandHeight, m_height);
+        unsigned char *out = bits + top * m_width * 4;
+
+        if (m_yuv)
+            convertYUVPacked(src, out, top, bottom);
+        else
+            convertRGB(src, out, top, bottom);
+    });
+}
+
+void GenericConverter::convertRGB(const Image *srcImage, unsigned char *dst,
+                                  unsigned int top, unsigned int bottom) const
+{
+    const unsigned char *src = srcImage->data(0).data() + top * m_stride;
+
+    for (unsigned int y = top; y < bottom; y++) {
+        for (unsigned int x = 0; x < m_width; x++) {
+            dst[4 * x + 0] = src[m_bpp * x + m_bPos];
+            dst[4 * x + 1] = src[m_bpp * x + m_gPos];
+            dst[4 * x + 2] = src[m_bpp * x + m_rPos];
+            dst[4 * x + 3] = 0xff;
+        }
+
+        src += m_stride;
+        dst += m_width * 4;
+    }
+}
+
+void GenericConverter::convertYUVPacked(const Image *srcImage, unsigned char *dst,
+                                        unsigned int top, unsigned int bottom) const
+{
+    const unsigned char *src = srcImage->data(0).data();
+    unsigned int crPos = (m_cbPos + 2) % 4;
+    unsigned int dstStride = m_width * 4;
+
+    for (unsigned int y = top; y < bottom; y++) {
+        unsigned char *line = dst + (y - top) * dstStride;
+
+        for (unsigned int x = 0; x < m_width; x += 2) {
+            unsigned int cb = src[y * m_stride + x * 2 + m_cbPos];
+            unsigned int cr = src[y * m_stride + x * 2 + crPos];
+
+            FormatConverterSimd::yuvToBgra(src[y * m_stride + x * 2 + m_yPos],
+                                           cb, cr, m_yuvTables, &line[4 * x]);
+            FormatConverterSimd::yuvToBgra(src[y * m_stride + x * 2 + m_yPos + 2],
+                                           cb, cr, m_yuvTables, &line[4 * x + 4]);
+        }
+    }
+}
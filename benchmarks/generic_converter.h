@@ -0,0 +1,55 @@
+#ifndef GENERIC_CONVERTER_H
+#define GENERIC_CONVERTER_H
+
+#include <QSize>
+
+#include <libcamera/color_space.h>
+#include <libcamera/pixel_format.h>
+
+#include "format_converter_simd.h"
+
+class Image;
+class QImage;
+
+/*
+ * The RGB and packed YUV conversion loops FormatConverter had before its per
+ * format kernels, reading the layout from members at every sample. Only
+ * kept for the benchmark to measure the specialised kernels against, and
+ * for the converter test to check they still match. Converts at full size
+ * and unoriented, in bands on the shared worker pool.
+ */
+class GenericConverter
+{
+public:
+    /* Returns false for formats other than RGB and packed YUV */
+    bool configure(const libcamera::PixelFormat &format, const QSize &size,
+                   unsigned int stride, const libcamera::ColorSpace &colorSpace);
+
+    void setParallelism(unsigned int threads);
+
+    /* dst must be a Format_RGB32 image of the configured size */
+    void convert(const Image *src, QImage *dst) const;
+
+private:
+    void convertRGB(const Image *src, unsigned char *dst,
+                    unsigned int top, unsigned int bottom) const;
+    void convertYUVPacked(const Image *src, unsigned char *dst,
+                          unsigned int top, unsigned int bottom) const;
+
+    bool m_yuv = false;
+    unsigned int m_width = 0;
+    unsigned int m_height = 0;
+    unsigned int m_stride = 0;
+    unsigned int m_threads = 1;
+
+    unsigned int m_bpp = 0;
+    unsigned int m_rPos = 0;
+    unsigned int m_gPos = 0;
+    unsigned int m_bPos = 0;
+    unsigned int m_yPos = 0;
+    unsigned int m_cbPos = 0;
+
+    FormatConverterSimd::YuvTables m_yuvTables;
+};
+
+#endif // GENERIC_CONVERTER_H
@@ -39,6 +39,7 @@ BuildRequires:  libexif-devel
 BuildRequires:  desktop-file-utils
 BuildRequires:  pkgconfig(libcamera)
 BuildRequires:  opencv-devel
+BuildRequires:  pkgconfig(libjpeg)
 BuildRequires:  qt6-rpm-macros
 BuildRequires:  kf6-extra-cmake-modules
 BuildRequires:  kf6-kcoreaddons-devel
@@ -0,0 +1,118 @@
+#include "analysisframe.h"
+
+#include <algorithm>
+
+#include <libcamera/formats.h>
+
+#include "image.h"
+
+AnalysisFrame AnalysisFrame::fromImage(const Image *image,
+                                       const libcamera::PixelFormat &format,
+                                       const QSize &size, unsigned int stride)
+{
+    AnalysisFrame frame;
+    unsigned int offset = 0;
+
+    if (!image || size.isEmpty())
+        return frame;
+
+    switch (format) {
+    case libcamera::formats::NV12:
+    case libcamera::formats::NV21:
+    case libcamera::formats::NV16:
+    case libcamera::formats::NV61:
+    case libcamera::formats::NV24:
+    case libcamera::formats::NV42:
+    case libcamera::formats::YUV420:
+    case libcamera::formats::YVU420:
+    case libcamera::formats::YUV422:
+    case libcamera::formats::R8:
+        frame.m_pixelStep = 1;
+        break;
+    case libcamera::formats::YUYV:
+    case libcamera::formats::YVYU:
+        frame.m_pixelStep = 2;
+        break;
+    case libcamera::formats::UYVY:
+    case libcamera::formats::VYUY:
+        frame.m_pixelStep = 2;
+        offset = 1;
+        break;
+    default:
+        return frame;
+    }
+
+    frame.m_data = image->data(0).data() + offset;
+    frame.m_stride = stride;
+    frame.m_size = size;
+
+    return frame;
+}
+
+AnalysisFrame AnalysisFrame::fromQImage(const QImage &image)
+{
+    AnalysisFrame frame;
+
+    if (image.isNull())
+        return frame;
+
+    QImage grey = image.convertToFormat(QImage::Format_Grayscale8);
+    unsigned int width = grey.width();
+
+    frame.m_storage = std::make_shared<std::vector<uint8_t>>(width * grey.height());
+    for (int y = 0; y < grey.height(); y++)
+        std::copy_n(grey.constScanLine(y), width, frame.m_storage->data() + y * width);
+
+    frame.m_data = frame.m_storage->data();
+    frame.m_stride = width;
+    frame.m_size = grey.size();
+
+    return frame;
+}
+
+AnalysisFrame AnalysisFrame::subsampled(unsigned int factor) const
+{
+    if (isNull() || factor == 0)
+        return AnalysisFrame();
+
+    if (factor == 1 && isContiguous())
+        return *this;
+
+    unsigned int width = m_size.width() / factor;
+    unsigned int height = m_size.height() / factor;
+    unsigned int area = factor * factor;
+
+    AnalysisFrame frame;
+    frame.m_storage = std::make_shared<std::vector<uint8_t>>(width * height);
+    frame.m_data = frame.m_storage->data();
+    frame.m_stride = width;
+    frame.m_size = QSize(width, height);
+
+    /* Sum factor source rows per output row, then average the columns. */
+    std::vector<uint16_t> sums(width * factor);
+    uint8_t *dst = frame.m_storage->data();
+
+    for (unsigned int y = 0; y < height; y++) {
+        std::fill(sums.begin(), sums.end(), 0);
+
+        for (unsigned int i = 0; i < factor; i++) {
+            const uint8_t *src = m_data + (y * factor + i) * m_stride;
+
+            for (unsigned int x = 0; x < width * factor; x++)
+                sums[x] += src[x * m_pixelStep];
+        }
+
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned int sum = area / 2;
+
+            for (unsigned int i = 0; i < factor; i++)
+                sum += sums[x * factor + i];
+
+            dst[x] = sum / area;
+        }
+
+        dst += width;
+    }
+
+    return frame;
+}
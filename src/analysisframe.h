@@ -0,0 +1,60 @@
+#ifndef ANALYSISFRAME_H
+#define ANALYSISFRAME_H
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include <QImage>
+#include <QSize>
+
+#include <libcamera/pixel_format.h>
+
+class Image;
+
+/*
+ * 8-bit luma view of a frame for analysis consumers such as face detection.
+ * For YUV streams it points straight at the mapped Y plane, so building one
+ * costs nothing; it is only valid while the frame stays mapped and queued.
+ * Packed YUV luma is addressed with a pixel step of 2.
+ */
+class AnalysisFrame
+{
+public:
+    AnalysisFrame() = default;
+
+    /* Null unless format carries a usable luma (or grey) plane. */
+    static AnalysisFrame fromImage(const Image *image,
+                                   const libcamera::PixelFormat &format,
+                                   const QSize &size, unsigned int stride);
+    /* Grey copy of an RGB image, for streams without a luma plane. */
+    static AnalysisFrame fromQImage(const QImage &image);
+
+    bool isNull() const { return !m_data; }
+
+    const uint8_t *data() const { return m_data; }
+    unsigned int stride() const { return m_stride; }
+    unsigned int pixelStep() const { return m_pixelStep; }
+    QSize size() const { return m_size; }
+
+    /* Contiguous rows, directly usable as a single channel matrix. */
+    bool isContiguous() const { return m_pixelStep == 1; }
+
+    /*
+     * Box filter by factor in both directions into a frame owning its
+     * samples. A factor of 1 still packs a stepped frame, but returns
+     * contiguous frames as is, without copying.
+     */
+    AnalysisFrame subsampled(unsigned int factor) const;
+
+private:
+    const uint8_t *m_data = nullptr;
+    unsigned int m_stride = 0;
+    unsigned int m_pixelStep = 1;
+    QSize m_size;
+
+    /* Backing store of copies, shared so frames stay cheap to pass on */
+    std::shared_ptr<std::vector<uint8_t>> m_storage;
+};
+
+#endif // ANALYSISFRAME_H
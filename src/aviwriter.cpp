@@ -0,0 +1,287 @@
+#include "aviwriter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#include <QDebug>
+
+namespace {
+
+/*
+ * Offsets of the header fields completed by finish(). Index entries are
+ * relative to the "movi" fourcc.
+ */
+constexpr qint64 AvihMaxBytesPerSec = 36;
+constexpr qint64 AvihTotalFrames = 48;
+constexpr qint64 AvihSuggestedBufferSize = 60;
+constexpr qint64 StrhLength = 140;
+constexpr qint64 StrhSuggestedBufferSize = 144;
+constexpr qint64 MoviListSize = 216;
+constexpr qint64 MoviStart = 220;
+
+constexpr uint32_t AvifHasIndex = 0x10;
+constexpr uint32_t AviifKeyframe = 0x10;
+
+/* RIFF sizes are 32 bit */
+constexpr qint64 MaxFileSize = 0xffffffffLL;
+
+void put16(std::vector<uint8_t> &out, uint16_t value)
+{
+    out.push_back(value & 0xff);
+    out.push_back(value >> 8);
+}
+
+void put32(std::vector<uint8_t> &out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        out.push_back((value >> (8 * i)) & 0xff);
+    }
+}
+
+void putFourcc(std::vector<uint8_t> &out, const char *fourcc)
+{
+    out.insert(out.end(), fourcc, fourcc + 4);
+}
+
+} // namespace
+
+AviWriter::AviWriter() = default;
+
+AviWriter::~AviWriter()
+{
+    if (m_file.isOpen()) {
+        finish();
+    }
+}
+
+bool AviWriter::open(const QString &fileName, const QSize &size, double fps, const char fourcc[4])
+{
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Unable to open" << fileName << m_file.errorString();
+        return false;
+    }
+
+    m_fps = fps > 0 ? fps : 30;
+    m_size = size;
+    m_firstTimestamp = -1;
+    m_nextSlot = 0;
+    m_skipped = 0;
+    m_repeated = 0;
+    m_maxFrameSize = 0;
+    m_index.clear();
+
+    const uint32_t rate = std::lround(m_fps * 1000);
+    std::vector<uint8_t> header;
+    header.reserve(MoviStart + 4);
+
+    putFourcc(header, "RIFF");
+    put32(header, 0);
+    putFourcc(header, "AVI ");
+
+    putFourcc(header, "LIST");
+    put32(header, 192);
+    putFourcc(header, "hdrl");
+
+    // Main header
+    putFourcc(header, "avih");
+    put32(header, 56);
+    put32(header, std::lround(1000000 / m_fps));
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, AvifHasIndex);
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, 1);
+    put32(header, 0);
+    put32(header, size.width());
+    put32(header, size.height());
+    for (int i = 0; i < 4; i++) {
+        put32(header, 0);
+    }
+
+    putFourcc(header, "LIST");
+    put32(header, 116);
+    putFourcc(header, "strl");
+
+    // Stream header, the rate is in thousandths of a frame per second
+    putFourcc(header, "strh");
+    put32(header, 56);
+    putFourcc(header, "vids");
+    putFourcc(header, fourcc);
+    put32(header, 0);
+    put16(header, 0);
+    put16(header, 0);
+    put32(header, 0);
+    put32(header, 1000);
+    put32(header, rate);
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, 0xffffffff);
+    put32(header, 0);
+    put16(header, 0);
+    put16(header, 0);
+    put16(header, size.width());
+    put16(header, size.height());
+
+    // Stream format, a BITMAPINFOHEADER
+    putFourcc(header, "strf");
+    put32(header, 40);
+    put32(header, 40);
+    put32(header, size.width());
+    put32(header, size.height());
+    put16(header, 1);
+    put16(header, 24);
+    putFourcc(header, fourcc);
+    put32(header, size.width() * size.height() * 3);
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, 0);
+
+    putFourcc(header, "LIST");
+    put32(header, 0);
+    putFourcc(header, "movi");
+
+    Q_ASSERT(qint64(header.size()) == MoviStart + 4);
+
+    if (m_file.write(reinterpret_cast<const char *>(header.data()), header.size()) != qint64(header.size())) {
+        qWarning() << "Unable to write" << fileName << m_file.errorString();
+        m_file.close();
+        return false;
+    }
+
+    return true;
+}
+
+bool AviWriter::writeFrame(const uint8_t *data, uint32_t size, int64_t timestamp)
+{
+    if (!m_file.isOpen()) {
+        return false;
+    }
+
+    if (m_firstTimestamp < 0) {
+        m_firstTimestamp = timestamp;
+    }
+
+    const int64_t slot = std::llround((timestamp - m_firstTimestamp) * m_fps / 1e9);
+    if (slot < m_nextSlot) {
+        m_skipped++;
+        return true;
+    }
+
+    // Hold the previous frame over the slots of frames that never came
+    while (m_nextSlot < slot) {
+        if (!writeChunk(nullptr, 0, false)) {
+            return false;
+        }
+        m_repeated++;
+    }
+
+    return writeChunk(data, size, true);
+}
+
+bool AviWriter::writeChunk(const uint8_t *data, uint32_t size, bool key)
+{
+    const qint64 offset = m_file.pos();
+    const uint32_t padded = size + (size & 1);
+
+    // Room must remain for this chunk, the index and its own entry
+    if (offset + 8 + padded + 8 + 16 * qint64(m_index.size() + 1) > MaxFileSize) {
+        qWarning() << "AVI size limit reached in" << m_file.fileName();
+        return false;
+    }
+
+    std::vector<uint8_t> header;
+    putFourcc(header, "00dc");
+    put32(header, size);
+
+    bool ok = m_file.write(reinterpret_cast<const char *>(header.data()), header.size()) == 8;
+    if (ok && size > 0) {
+        ok = m_file.write(reinterpret_cast<const char *>(data), size) == size;
+    }
+    if (ok && padded != size) {
+        ok = m_file.write("\0", 1) == 1;
+    }
+    if (!ok) {
+        qWarning() << "Unable to write" << m_file.fileName() << m_file.errorString();
+        return false;
+    }
+
+    m_index.push_back({ uint32_t(offset - MoviStart), size, key });
+    m_maxFrameSize = std::max(m_maxFrameSize, size);
+    m_nextSlot++;
+    return true;
+}
+
+bool AviWriter::finish()
+{
+    if (!m_file.isOpen()) {
+        return false;
+    }
+
+    const qint64 moviEnd = m_file.pos();
+
+    std::vector<uint8_t> index;
+    index.reserve(8 + 16 * m_index.size());
+    putFourcc(index, "idx1");
+    put32(index, 16 * m_index.size());
+    for (const IndexEntry &entry : m_index) {
+        putFourcc(index, "00dc");
+        put32(index, entry.key ? AviifKeyframe : 0);
+        put32(index, entry.offset);
+        put32(index, entry.size);
+    }
+
+    bool ok = m_file.write(reinterpret_cast<const char *>(index.data()), index.size()) == qint64(index.size());
+    const qint64 end = m_file.pos();
+
+    // Fill in the sizes and counts known now
+    auto patch = [&](qint64 offset, uint32_t value) {
+        std::vector<uint8_t> field;
+        put32(field, value);
+        ok = ok && m_file.seek(offset) &&
+             m_file.write(reinterpret_cast<const char *>(field.data()), 4) == 4;
+    };
+
+    const uint32_t frames = m_index.size();
+    const uint32_t bufferSize = m_maxFrameSize + 8;
+    patch(4, end - 8);
+    patch(AvihMaxBytesPerSec, std::min<double>(bufferSize * m_fps, 0xffffffff));
+    patch(AvihTotalFrames, frames);
+    patch(AvihSuggestedBufferSize, bufferSize);
+    patch(StrhLength, frames);
+    patch(StrhSuggestedBufferSize, bufferSize);
+    patch(MoviListSize, moviEnd - MoviListSize - 4);
+
+    ok = m_file.flush() && ok;
+    m_file.close();
+
+    if (!ok) {
+        qWarning() << "Unable to complete" << m_file.fileName();
+    }
+
+    return ok;
+}
+
+bool AviWriter::isOpen() const
+{
+    return m_file.isOpen();
+}
+
+uint32_t AviWriter::frameCount() const
+{
+    return m_index.size();
+}
+
+uint32_t AviWriter::skippedFrames() const
+{
+    return m_skipped;
+}
+
+uint32_t AviWriter::repeatedFrames() const
+{
+    return m_repeated;
+}
@@ -0,0 +1,63 @@
+#ifndef AVIWRITER_H
+#define AVIWRITER_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <QFile>
+#include <QSize>
+#include <QString>
+
+/*
+ * Muxes compressed video frames into an AVI 1.0 file, one video stream of
+ * fourcc (MJPG by default). AVI plays at a constant rate, so frames are
+ * placed by their capture timestamp: a frame goes in the slot of the
+ * nominal rate closest to its time since the first frame, empty chunks
+ * fill the slots of frames that never came, players hold the previous
+ * frame over them, and a frame landing in a slot already taken is skipped.
+ * The headers and index are completed by finish(), the RIFF size limits a
+ * file to a little under 4 GiB.
+ */
+class AviWriter
+{
+public:
+    AviWriter();
+    ~AviWriter();
+
+    bool open(const QString &fileName, const QSize &size, double fps,
+              const char fourcc[4] = "MJPG");
+    /*
+     * Add a frame captured at timestamp nanoseconds. Returns false when it
+     * could not be written, a frame skipped for its timing is not an error.
+     */
+    bool writeFrame(const uint8_t *data, uint32_t size, int64_t timestamp);
+    /* Write the index and complete the headers */
+    bool finish();
+
+    bool isOpen() const;
+    /* Slots written, including those filled with empty chunks */
+    uint32_t frameCount() const;
+    uint32_t skippedFrames() const;
+    uint32_t repeatedFrames() const;
+
+private:
+    struct IndexEntry {
+        uint32_t offset;
+        uint32_t size;
+        bool key;
+    };
+
+    bool writeChunk(const uint8_t *data, uint32_t size, bool key);
+
+    QFile m_file;
+    double m_fps = 30;
+    QSize m_size;
+    int64_t m_firstTimestamp = -1;
+    uint32_t m_nextSlot = 0;
+    uint32_t m_skipped = 0;
+    uint32_t m_repeated = 0;
+    uint32_t m_maxFrameSize = 0;
+    std::vector<IndexEntry> m_index;
+};
+
+#endif // AVIWRITER_H
@@ -1,9 +1,97 @@
 
-#include <QCoreApplication>
-#include <QFile>
+#include <QDir>
+#include <QFileInfo>
 #include "cameraproxy.h"
-#include "encoder_jpeg.h"
 #include "settings.h"
+#include "stillencoder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <optional>
+#include <time.h>
+
+#include <libcamera/property_ids.h>
+
+// Bounds the zero shutter lag ring whatever the memory budget
+static constexpr unsigned int MaxZslDepth = 8;
+
+// Stills held for a saver slot, each keeps a capture buffer
+static constexpr int MaxQueuedStills = 2;
+
+// Adds the time spent in a scope to a total, in nanoseconds. A timer nested
+// in one for the same total does nothing, so that time is only counted once
+class ScopeTimer
+{
+public:
+    explicit ScopeTimer(qint64 *total)
+        : m_total(s_active == total ? nullptr : total)
+        , m_previous(s_active)
+    {
+        if (m_total) {
+            s_active = m_total;
+            m_timer.start();
+        }
+    }
+
+    ~ScopeTimer()
+    {
+        if (m_total) {
+            *m_total += m_timer.nsecsElapsed();
+            s_active = m_previous;
+        }
+    }
+
+private:
+    static thread_local qint64 *s_active;
+
+    qint64 *m_total;
+    qint64 *m_previous;
+    QElapsedTimer m_timer;
+};
+
+thread_local qint64 *ScopeTimer::s_active = nullptr;
+
+// Raw viewfinder frames are processed with the sensor black level and the
+// white balance gains of their request, read without allocating. Gains are
+// rounded, so the converter only rebuilds its tables when they really move
+static FormatConverter::BayerParameters bayerParameters(const libcamera::ControlList &metadata)
+{
+    FormatConverter::BayerParameters params;
+
+    if (auto levels = metadata.get(libcamera::controls::SensorBlackLevels)) {
+        int64_t sum = 0;
+        for (int32_t level : *levels) {
+            sum += level;
+        }
+        params.blackLevel = std::clamp<int64_t>(sum / 4, 0, 65535);
+    }
+
+    if (auto gains = metadata.get(libcamera::controls::ColourGains)) {
+        params.redGain = std::round((*gains)[0] * 64) / 64;
+        params.blueGain = std::round((*gains)[1] * 64) / 64;
+    }
+
+    return params;
+}
+
+// Frames are stamped with the sensor timestamp, on CLOCK_BOOTTIME, where
+// the pipeline reports one, and with the buffer timestamp, on
+// CLOCK_MONOTONIC, otherwise. clock is set to the one used, presses are
+// stamped with it
+static int64_t frameTimestamp(const libcamera::Request *request, const libcamera::FrameBuffer *buffer,
+                              clockid_t *clock = nullptr)
+{
+    std::optional<int64_t> sensor;
+    if (request) {
+        sensor = request->metadata().get(libcamera::controls::SensorTimestamp);
+    }
+
+    if (clock) {
+        *clock = sensor ? CLOCK_BOOTTIME : CLOCK_MONOTONIC;
+    }
+    return sensor.value_or(buffer ? buffer->metadata().timestamp : 0);
+}
 
 QDebug operator<< (QDebug d, const libcamera::Size &sz) {
     d << "Size:" << sz.width << "x" << sz.height;
@@ -28,24 +116,39 @@ CameraProxy::CameraProxy(QObject *parent)
     : QObject{parent}
 {
     qDebug() << Q_FUNC_INFO;
+
+    m_stillSaver.setWriteBehindCache(&m_writeBehind);
+    connect(&m_stillSaver, &StillSaver::saved, this, &CameraProxy::stillSaved);
+    connect(&m_stillSaver, &StillSaver::progress, this, &CameraProxy::stillSaveProgress);
+    connect(&m_stillSaver, &StillSaver::pendingChanged, this, &CameraProxy::pendingStillsChanged);
+    // Queued, save() emits it and must not be reentered
+    connect(&m_stillSaver, &StillSaver::pendingChanged, this, &CameraProxy::flushQueuedStills,
+            Qt::QueuedConnection);
+    connect(&m_videoRecorder, &VideoRecorder::statsChanged, this, &CameraProxy::recordingStatsChanged);
+    connect(&m_videoRecorder, &VideoRecorder::finished, this, &CameraProxy::recordingDone);
+    connect(&m_livePhoto, &LivePhoto::saved, this, &CameraProxy::livePhotoSaved);
+
+    connect(&m_doneWake, &WakeNotifier::woken, this, &CameraProxy::processCapture);
+    connect(&m_viewfinderWake, &WakeNotifier::woken, this, &CameraProxy::drainViewfinder,
+            Qt::DirectConnection);
+    m_viewfinderWake.moveToThread(&m_captureThread);
+    m_captureThread.setObjectName(QStringLiteral("Capture"));
+    m_captureThread.start(QThread::HighPriority);
 }
 
 CameraProxy::~CameraProxy()
 {
     qDebug() << Q_FUNC_INFO;
-    m_currentCamera->stop();
-    m_cameraManager.reset();
-}
-
-bool CameraProxy::event(QEvent *e)
-{
-    //qDebug() << Q_FUNC_INFO;
-    if (e->type() == CaptureEvent::type()) {
-        processCapture();
-        return true;
+    if (m_currentCamera) {
+        m_currentCamera->stop();
     }
-
-    return QObject::event(e);
+    // Its socket notifier has to be torn down on a running thread
+    QMetaObject::invokeMethod(&m_viewfinderWake, [this]() {
+        m_viewfinderWake.moveToThread(thread());
+    }, Qt::BlockingQueuedConnection);
+    m_captureThread.quit();
+    m_captureThread.wait();
+    m_cameraManager.reset();
 }
 
 void CameraProxy::setCameraManager(std::shared_ptr<libcamera::CameraManager> cm)
@@ -84,7 +187,8 @@ void CameraProxy::setStillFormat(const QString &format)
 
     Q_EMIT formatChanged();
 
-    if (oldstate == CapturingViewFinder) {
+    // Stopping ended a recording, the viewfinder comes back without it
+    if (oldstate == CapturingViewFinder || oldstate == Recording) {
         startViewFinder();
     }
 }
@@ -108,20 +212,106 @@ void CameraProxy::setResolution(const QSize &res)
 
     Q_EMIT resolutionChanged();
 
-    if (oldstate == CapturingViewFinder) {
+    // Stopping ended a recording, the viewfinder comes back without it
+    if (oldstate == CapturingViewFinder || oldstate == Recording) {
         startViewFinder();
     }
 }
 
-void CameraProxy::setFaceDetectionEnabled(bool enabled)
+void CameraProxy::setZslEnabled(bool enabled)
 {
-    m_enableFaceDetection = enabled;
+    if (m_zslEnabled == enabled) {
+        return;
+    }
 
-    if (!m_enableFaceDetection) {
-        m_rects.clear();
+    m_zslEnabled = enabled;
+
+    // The ring needs extra still buffers, allocated when the camera starts
+    if (m_state == CapturingViewFinder) {
+        startViewFinder();
+    }
+}
+
+void CameraProxy::setZslMemoryBudget(int megabytes)
+{
+    m_zslMemoryBudget = qint64(std::max(0, megabytes)) * 1024 * 1024;
+}
+
+int CameraProxy::zslDepth() const
+{
+    return m_zslDepth;
+}
+
+QStringList CameraProxy::stillEncoders() const
+{
+    return StillEncoder::names();
+}
+
+void CameraProxy::setStillEncoder(const QString &name)
+{
+    if (!StillEncoder::names().contains(name)) {
+        qWarning() << "Still encoder" << name << "is not available, keeping" << m_stillEncoder;
+        return;
+    }
+    m_stillEncoder = name;
+}
+
+int CameraProxy::defaultStillQuality(const QString &name) const
+{
+    return StillEncoder::defaultQuality(name);
+}
+
+void CameraProxy::setStillQuality(int quality)
+{
+    m_stillQuality = quality;
+}
+
+QStringList CameraProxy::rawCompressions() const
+{
+    return RawDump::compressions();
+}
+
+void CameraProxy::setRawCompression(const QString &name)
+{
+    if (!RawDump::compressions().contains(name)) {
+        qWarning() << "Raw compression" << name << "is not available, writing raw dumps uncompressed";
+    }
+    m_rawCompression = RawDump::compression(name);
+}
+
+void CameraProxy::setWriteBehindEnabled(bool enabled)
+{
+    m_writeBehind.setEnabled(enabled);
+}
+
+void CameraProxy::setWriteBehindBudget(int megabytes)
+{
+    m_writeBehind.setBudget(qint64(std::max(0, megabytes)) * 1024 * 1024);
+}
+
+WriteBehindCache *CameraProxy::writeBehind()
+{
+    return &m_writeBehind;
+}
+
+void CameraProxy::setLivePhotoEnabled(bool enabled)
+{
+    m_livePhotoEnabled = enabled;
+    if (!enabled) {
+        m_livePhoto.clear();
     }
 }
 
+bool CameraProxy::livePhotoSupported() const
+{
+    return !m_singleStream;
+}
+
+void CameraProxy::setFaceDetectionEnabled(bool enabled)
+{
+    m_enableFaceDetection = enabled;
+}
+
 std::vector<libcamera::Size> CameraProxy::supportedResoluions(QString format)
 {
     return m_stillFormats[libcamera::PixelFormat::fromString(format.toStdString())];
@@ -256,6 +446,8 @@ bool CameraProxy::configureCamera()
                 << m_vfStreamConfig->toString().c_str();
     }
 
+    configureZsl();
+
     if (m_currentCamera->configure(m_config.get()) < 0) {
         qInfo() << "Failed to configure camera";
         return false;
@@ -264,6 +456,96 @@ bool CameraProxy::configureCamera()
     return true;
 }
 
+/*
+ * Size the zero shutter lag ring from the memory budget and the validated
+ * still frame size, and ask for enough still buffers to hold it plus one being
+ * captured and one being saved.
+ */
+void CameraProxy::configureZsl()
+{
+    unsigned int depth = 0;
+
+    if (m_zslEnabled && m_vfStreamConfig && m_stillStreamConfig &&
+        m_stillStreamConfig->frameSize > 0) {
+        unsigned int bufferCount = m_stillStreamConfig->bufferCount;
+
+        depth = std::clamp<qint64>(m_zslMemoryBudget / m_stillStreamConfig->frameSize,
+                                   1, MaxZslDepth);
+        m_stillStreamConfig->bufferCount = depth + 2;
+
+        if (m_config->validate() == libcamera::CameraConfiguration::Invalid) {
+            m_stillStreamConfig->bufferCount = bufferCount;
+            m_config->validate();
+        }
+
+        // The pipeline may have settled on fewer buffers
+        if (m_stillStreamConfig->bufferCount < 2) {
+            depth = 0;
+        } else {
+            depth = std::clamp(m_stillStreamConfig->bufferCount - 2, 1u, depth);
+        }
+
+        qDebug() << "Zero shutter lag ring of" << depth << "frames,"
+                 << m_stillStreamConfig->bufferCount << "still buffers";
+    }
+
+    if (m_zslDepth != depth) {
+        m_zslDepth = depth;
+        Q_EMIT zslDepthChanged();
+    }
+}
+
+void CameraProxy::pushZslFrame(libcamera::FrameBuffer *buffer)
+{
+    ZslFrame frame;
+    frame.buffer = buffer;
+    frame.timestamp = frameTimestamp(buffer->request(), buffer);
+    frame.exif = stillExif(buffer);
+
+    QMutexLocker locker(&m_mutex);
+    while (m_zslRing.size() >= m_zslDepth) {
+        m_freeBuffers[m_stillStream].enqueue(m_zslRing.front().buffer);
+        m_zslRing.pop_front();
+    }
+
+    m_zslRing.push_back(std::move(frame));
+}
+
+CameraProxy::ZslFrame CameraProxy::takeZslFrame(int64_t timestamp)
+{
+    auto closest = std::min_element(m_zslRing.begin(), m_zslRing.end(),
+                                    [timestamp](const ZslFrame &a, const ZslFrame &b) {
+                                        return std::abs(a.timestamp - timestamp) <
+                                               std::abs(b.timestamp - timestamp);
+                                    });
+    if (closest == m_zslRing.end()) {
+        return {};
+    }
+
+    qDebug() << "Zero shutter lag frame" << (closest->timestamp - timestamp) / 1000000 << "ms from the press";
+
+    ZslFrame frame = std::move(*closest);
+    m_zslRing.erase(closest);
+    return frame;
+}
+
+// Now, on the clock the latest frames were stamped with
+int64_t CameraProxy::pressTimestamp() const
+{
+    timespec ts;
+    clock_gettime(m_frameClock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void CameraProxy::clearZslRing()
+{
+    QMutexLocker locker(&m_mutex);
+    for (const ZslFrame &frame : m_zslRing) {
+        m_freeBuffers[m_stillStream].enqueue(frame.buffer);
+    }
+    m_zslRing.clear();
+}
+
 void CameraProxy::cacheFormats(libcamera::StreamRole role)
 {
     qDebug() << Q_FUNC_INFO << (int)role;
@@ -341,7 +623,7 @@ void CameraProxy::setViewFinder(ViewFinder2D *vf)
     qDebug() << Q_FUNC_INFO << vf;
     m_viewFinder = vf;
     connect(m_viewFinder, &ViewFinder2D::renderComplete,
-            this, &CameraProxy::renderComplete);
+            this, &CameraProxy::viewfinderRendered, Qt::DirectConnection);
 }
 
 void CameraProxy::startViewFinder()
@@ -377,6 +659,12 @@ void CameraProxy::startViewFinder()
         }
     }
 
+    // Undo the orientation libcamera could not correct with sensor flips, and
+    // mirror front camera previews
+    bool front = m_currentCamera->properties().get(libcamera::properties::Location) ==
+                 libcamera::properties::CameraLocationFront;
+    m_viewFinder->setOrientation(m_config->orientation, front);
+
     // Configure the viewfinder. If no color space is reported, default to sYCC.
     ret = m_viewFinder->setFormat(m_vfStreamConfig->pixelFormat,
                                   QSize(m_vfStreamConfig->size.width, m_vfStreamConfig->size.height),
@@ -440,6 +728,8 @@ void CameraProxy::startViewFinder()
         m_requests.push_back(std::move(request));
     }
 
+    resetQueues(m_requests.size());
+
     ret = m_currentCamera->start();
     if (ret) {
         qInfo() << "Failed to start capture";
@@ -464,21 +754,45 @@ void CameraProxy::stop()
     qDebug() << Q_FUNC_INFO;
     if (m_currentCamera) {
         qDebug() << "stopping";
+        m_videoRecorder.stop();
+        // Live photo clips wait for the frames after their press, which come
+        // in once the viewfinder restarts. The ring is kept for presses then
         setState(Stopping);
 
         m_currentCamera->stop();
 
         m_currentCamera->requestCompleted.disconnect(this);
 
+        // Frames on the capture thread still reference the mapped buffers,
+        // emptying its queue waits for the one it may be processing
+        resetQueues(0);
+        m_session++;
+
+        // Stills being saved still reference the mapped buffers, those
+        // waiting for a slot are saved first. A slot is free once idle
+        while (!m_queuedStills.isEmpty()) {
+            m_stillSaver.waitForIdle();
+            m_stillSaver.save(m_queuedStills.dequeue());
+        }
+        m_stillSaver.waitForIdle();
+        m_savingBuffers.clear();
+        m_zslRing.clear();
+        m_zslPending = false;
+
+        // A burst ends with the session, once its last saves are reported
+        if (m_burstActive) {
+            m_burstRemaining = 0;
+            m_stillsInFlight = 0;
+            QMetaObject::invokeMethod(this, &CameraProxy::maybeFinishBurst, Qt::QueuedConnection);
+        }
+
         m_mappedBuffers.clear();
         m_requests.clear();
-        m_freeQueue.clear();
 
         delete m_allocator;
         m_allocator = nullptr;
 
         m_freeBuffers.clear();
-        m_doneQueue.clear();
         setState(Stopped);
     }
 }
@@ -487,100 +801,226 @@ void CameraProxy::stillCapture(const QString &filename)
 {
     qDebug() << Q_FUNC_INFO;
 
+    // The shutter honours back-pressure from the saver rather than block
+    if (stillBusy()) {
+        qWarning() << "Still save pipeline full, ignoring the press";
+        Q_EMIT stillDropped(filename + StillEncoder::suffix(m_stillEncoder));
+        return;
+    }
+
     m_saveFileName = filename;
 
-    if (!m_singleStream) {
-        m_captureStill = true;
+    // The clip is written once the frames after the press are in
+    if (m_livePhotoEnabled && livePhotoSupported()) {
+        m_livePhoto.capture(m_saveFileName + QStringLiteral(".avi"), pressTimestamp());
+    }
+
+    if (m_singleStream) {
+        startStillStream();
+    } else if (m_zslDepth > 0) {
+        // Save the ring frame exposed closest to the press, or the next one
+        // to arrive if the ring has not filled yet
+        ZslFrame frame = takeZslFrame(pressTimestamp());
+        if (frame.buffer) {
+            saveStill(frame.buffer, m_saveFileName, frame.exif);
+        } else {
+            m_zslPending = true;
+        }
     } else {
-        m_frame = 0;
-        int ret;
+        m_captureStill = true;
+    }
+}
 
-        stop();
+void CameraProxy::startBurst(const QString &filename, int count)
+{
+    qDebug() << Q_FUNC_INFO << count;
+
+    if (m_burstActive) {
+        return;
+    }
 
-        buildConfiguration({libcamera::StreamRole::StillCapture}, true);
+    m_saveFileName = filename;
 
-        // Set the preferred still format and size
-        m_stillStreamConfig->pixelFormat = libcamera::PixelFormat::fromString(m_currentStillFormat.toStdString());
-        m_stillStreamConfig->size = m_currentStillResolution;
+    // Restarting the camera for a single stream stops it first, which would
+    // end the burst straight away
+    if (m_singleStream) {
+        startStillStream();
+    }
 
-        libcamera::CameraConfiguration::Status validation = m_config->validate();
-        if (validation == libcamera::CameraConfiguration::Invalid) {
-            qWarning() << "Failed to create valid camera configuration";
-            return;
-        }
+    // Burst frames are captured fresh, give them the ring's buffers
+    clearZslRing();
+
+    m_burstActive = true;
+    m_burstRemaining = count > 0 ? count : -1;
+    m_burstIndex = 0;
+    m_burstSaved = 0;
+    m_burstDropped = 0;
+    m_burstShotsPerSecond = 0;
+    m_stillsInFlight = 0;
+    m_burstTimer.start();
+    Q_EMIT burstStatsChanged();
+}
 
-        if (validation == libcamera::CameraConfiguration::Adjusted) {
-            qInfo() << "Stream configuration adjusted to "
-                    << m_stillStreamConfig->toString().c_str();
-        }
+void CameraProxy::stopBurst()
+{
+    qDebug() << Q_FUNC_INFO;
 
-        ret = m_currentCamera->configure(m_config.get());
-        if (ret < 0) {
-            qInfo() << "Failed to configure camera";
-            return;
-        }
+    m_burstRemaining = 0;
+    maybeFinishBurst();
+}
 
-        ret = m_allocator->allocate(m_stillStream);
-        if (ret < 0) {
-            qWarning() << "Failed to allocate still capture buffers";
-            //TODO got error;
-            return;
-        }
+void CameraProxy::startRecording(const QString &filename)
+{
+    qDebug() << Q_FUNC_INFO << filename;
 
-        qDebug() << "Creating still buffers";
-        for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : m_allocator->buffers(m_stillStream)) {
-            qDebug() << "Still Mapping buffer " << buffer.get();
-            /* Map memory buffers and cache the mappings. */
-            std::unique_ptr<Image> image = Image::fromFrameBuffer(buffer.get(), Image::MapMode::ReadOnly);
-            assert(image != nullptr);
-            m_mappedBuffers[buffer.get()] = std::move(image);
+    if (m_state != CapturingViewFinder) {
+        qWarning() << "Recording needs a running viewfinder";
+        return;
+    }
 
-            /* Store buffers on the free list. */
-            m_freeBuffers[m_stillStream].enqueue(buffer.get());
+    m_videoRecorder.start(filename, recordingFrameRate());
+    setState(Recording);
+    Q_EMIT recordingStatsChanged();
+}
+
+void CameraProxy::stopRecording()
+{
+    qDebug() << Q_FUNC_INFO;
+
+    m_videoRecorder.stop();
+    if (m_state == Recording) {
+        setState(CapturingViewFinder);
+    }
+}
+
+// The fastest rate the sensor allows, the muxer holds frames that come slower
+double CameraProxy::recordingFrameRate() const
+{
+    const libcamera::ControlInfoMap &controls = m_currentCamera->controls();
+    auto limits = controls.find(libcamera::controls::FrameDurationLimits.id());
+    if (limits != controls.end()) {
+        int64_t minDuration = limits->second.min().get<int64_t>();
+        if (minDuration > 0) {
+            return std::clamp(1e6 / minDuration, 5.0, 60.0);
         }
+    }
 
-        m_requests.clear();
+    return 30;
+}
 
-        /* Create requests and fill them with buffers from the still stream. */
-        while (!m_freeBuffers[m_stillStream].isEmpty()) {
-            qDebug() << "Creating still request...";
-            libcamera::FrameBuffer *buffer = m_freeBuffers[m_stillStream].dequeue();
+void CameraProxy::recordingDone(const QString &path, bool ok)
+{
+    // The recorder ends a recording itself when storage fails
+    if (m_state == Recording && !m_videoRecorder.isRecording()) {
+        setState(CapturingViewFinder);
+    }
 
-            std::unique_ptr<libcamera::Request> request = m_currentCamera->createRequest();
-            if (!request) {
-                qWarning() << "Can't create request";
-                ret = -ENOMEM;
-                return;
-            }
+    Q_EMIT recordingFinished(path, ok);
+}
 
-            ret = request->addBuffer(m_stillStream, buffer);
-            if (ret < 0) {
-                qWarning() << "Can't set buffer for request";
-                return;
-            }
+int CameraProxy::recordingDropped() const
+{
+    return m_videoRecorder.droppedFrames();
+}
+
+double CameraProxy::recordingEncodeFps() const
+{
+    return m_videoRecorder.encodeFps();
+}
+
+void CameraProxy::startStillStream()
+{
+    m_frame = 0;
+    int ret;
 
-            m_requests.push_back(std::move(request));
+    stop();
+
+    buildConfiguration({libcamera::StreamRole::StillCapture}, true);
+
+    // Set the preferred still format and size
+    m_stillStreamConfig->pixelFormat = libcamera::PixelFormat::fromString(m_currentStillFormat.toStdString());
+    m_stillStreamConfig->size = m_currentStillResolution;
+
+    libcamera::CameraConfiguration::Status validation = m_config->validate();
+    if (validation == libcamera::CameraConfiguration::Invalid) {
+        qWarning() << "Failed to create valid camera configuration";
+        return;
+    }
+
+    if (validation == libcamera::CameraConfiguration::Adjusted) {
+        qInfo() << "Stream configuration adjusted to "
+                << m_stillStreamConfig->toString().c_str();
+    }
+
+    ret = m_currentCamera->configure(m_config.get());
+    if (ret < 0) {
+        qInfo() << "Failed to configure camera";
+        return;
+    }
+
+    ret = m_allocator->allocate(m_stillStream);
+    if (ret < 0) {
+        qWarning() << "Failed to allocate still capture buffers";
+        //TODO got error;
+        return;
+    }
+
+    qDebug() << "Creating still buffers";
+    for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : m_allocator->buffers(m_stillStream)) {
+        qDebug() << "Still Mapping buffer " << buffer.get();
+        /* Map memory buffers and cache the mappings. */
+        std::unique_ptr<Image> image = Image::fromFrameBuffer(buffer.get(), Image::MapMode::ReadOnly);
+        assert(image != nullptr);
+        m_mappedBuffers[buffer.get()] = std::move(image);
+
+        /* Store buffers on the free list. */
+        m_freeBuffers[m_stillStream].enqueue(buffer.get());
+    }
+
+    m_requests.clear();
+
+    /* Create requests and fill them with buffers from the still stream. */
+    while (!m_freeBuffers[m_stillStream].isEmpty()) {
+        qDebug() << "Creating still request...";
+        libcamera::FrameBuffer *buffer = m_freeBuffers[m_stillStream].dequeue();
+
+        std::unique_ptr<libcamera::Request> request = m_currentCamera->createRequest();
+        if (!request) {
+            qWarning() << "Can't create request";
+            ret = -ENOMEM;
+            return;
         }
 
-        ret = m_currentCamera->start();
-        if (ret) {
-            qInfo() << "Failed to start capture";
+        ret = request->addBuffer(m_stillStream, buffer);
+        if (ret < 0) {
+            qWarning() << "Can't set buffer for request";
             return;
         }
 
-        setState(CapturingStill);
+        m_requests.push_back(std::move(request));
+    }
 
-        m_currentCamera->requestCompleted.connect(this, &CameraProxy::requestComplete);
+    resetQueues(m_requests.size());
 
-        /* Queue all requests. */
-        for (std::unique_ptr<libcamera::Request> &request : m_requests) {
-            ret = m_currentCamera->queueRequest(request.get());
-            if (ret < 0) {
-                qWarning() << "Can't queue request";
-                return;
-            }
+    ret = m_currentCamera->start();
+    if (ret) {
+        qInfo() << "Failed to start capture";
+        return;
+    }
+
+    setState(CapturingStill);
+
+    m_currentCamera->requestCompleted.connect(this, &CameraProxy::requestComplete);
+
+    /* Queue all requests. */
+    for (std::unique_ptr<libcamera::Request> &request : m_requests) {
+        ret = m_currentCamera->queueRequest(request.get());
+        if (ret < 0) {
+            qWarning() << "Can't queue request";
+            return;
         }
-    }}
+    }
+}
 
 bool CameraProxy::controlExists(CameraProxy::Control c)
 {
@@ -708,63 +1148,106 @@ void CameraProxy::requestComplete(libcamera::Request *request)
 
     /*
      * We're running in the libcamera thread context, expensive operations
-     * are not allowed. Add the buffer to the done queue and post a
-     * CaptureEvent for the application thread to handle.
+     * are not allowed, nor is waiting or allocating. Hand the viewfinder
+     * buffer to the capture thread and the request to the application
+     * thread, each woken once for however many are pending.
      */
-    {
-        QMutexLocker locker(&m_mutex);
-        m_doneQueue.enqueue(request);
+    if (libcamera::FrameBuffer *buffer = request->findBuffer(m_viewFinderStream)) {
+        if (m_viewfinderQueue.push({ buffer, frameTimestamp(request, buffer),
+                                     bayerParameters(request->metadata()) })) {
+            m_viewfinderWake.wake();
+        } else {
+            qWarning() << "Viewfinder queue full";
+        }
     }
 
-    QCoreApplication::postEvent(this, new CaptureEvent);
+    if (m_doneQueue.push(request)) {
+        m_doneWake.wake();
+    } else {
+        qWarning() << "Done queue full";
+    }
+}
+
+// Sizes the queues for a session, or empties them with 0. The camera must
+// not be running, the capture thread is waited for
+void CameraProxy::resetQueues(size_t capacity)
+{
+    m_doneQueue.reset(capacity);
+    m_freeQueue.reset(capacity);
+    QMetaObject::invokeMethod(&m_viewfinderWake, [this, capacity]() {
+        m_viewfinderQueue.reset(capacity);
+    }, Qt::BlockingQueuedConnection);
 }
 
 void CameraProxy::processCapture()
 {
     //qDebug() << Q_FUNC_INFO;
+    ScopeTimer timer(&m_statsGuiTime);
+
     if (m_state == Stopped) {
         qDebug() << "dont process event if camera stopped";
         return;
     }
     /*
-     * Retrieve the next buffer from the done queue. The queue may be empty
-     * if stopCapture() has been called while a CaptureEvent was posted but
-     * not processed yet. Return immediately in that case.
+     * Drain every request completed since the last wake. The queue may be
+     * empty if stopCapture() has been called while a wake was pending.
     */
     libcamera::Request *request;
-    {
-        QMutexLocker locker(&m_mutex);
-        if (m_doneQueue.isEmpty())
-            return;
+    while (m_doneQueue.pop(&request)) {
+        // Follow the clock the pipeline stamps frames with, for presses
+        frameTimestamp(request, nullptr, &m_frameClock);
 
-        request = m_doneQueue.dequeue();
-    }
+        /* Process buffers, the viewfinder one is on the capture thread. */
+        //qDebug() << "VF Buffers" << request->buffers().count(m_viewFinderStream) << " Still buffers " << request->buffers().count(m_stillStream);
+        processStill(request->findBuffer(m_stillStream));
 
-    /* Process buffers. */
-    //qDebug() << "VF Buffers" << request->buffers().count(m_viewFinderStream) << " Still buffers " << request->buffers().count(m_stillStream);
-    processViewfinder(request->findBuffer(m_viewFinderStream));
-    processStill(request->findBuffer(m_stillStream));
+        if (m_state <= Stopping) {
+            continue;
+        }
 
-    if (m_state <= Stopping) {
-        return;
+        request->reuse();
+        m_freeQueue.push(request);
     }
+}
 
-    request->reuse();
-    QMutexLocker locker(&m_mutex);
-    m_freeQueue.enqueue(request);
+// Runs on the capture thread, for every viewfinder buffer since the last wake
+void CameraProxy::drainViewfinder()
+{
+    ViewfinderFrame frame;
+    while (m_viewfinderQueue.pop(&frame)) {
+        m_viewFinder->setBayerParameters(frame.bayer);
+        processViewfinder(frame.buffer, frame.timestamp);
+    }
 }
 
-void CameraProxy::processViewfinder(libcamera::FrameBuffer *buffer)
+// Runs on the capture thread, while the camera streams
+void CameraProxy::processViewfinder(libcamera::FrameBuffer *buffer, int64_t timestamp)
 {
     if (!buffer) return;
 
     //qDebug() << Q_FUNC_INFO << "Buffer request:" << buffer << buffer->request();//->toString().c_str();
 
-    Image *i = m_mappedBuffers[buffer].get();
+    QElapsedTimer timer;
+    timer.start();
+
+    Image *i = m_mappedBuffers.at(buffer).get();
     QList<QRectF> rects;
 
     if (m_enableFaceDetection) {
-        rects = m_fd.detect(m_viewFinder->currentImage());
+        // Detect on the mapped luma plane where there is one, saving an RGB round trip
+        AnalysisFrame frame = AnalysisFrame::fromImage(i, m_vfStreamConfig->pixelFormat,
+                                                       QSize(m_vfStreamConfig->size.width,
+                                                             m_vfStreamConfig->size.height),
+                                                       m_vfStreamConfig->stride);
+        if (!frame.isNull()) {
+            rects = m_fd.detect(frame);
+            for (QRectF &rect : rects) {
+                rect = m_viewFinder->mapRect(rect);
+            }
+        } else {
+            // The viewfinder image is already oriented
+            rects = m_fd.detect(AnalysisFrame::fromQImage(m_viewFinder->currentImage()));
+        }
         if (rects.length() > 0) {
             m_rects = rects;
             m_rectDelay = 30;
@@ -776,9 +1259,31 @@ void CameraProxy::processViewfinder(libcamera::FrameBuffer *buffer)
                 m_rects.clear();
             }
         }
+    } else if (!m_rects.isEmpty()) {
+        m_rects.clear();
+        m_rectDelay = 0;
     }
 
     m_viewFinder->renderImage(buffer, i, m_rects);
+
+    if (m_videoRecorder.isRecording()) {
+        m_videoRecorder.push(m_viewFinder->recordingImage(), timestamp);
+    } else if (m_livePhotoEnabled && livePhotoSupported()) {
+        m_livePhoto.push(m_viewFinder->recordingImage(), timestamp);
+    }
+
+    m_statsCaptureTime += timer.nsecsElapsed();
+}
+
+// Called on the thread the viewfinder rendered on, the buffer is requeued on this one
+void CameraProxy::viewfinderRendered(libcamera::FrameBuffer *buffer)
+{
+    const unsigned int session = m_session;
+    QMetaObject::invokeMethod(this, [this, buffer, session]() {
+        if (session == m_session) {
+            renderComplete(buffer);
+        }
+    }, Qt::QueuedConnection);
 }
 
 void CameraProxy::processStill(libcamera::FrameBuffer *buffer)
@@ -795,54 +1300,251 @@ void CameraProxy::processStill(libcamera::FrameBuffer *buffer)
         return;
     }
 
-    QFile file(m_saveFileName);
-    if (!file.open(QIODevice::WriteOnly)) {
+    // Frames queued behind the still, or the last frame of a burst, are not needed
+    if (m_singleStream && (m_burstActive ? m_burstRemaining == 0 : m_frame > 4)) {
+        recycleStill(buffer);
+        maybeFinishBurst();
+        return;
+    }
+
+    // Between presses, stills only refresh the zero shutter lag ring
+    if (m_zslDepth > 0 && !m_burstActive) {
+        if (!m_zslPending) {
+            pushZslFrame(buffer);
+            return;
+        }
+        m_zslPending = false;
+    }
+
+    if (m_burstActive) {
+        // Ring stills queued before the burst started are counted as burst frames
+        if (!m_singleStream && m_stillsInFlight > 0) {
+            m_stillsInFlight--;
+        }
+
+        // Encoders or storage fell behind, drop the frame rather than block
+        if (m_stillSaver.pending() >= m_stillSaver.capacity()) {
+            m_burstDropped++;
+            Q_EMIT burstStatsChanged();
+            recycleStill(buffer);
+            return;
+        }
+    }
+
+    m_frame++;
+
+    QString fileName = m_saveFileName;
+    if (m_burstActive) {
+        fileName = burstFileName(m_burstIndex++);
+        m_burstPaths.insert(fileName + StillEncoder::suffix(m_stillEncoder));
+        if (m_burstRemaining > 0) {
+            m_burstRemaining--;
+        }
+    }
+
+    saveStill(buffer, fileName, stillExif(buffer));
+}
+
+// The request's metadata is only valid until it is reused for the next frame
+ExifWriter CameraProxy::stillExif(libcamera::FrameBuffer *buffer) const
+{
+    ExifWriter exif;
+    exif.setModel(m_currentCamera->properties().get(libcamera::properties::Model).value_or(std::string()));
+    if (libcamera::Request *request = buffer->request()) {
+        exif.setMetadata(request->metadata());
+    }
+    return exif;
+}
+
+void CameraProxy::saveStill(libcamera::FrameBuffer *buffer, const QString &fileName, const ExifWriter &exif)
+{
+    StillSaver::Job job;
+    job.config = m_config->at(m_singleStream ? 0 : 1);
+    job.buffer = buffer;
+    job.image = m_mappedBuffers[buffer].get();
+    job.orientation = m_config->orientation;
+    job.fileName = fileName;
+    job.encoder = m_stillEncoder;
+    job.quality = m_stillQuality;
+    job.rawCompression = m_rawCompression;
+    job.exif = exif;
+
+    m_savingBuffers.insert(buffer);
+
+    // Stills are saved in order, behind any already waiting for a slot
+    if (m_queuedStills.isEmpty() && m_stillSaver.save(job)) {
+        return;
+    }
+
+    if (m_queuedStills.size() < MaxQueuedStills) {
+        m_queuedStills.enqueue(job);
+        Q_EMIT pendingStillsChanged();
         return;
     }
 
-    size_t totalSize = 0;
-    for (uint plane = 0; plane < buffer->metadata().planes().size(); ++plane) {
-        totalSize += buffer->metadata().planes()[plane].bytesused;
+    const QString path = fileName + StillEncoder::suffix(m_stillEncoder);
+    qWarning() << "Still save pipeline full, dropping" << path;
+
+    m_savingBuffers.remove(buffer);
+    recycleStill(buffer);
+    Q_EMIT stillDropped(path);
+
+    if (m_burstPaths.remove(path)) {
+        m_burstDropped++;
+        Q_EMIT burstStatsChanged();
+        maybeFinishBurst();
+    } else {
+        restoreViewFinder();
+    }
+}
+
+void CameraProxy::flushQueuedStills()
+{
+    bool flushed = false;
+    while (!m_queuedStills.isEmpty() && m_stillSaver.save(m_queuedStills.head())) {
+        m_queuedStills.dequeue();
+        flushed = true;
     }
 
-    file.write((const char*)m_mappedBuffers[buffer].get()->data(0).data(), totalSize);
-    file.close();
+    if (flushed) {
+        Q_EMIT pendingStillsChanged();
+    }
+}
 
-    EncoderJpeg jpeg;
-    libcamera::StreamConfiguration config = m_config->at(m_singleStream ? 0 : 1);
-    bool ok = jpeg.encode(config, buffer, m_mappedBuffers[buffer].get(), QString(m_saveFileName + QStringLiteral(".jpg")).toStdString());
+void CameraProxy::stillSaved(libcamera::FrameBuffer *buffer, const QString &path, bool ok)
+{
     if (!ok) {
         qDebug() << "Unable to save jpeg file";
     }
-    qDebug() << "Saved JPEG as " << QString(m_saveFileName + QStringLiteral(".jpg"));
 
-    {
-        QMutexLocker locker(&m_mutex);
-        m_freeBuffers[m_stillStream].enqueue(buffer);
+    // Buffers of a stopped session have been freed, only report the file
+    if (m_savingBuffers.remove(buffer)) {
+        Q_EMIT stillSaveComplete(buffer);
+        recycleStill(buffer);
+    }
+
+    // The gallery opens files where they are now, it follows them once flushed
+    const QString location = m_writeBehind.location(path);
+
+    if (!m_burstPaths.remove(path)) {
+        Q_EMIT stillCaptureFinished(location);
+        restoreViewFinder();
+        return;
+    }
+
+    m_burstSaved++;
+    if (m_burstTimer.elapsed() > 0) {
+        m_burstShotsPerSecond = m_burstSaved * 1000.0 / m_burstTimer.elapsed();
     }
+    Q_EMIT burstStatsChanged();
+    Q_EMIT burstFrameSaved(location);
+
+    maybeFinishBurst();
+}
 
-    if (buffer) {
+void CameraProxy::recycleStill(libcamera::FrameBuffer *buffer)
+{
+    // A single still stream keeps capturing for as long as a burst wants frames
+    if (m_singleStream && m_burstActive && m_burstRemaining != 0) {
         renderComplete(buffer);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_freeBuffers[m_stillStream].enqueue(buffer);
+}
+
+void CameraProxy::maybeFinishBurst()
+{
+    if (!m_burstActive || m_burstRemaining != 0 || m_stillsInFlight > 0 ||
+        !m_burstPaths.isEmpty()) {
+        return;
+    }
+
+    qDebug() << "Burst finished:" << m_burstSaved << "saved," << m_burstDropped
+             << "dropped," << m_burstShotsPerSecond << "shots/s";
+
+    m_burstActive = false;
+    Q_EMIT burstStatsChanged();
+    Q_EMIT burstFinished(m_burstSaved);
+
+    // Bursts ended by stopping leave the camera stopped
+    restoreViewFinder();
+}
+
+// A single stream camera is switched to stills for a press or a burst, give
+// the viewfinder back once its stills are saved or dropped. Two stream
+// cameras keep the viewfinder running throughout
+void CameraProxy::restoreViewFinder()
+{
+    if (m_singleStream && m_state == CapturingStill) {
+        QMetaObject::invokeMethod(this, &CameraProxy::startViewFinder, Qt::QueuedConnection);
+    }
+}
+
+QString CameraProxy::burstFileName(int index) const
+{
+    QFileInfo info(m_saveFileName);
+    QString name = info.completeBaseName() + QStringLiteral("_BURST%1").arg(index, 3, 10, QLatin1Char('0'));
+    if (!info.suffix().isEmpty()) {
+        name += QLatin1Char('.') + info.suffix();
+    }
+    return info.dir().filePath(name);
+}
+
+int CameraProxy::pendingStills() const
+{
+    return m_stillSaver.pending() + m_queuedStills.size();
+}
+
+bool CameraProxy::stillBusy() const
+{
+    return m_queuedStills.size() >= MaxQueuedStills;
+}
+
+bool CameraProxy::burstActive() const
+{
+    return m_burstActive;
+}
+
+int CameraProxy::burstSaved() const
+{
+    return m_burstSaved;
+}
+
+int CameraProxy::burstDropped() const
+{
+    return m_burstDropped;
+}
+
+double CameraProxy::burstShotsPerSecond() const
+{
+    return m_burstShotsPerSecond;
+}
+
+bool CameraProxy::burstWantsStill() const
+{
+    if (!m_burstActive) {
+        return false;
     }
 
-    Q_EMIT stillCaptureFinished(m_saveFileName + QStringLiteral(".jpg"));
+    // Continuous bursts run until stopped, counted ones until enough are in flight
+    return m_burstRemaining < 0 || m_stillsInFlight < m_burstRemaining;
 }
 
 void CameraProxy::renderComplete(libcamera::FrameBuffer *buffer)
 {
     //qDebug() << Q_FUNC_INFO << buffer << m_state << m_viewFinderStream << m_stillStream;
-    libcamera::Request *request;
-    {
-        QMutexLocker locker(&m_mutex);
-        if (m_freeQueue.isEmpty()) {
-            qDebug() << "Free queue empty";
-            return;
-        }
+    ScopeTimer timer(&m_statsGuiTime);
+    updateFrameStats();
 
-        request = m_freeQueue.dequeue();
+    libcamera::Request *request;
+    if (!m_freeQueue.pop(&request)) {
+        qDebug() << "Free queue empty";
+        return;
     }
 
-    if (m_state == CapturingViewFinder) {
+    if (m_state == CapturingViewFinder || m_state == Recording) {
         request->addBuffer(m_viewFinderStream, buffer);
         for(auto c : m_controlValues) {
             if (c.first) {
@@ -852,31 +1554,78 @@ void CameraProxy::renderComplete(libcamera::FrameBuffer *buffer)
     }
 
     if (m_singleStream) {
-        if ( m_state == CapturingStill && m_frame < 5) {
+        if (m_state == CapturingStill && (m_frame < 5 || m_burstActive)) {
             request->addBuffer(m_stillStream, buffer);
         }
-    } else if (m_captureStill) {
-        qDebug() << "Submitting request for still image " << m_stillStream->configuration().toString().c_str();
+    } else if (m_captureStill || burstWantsStill() || (m_zslDepth > 0 && !m_burstActive)) {
+        if (m_captureStill) {
+            qDebug() << "Submitting request for still image " << m_stillStream->configuration().toString().c_str();
+        }
+
+        // A burst takes no more stills than the saver has room for, so a
+        // slow encoder or storage throttles capture
+        bool room = !m_burstActive ||
+                    m_stillsInFlight + m_stillSaver.pending() < m_stillSaver.capacity();
 
         libcamera::FrameBuffer *stillBuffer = nullptr;
-        {
+        if (room) {
             QMutexLocker locker(&m_mutex);
             if (!m_freeBuffers[m_stillStream].isEmpty()) {
                 stillBuffer = m_freeBuffers[m_stillStream].dequeue();
             }
+        }
 
-            /* Create requests and fill them with buffers from the still stream. */
-            libcamera::FrameBuffer *buffer = m_freeBuffers[m_stillStream].dequeue();
-
-            int ret = request->addBuffer(m_stillStream, buffer);
-            if (ret < 0) {
-                qWarning() << "Can't set buffer for request";
-                return;
+        if (!stillBuffer) {
+            if (m_burstActive) {
+                m_burstDropped++;
+                Q_EMIT burstStatsChanged();
             }
-
+        } else if (request->addBuffer(m_stillStream, stillBuffer) < 0) {
+            qWarning() << "Can't set buffer for request";
+            QMutexLocker locker(&m_mutex);
+            m_freeBuffers[m_stillStream].enqueue(stillBuffer);
+        } else if (m_burstActive) {
+            m_stillsInFlight++;
+        } else {
+            m_captureStill = false;
         }
-        m_captureStill = false;
     }
 
     m_currentCamera->queueRequest(request);
 }
+
+void CameraProxy::updateFrameStats()
+{
+    if (!m_frameStatsTimer.isValid()) {
+        m_frameStatsTimer.start();
+    }
+
+    m_statsFrames++;
+
+    qint64 elapsed = m_frameStatsTimer.elapsed();
+    if (elapsed < 1000) {
+        return;
+    }
+
+    m_viewfinderFps = m_statsFrames * 1000.0 / elapsed;
+    m_guiFrameTime = m_statsGuiTime / 1e6 / m_statsFrames;
+    double captureFrameTime = m_statsCaptureTime.exchange(0) / 1e6 / m_statsFrames;
+
+    qDebug() << "Viewfinder" << m_viewfinderFps << "fps, per frame" << m_guiFrameTime
+             << "ms on the GUI thread," << captureFrameTime << "ms on the capture thread";
+
+    m_statsFrames = 0;
+    m_statsGuiTime = 0;
+    m_frameStatsTimer.restart();
+    Q_EMIT frameStatsChanged();
+}
+
+double CameraProxy::viewfinderFps() const
+{
+    return m_viewfinderFps;
+}
+
+double CameraProxy::guiFrameTime() const
+{
+    return m_guiFrameTime;
+}
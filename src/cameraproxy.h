@@ -3,8 +3,15 @@
 
 #include <QObject>
 #include <QQueue>
-#include <QEvent>
+#include <QElapsedTimer>
 #include <QMutex>
+#include <QSet>
+#include <QThread>
+
+#include <atomic>
+#include <time.h>
+
+#include <deque>
 
 #include <libcamera/camera.h>
 #include <libcamera/camera_manager.h>
@@ -16,11 +23,19 @@
 #include <libcamera/pixel_format.h>
 #include <libcamera/control_ids.h>
 
+#include "exifwriter.h"
 #include "facedetection.h"
 #include "image.h"
+#include "livephoto.h"
+#include "rawdump.h"
 #include "settings.h"
+#include "spscring.h"
+#include "stillsaver.h"
+#include "videorecorder.h"
 #include "viewfinder.h"
 #include "viewfinder2d.h"
+#include "wakenotifier.h"
+#include "writebehindcache.h"
 
 class CameraProxy : public QObject
 {
@@ -30,6 +45,19 @@ public:
     ~CameraProxy();
 
     Q_PROPERTY(CameraState state READ state WRITE setState NOTIFY stateChanged)
+    Q_PROPERTY(int pendingStills READ pendingStills NOTIFY pendingStillsChanged)
+    Q_PROPERTY(bool stillBusy READ stillBusy NOTIFY pendingStillsChanged)
+    Q_PROPERTY(int zslDepth READ zslDepth NOTIFY zslDepthChanged)
+    Q_PROPERTY(bool livePhotoSupported READ livePhotoSupported NOTIFY stateChanged)
+    Q_PROPERTY(bool burstActive READ burstActive NOTIFY burstStatsChanged)
+    Q_PROPERTY(int burstSaved READ burstSaved NOTIFY burstStatsChanged)
+    Q_PROPERTY(int burstDropped READ burstDropped NOTIFY burstStatsChanged)
+    Q_PROPERTY(double burstShotsPerSecond READ burstShotsPerSecond NOTIFY burstStatsChanged)
+    Q_PROPERTY(WriteBehindCache *writeBehind READ writeBehind CONSTANT)
+    Q_PROPERTY(int recordingDropped READ recordingDropped NOTIFY recordingStatsChanged)
+    Q_PROPERTY(double recordingEncodeFps READ recordingEncodeFps NOTIFY recordingStatsChanged)
+    Q_PROPERTY(double viewfinderFps READ viewfinderFps NOTIFY frameStatsChanged)
+    Q_PROPERTY(double guiFrameTime READ guiFrameTime NOTIFY frameStatsChanged)
 
     enum CameraState {
         Stopped = 0,
@@ -37,7 +65,8 @@ public:
         CapturingStill,
         CapturingViewFinder,
         ConfiguringStill,
-        ConfiguringViewFinder
+        ConfiguringViewFinder,
+        Recording
     };
     enum Control {
         AeEnable = libcamera::controls::AE_ENABLE,
@@ -63,8 +92,6 @@ public:
     Q_ENUM(Control);
     Q_ENUM(ControlType)
 
-    bool event(QEvent *e) override;
-
     void setCameraManager(std::shared_ptr<libcamera::CameraManager> cm);
     void setSettings(Settings *settings);
 
@@ -73,6 +100,24 @@ public:
     Q_INVOKABLE QString currentStillFormat() const;
     Q_INVOKABLE void setResolution(const QSize &res);
     Q_INVOKABLE void setFaceDetectionEnabled(bool enabled);
+    // Zero shutter lag keeps recent stills in a ring sized to the budget
+    Q_INVOKABLE void setZslEnabled(bool enabled);
+    Q_INVOKABLE void setZslMemoryBudget(int megabytes);
+    // Live photos write a clip of the viewfinder around each still press.
+    // Single stream cameras stop the viewfinder for stills, and have none
+    Q_INVOKABLE void setLivePhotoEnabled(bool enabled);
+    bool livePhotoSupported() const;
+    // Image format of saved stills, a StillEncoder name, and its quality
+    Q_INVOKABLE QStringList stillEncoders() const;
+    Q_INVOKABLE void setStillEncoder(const QString &name);
+    Q_INVOKABLE int defaultStillQuality(const QString &name) const;
+    Q_INVOKABLE void setStillQuality(int quality);
+    // Compression of raw dumps, "none" or a name from rawCompressions()
+    Q_INVOKABLE QStringList rawCompressions() const;
+    Q_INVOKABLE void setRawCompression(const QString &name);
+    // Captures for removable storage are staged on internal flash, within the budget
+    Q_INVOKABLE void setWriteBehindEnabled(bool enabled);
+    Q_INVOKABLE void setWriteBehindBudget(int megabytes);
 
     std::vector<libcamera::Size> supportedResoluions(QString format);
     libcamera::ControlInfoMap supportedControls() const;
@@ -80,6 +125,24 @@ public:
     CameraState state() const;
     void setState(CameraState newState);
 
+    int pendingStills() const;
+    // No room for another still until a save completes, presses are dropped
+    bool stillBusy() const;
+    int zslDepth() const;
+    WriteBehindCache *writeBehind();
+
+    bool burstActive() const;
+    int burstSaved() const;
+    int burstDropped() const;
+    double burstShotsPerSecond() const;
+
+    int recordingDropped() const;
+    double recordingEncodeFps() const;
+
+    double viewfinderFps() const;
+    // Milliseconds the GUI thread spends on each frame
+    double guiFrameTime() const;
+
     //Controls
     bool controlExists(CameraProxy::Control c);
     float controlMin(CameraProxy::Control c);
@@ -95,6 +158,12 @@ public Q_SLOTS:
     void startViewFinder();
     void stop();
     void stillCapture(const QString &filename);
+    // Capture count stills at sensor rate, or until stopBurst() for count 0
+    void startBurst(const QString &filename, int count = 0);
+    void stopBurst();
+    // Record the viewfinder as Motion JPEG in an AVI
+    void startRecording(const QString &filename);
+    void stopRecording();
 
 Q_SIGNALS:
     void cameraChanged();
@@ -102,6 +171,18 @@ Q_SIGNALS:
     void resolutionChanged();
     void stillSaveComplete(libcamera::FrameBuffer *buffer);
     void stillCaptureFinished(const QString &path);
+    void stillSaveProgress(const QString &path, int percent);
+    void pendingStillsChanged();
+    // The still was not saved, the save pipeline was full
+    void stillDropped(const QString &path);
+    void zslDepthChanged();
+    void burstFrameSaved(const QString &path);
+    void burstFinished(int saved);
+    void burstStatsChanged();
+    void recordingFinished(const QString &path, bool ok);
+    void livePhotoSaved(const QString &path, bool ok);
+    void recordingStatsChanged();
+    void frameStatsChanged();
     void stateChanged();
 
 private:
@@ -122,10 +203,38 @@ private:
     libcamera::Stream *m_viewFinderStream;
     libcamera::Stream *m_stillStream;
     std::map<const libcamera::Stream *, QQueue<libcamera::FrameBuffer *>> m_freeBuffers;
-    QQueue<libcamera::Request *> m_doneQueue;
-    QQueue<libcamera::Request *> m_freeQueue;
     std::vector<std::unique_ptr<libcamera::Request>> m_requests;
 
+    // Completed requests, from the libcamera thread to this one, and
+    // reused requests waiting for a buffer. Sized to m_requests, so a push
+    // only fails if libcamera hands back more requests than were queued
+    SpscRing<libcamera::Request *> m_doneQueue;
+    SpscRing<libcamera::Request *> m_freeQueue;
+    WakeNotifier m_doneWake;
+
+    // Viewfinder frames are analysed and converted on the capture thread,
+    // m_viewfinderWake lives there to drain them. Frames carry what the
+    // capture thread needs of their request's metadata, as the request is
+    // reused on this thread
+    struct ViewfinderFrame {
+        libcamera::FrameBuffer *buffer = nullptr;
+        int64_t timestamp = 0;
+        FormatConverter::BayerParameters bayer;
+    };
+    QThread m_captureThread;
+    SpscRing<ViewfinderFrame> m_viewfinderQueue;
+    WakeNotifier m_viewfinderWake;
+    // Counts stops, so buffers rendered before one are not requeued after it
+    std::atomic<unsigned int> m_session{0};
+
+    // Frame statistics, over about a second
+    QElapsedTimer m_frameStatsTimer;
+    int m_statsFrames = 0;
+    qint64 m_statsGuiTime = 0;
+    std::atomic<qint64> m_statsCaptureTime{0};
+    double m_viewfinderFps = 0;
+    double m_guiFrameTime = 0;
+
 
     // Cached still and viewfinder modes
     std::map<libcamera::PixelFormat, std::vector<libcamera::Size>> m_viewFinderFormats;
@@ -143,40 +252,93 @@ private:
     bool m_captureStill = false;
     bool m_singleStream = false;
 
+    // Stills are encoded and written off the GUI thread, their buffers are
+    // recycled once saved. The saver stages files in the cache, which
+    // outlives it.
+    WriteBehindCache m_writeBehind;
+    StillSaver m_stillSaver;
+    QSet<libcamera::FrameBuffer *> m_savingBuffers;
+    // Stills waiting for a saver slot, the GUI thread never waits for one
+    QQueue<StillSaver::Job> m_queuedStills;
+    QString m_stillEncoder = QStringLiteral("jpeg");
+    int m_stillQuality = -1;
+    RawDump::Compression m_rawCompression = RawDump::Compression::None;
+
+    // Zero shutter lag, two stream configurations only
+    struct ZslFrame {
+        libcamera::FrameBuffer *buffer = nullptr;
+        int64_t timestamp = 0;
+        ExifWriter exif;
+    };
+    bool m_zslEnabled = false;
+    qint64 m_zslMemoryBudget = 256 * 1024 * 1024;
+    unsigned int m_zslDepth = 0;
+    bool m_zslPending = false;
+    std::deque<ZslFrame> m_zslRing;
+    // The clock frames are stamped with, presses are stamped with it too
+    clockid_t m_frameClock = CLOCK_BOOTTIME;
+
+    // Burst capture. m_burstRemaining is -1 for continuous bursts.
+    bool m_burstActive = false;
+    int m_burstRemaining = 0;
+    int m_burstIndex = 0;
+    int m_burstSaved = 0;
+    int m_burstDropped = 0;
+    int m_stillsInFlight = 0;
+    double m_burstShotsPerSecond = 0;
+    QElapsedTimer m_burstTimer;
+    QSet<QString> m_burstPaths;
+
+    // Video recording, fed from the viewfinder
+    VideoRecorder m_videoRecorder;
+
+    // Live photos, a ring of compressed viewfinder frames
+    std::atomic<bool> m_livePhotoEnabled{false};
+    LivePhoto m_livePhoto;
+
     bool buildConfiguration( std::initializer_list<libcamera::StreamRole> roles, bool configure = false);
     bool configureCamera();
 
+    void resetQueues(size_t capacity);
     void processCapture();
-    void processViewfinder(libcamera::FrameBuffer *buffer);
+    void drainViewfinder();
+    void processViewfinder(libcamera::FrameBuffer *buffer, int64_t timestamp);
+    void viewfinderRendered(libcamera::FrameBuffer *buffer);
     void processStill(libcamera::FrameBuffer *buffer);
+    void saveStill(libcamera::FrameBuffer *buffer, const QString &fileName, const ExifWriter &exif);
+    void flushQueuedStills();
+    ExifWriter stillExif(libcamera::FrameBuffer *buffer) const;
+    void stillSaved(libcamera::FrameBuffer *buffer, const QString &path, bool ok);
+    void recycleStill(libcamera::FrameBuffer *buffer);
+    void startStillStream();
+
+    void configureZsl();
+    void pushZslFrame(libcamera::FrameBuffer *buffer);
+    ZslFrame takeZslFrame(int64_t timestamp);
+    void clearZslRing();
+    int64_t pressTimestamp() const;
+
+    bool burstWantsStill() const;
+    void maybeFinishBurst();
+    void restoreViewFinder();
+    QString burstFileName(int index) const;
+
+    double recordingFrameRate() const;
+    void recordingDone(const QString &path, bool ok);
 
     void requestComplete(libcamera::Request *request);
+    void updateFrameStats();
     void cacheFormats(libcamera::StreamRole role);
 
     libcamera::Size bestViewfinderResolution(libcamera::PixelFormat format, libcamera::Size stillSize);
 
     std::unordered_map<Control, libcamera::ControlValue> m_controlValues;
 
-    //Face detection
-    bool m_enableFaceDetection;
+    //Face detection, on the capture thread
+    std::atomic<bool> m_enableFaceDetection{false};
     FaceDetection m_fd;
     QList<QRectF> m_rects;
     uint m_rectDelay = 0;
 };
 
-class CaptureEvent : public QEvent
-{
-public:
-    CaptureEvent()
-        : QEvent(type())
-    {
-    }
-
-    static Type type()
-    {
-        static int type = QEvent::registerEventType();
-        return static_cast<Type>(type);
-    }
-};
-
 #endif // CAMERAPROXY_H
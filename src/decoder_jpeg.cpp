@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * decoder_jpeg.cpp - Persistent MJPEG decoder with DCT domain scaling
+ */
+
+#include "decoder_jpeg.h"
+
+#include <algorithm>
+#include <iterator>
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+#include <QtGlobal>
+
+#include "qdebug.h"
+
+/*
+ * One decompressor is created for the lifetime of the stream and reused for
+ * every frame, libjpeg only allocates per image working memory. Errors unwind
+ * through a longjmp back into decode().
+ */
+struct DecoderJpeg::Decompressor {
+	jpeg_decompress_struct cinfo;
+	jpeg_error_mgr error;
+	jmp_buf jump;
+};
+
+namespace {
+
+void errorExit(j_common_ptr cinfo)
+{
+	jmp_buf *jump = static_cast<jmp_buf *>(cinfo->client_data);
+	char message[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, message);
+	qDebug() << "Unable to decode MJPEG frame:" << message;
+
+	longjmp(*jump, 1);
+}
+
+/*
+ * Corrupt data warnings are common with UVC cameras and libjpeg recovers
+ * from them, don't print one for every frame.
+ */
+void outputMessage(j_common_ptr)
+{
+}
+
+} /* namespace */
+
+DecoderJpeg::DecoderJpeg()
+	: decompressor_(std::make_unique<Decompressor>())
+{
+	jpeg_decompress_struct &cinfo = decompressor_->cinfo;
+
+	cinfo.err = jpeg_std_error(&decompressor_->error);
+	decompressor_->error.error_exit = errorExit;
+	decompressor_->error.output_message = outputMessage;
+	cinfo.client_data = &decompressor_->jump;
+
+	jpeg_create_decompress(&cinfo);
+}
+
+DecoderJpeg::~DecoderJpeg()
+{
+	jpeg_destroy_decompress(&decompressor_->cinfo);
+}
+
+unsigned int DecoderJpeg::scaleDenominator(const QSize &size, const QSize &target)
+{
+	unsigned int denominator = 8;
+
+	while (denominator > 1) {
+		QSize scaled = scaledSize(size, denominator);
+		if (scaled.width() >= target.width() &&
+		    scaled.height() >= target.height())
+			break;
+
+		denominator /= 2;
+	}
+
+	return denominator;
+}
+
+QSize DecoderJpeg::scaledSize(const QSize &size, unsigned int denominator)
+{
+	/* As libjpeg computes output_width and output_height */
+	int d = denominator;
+	return QSize((size.width() + d - 1) / d, (size.height() + d - 1) / d);
+}
+
+bool DecoderJpeg::decode(const uint8_t *data, size_t length, const QSize &size,
+			 unsigned int denominator, uint8_t *dst, unsigned int stride)
+{
+	if (!start(data, length, size, denominator))
+		return false;
+
+	if (!readRows(dst, stride, decompressor_->cinfo.output_height))
+		return false;
+
+	return finish();
+}
+
+bool DecoderJpeg::start(const uint8_t *data, size_t length, const QSize &size,
+			unsigned int denominator)
+{
+	jpeg_decompress_struct &cinfo = decompressor_->cinfo;
+
+	if (setjmp(decompressor_->jump)) {
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), length);
+
+	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK ||
+	    cinfo.image_width != static_cast<unsigned int>(size.width()) ||
+	    cinfo.image_height != static_cast<unsigned int>(size.height())) {
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	/*
+	 * Decode straight to the QImage::Format_RGB32 byte order. libjpeg-turbo
+	 * supplies the standard Huffman tables most MJPEG frames leave out.
+	 */
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+	cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+	cinfo.out_color_space = JCS_EXT_XRGB;
+#endif
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denominator;
+
+	jpeg_start_decompress(&cinfo);
+
+	return true;
+}
+
+bool DecoderJpeg::readRows(uint8_t *dst, unsigned int stride, unsigned int count)
+{
+	jpeg_decompress_struct &cinfo = decompressor_->cinfo;
+
+	if (setjmp(decompressor_->jump)) {
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	JSAMPROW rows[16];
+	unsigned int top = cinfo.output_scanline;
+	unsigned int end = std::min(top + count, cinfo.output_height);
+
+	while (cinfo.output_scanline < end) {
+		unsigned int first = cinfo.output_scanline;
+		unsigned int lines = std::min<unsigned int>(end - first, std::size(rows));
+
+		for (unsigned int i = 0; i < lines; i++)
+			rows[i] = dst + (first - top + i) * stride;
+
+		jpeg_read_scanlines(&cinfo, rows, lines);
+	}
+
+	return true;
+}
+
+bool DecoderJpeg::finish()
+{
+	jpeg_decompress_struct &cinfo = decompressor_->cinfo;
+
+	if (setjmp(decompressor_->jump)) {
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_finish_decompress(&cinfo);
+
+	return true;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * decoder_jpeg.h - Persistent MJPEG decoder with DCT domain scaling
+ */
+
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <QSize>
+
+class DecoderJpeg
+{
+public:
+	DecoderJpeg();
+	~DecoderJpeg();
+
+	/*
+	 * Largest DCT scaling denominator (1, 2, 4 or 8) that decodes a size
+	 * image to no less than target in both directions.
+	 */
+	static unsigned int scaleDenominator(const QSize &size, const QSize &target);
+	static QSize scaledSize(const QSize &size, unsigned int denominator);
+
+	/*
+	 * Decode a JPEG of the given size at 1/denominator scale into RGB32
+	 * rows at dst. Returns false, leaving the rows in an unspecified state,
+	 * for data that is not a decodable JPEG of that size.
+	 */
+	bool decode(const uint8_t *data, size_t length, const QSize &size,
+		    unsigned int denominator, uint8_t *dst, unsigned int stride);
+
+	/*
+	 * Decode incrementally, count rows at a time, for callers processing
+	 * the image in strips. A failed call ends decoding of the image.
+	 */
+	bool start(const uint8_t *data, size_t length, const QSize &size,
+		   unsigned int denominator);
+	bool readRows(uint8_t *dst, unsigned int stride, unsigned int count);
+	bool finish();
+
+private:
+	/* libjpeg state, kept out of the header */
+	struct Decompressor;
+
+	std::unique_ptr<Decompressor> decompressor_;
+};
@@ -0,0 +1,344 @@
+#include "dngwriter.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <vector>
+
+#include <QDebug>
+#include <QFile>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "exifwriter.h"
+#include "image.h"
+#include "tiffdirectory.h"
+
+namespace {
+
+enum Tag : uint16_t {
+    NewSubFileType = 254,
+    ImageWidth = 256,
+    ImageLength = 257,
+    BitsPerSample = 258,
+    Compression = 259,
+    PhotometricInterpretation = 262,
+    Model = 272,
+    StripOffsets = 273,
+    Orientation = 274,
+    SamplesPerPixel = 277,
+    RowsPerStrip = 278,
+    StripByteCounts = 279,
+    PlanarConfiguration = 284,
+    Software = 305,
+    DateTime = 306,
+    CfaRepeatPatternDim = 33421,
+    CfaPattern = 33422,
+    ExposureTime = 33434,
+    IsoSpeedRatings = 34855,
+    DngVersion = 50706,
+    DngBackwardVersion = 50707,
+    UniqueCameraModel = 50708,
+    CfaPlaneColor = 50710,
+    CfaLayout = 50711,
+    BlackLevelRepeatDim = 50713,
+    BlackLevel = 50714,
+    WhiteLevel = 50717,
+    ColorMatrix1 = 50721,
+    AsShotNeutral = 50728,
+    CalibrationIlluminant1 = 50778,
+};
+
+enum Colour : uint8_t { Red = 0, Green = 1, Blue = 2 };
+
+struct RawFormat {
+    /* Colours of the top left 2x2 pixels, row by row */
+    std::array<uint8_t, 4> cfa;
+    /* Significant bits of each sample */
+    unsigned int bits;
+    /* CSI-2 packing, otherwise one byte or one little endian 16-bit word per sample */
+    bool csi2Packed;
+};
+
+constexpr std::array<uint8_t, 4> BGGR = { Blue, Green, Green, Red };
+constexpr std::array<uint8_t, 4> GBRG = { Green, Blue, Red, Green };
+constexpr std::array<uint8_t, 4> GRBG = { Green, Red, Blue, Green };
+constexpr std::array<uint8_t, 4> RGGB = { Red, Green, Green, Blue };
+
+const std::map<libcamera::PixelFormat, RawFormat> rawFormats = {
+    { libcamera::formats::SBGGR8, { BGGR, 8, false } },
+    { libcamera::formats::SGBRG8, { GBRG, 8, false } },
+    { libcamera::formats::SGRBG8, { GRBG, 8, false } },
+    { libcamera::formats::SRGGB8, { RGGB, 8, false } },
+    { libcamera::formats::SBGGR10, { BGGR, 10, false } },
+    { libcamera::formats::SGBRG10, { GBRG, 10, false } },
+    { libcamera::formats::SGRBG10, { GRBG, 10, false } },
+    { libcamera::formats::SRGGB10, { RGGB, 10, false } },
+    { libcamera::formats::SBGGR12, { BGGR, 12, false } },
+    { libcamera::formats::SGBRG12, { GBRG, 12, false } },
+    { libcamera::formats::SGRBG12, { GRBG, 12, false } },
+    { libcamera::formats::SRGGB12, { RGGB, 12, false } },
+    { libcamera::formats::SBGGR16, { BGGR, 16, false } },
+    { libcamera::formats::SGBRG16, { GBRG, 16, false } },
+    { libcamera::formats::SGRBG16, { GRBG, 16, false } },
+    { libcamera::formats::SRGGB16, { RGGB, 16, false } },
+    { libcamera::formats::SBGGR10_CSI2P, { BGGR, 10, true } },
+    { libcamera::formats::SGBRG10_CSI2P, { GBRG, 10, true } },
+    { libcamera::formats::SGRBG10_CSI2P, { GRBG, 10, true } },
+    { libcamera::formats::SRGGB10_CSI2P, { RGGB, 10, true } },
+    { libcamera::formats::SBGGR12_CSI2P, { BGGR, 12, true } },
+    { libcamera::formats::SGBRG12_CSI2P, { GBRG, 12, true } },
+    { libcamera::formats::SGRBG12_CSI2P, { GRBG, 12, true } },
+    { libcamera::formats::SRGGB12_CSI2P, { RGGB, 12, true } },
+};
+
+using Matrix = std::array<float, 9>;
+
+Matrix multiply(const Matrix &a, const Matrix &b)
+{
+    Matrix m{};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++)
+                m[i * 3 + j] += a[i * 3 + k] * b[k * 3 + j];
+        }
+    }
+    return m;
+}
+
+bool invert(const Matrix &m, Matrix *inverse)
+{
+    float det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+                m[1] * (m[3] * m[8] - m[5] * m[6]) +
+                m[2] * (m[3] * m[7] - m[4] * m[6]);
+    if (std::abs(det) < 1e-6f)
+        return false;
+
+    *inverse = {
+        (m[4] * m[8] - m[5] * m[7]) / det, (m[2] * m[7] - m[1] * m[8]) / det, (m[1] * m[5] - m[2] * m[4]) / det,
+        (m[5] * m[6] - m[3] * m[8]) / det, (m[0] * m[8] - m[2] * m[6]) / det, (m[2] * m[3] - m[0] * m[5]) / det,
+        (m[3] * m[7] - m[4] * m[6]) / det, (m[1] * m[6] - m[0] * m[7]) / det, (m[0] * m[4] - m[1] * m[3]) / det,
+    };
+    return true;
+}
+
+/* Linear sRGB to CIE XYZ, D65 white */
+constexpr Matrix RgbToXyz = {
+    0.4124564f, 0.3575761f, 0.1804375f,
+    0.2126729f, 0.7151522f, 0.0721750f,
+    0.0193339f, 0.1191920f, 0.9503041f,
+};
+
+/*
+ * CSI-2 packs four 10-bit samples in five bytes, the high bits of each then
+ * a byte of the low bits. TIFF wants them as one big endian bit stream.
+ */
+void repack10(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 4 <= width; x += 4, src += 5, dst += 5) {
+        uint16_t p0 = src[0] << 2 | (src[4] & 3);
+        uint16_t p1 = src[1] << 2 | ((src[4] >> 2) & 3);
+        uint16_t p2 = src[2] << 2 | ((src[4] >> 4) & 3);
+        uint16_t p3 = src[3] << 2 | (src[4] >> 6);
+
+        dst[0] = p0 >> 2;
+        dst[1] = (p0 & 3) << 6 | p1 >> 4;
+        dst[2] = (p1 & 15) << 4 | p2 >> 6;
+        dst[3] = (p2 & 63) << 2 | p3 >> 8;
+        dst[4] = p3;
+    }
+
+    uint32_t bits = 0;
+    unsigned int count = 0;
+    for (unsigned int i = 0; x < width; x++, i++) {
+        bits = bits << 10 | src[i] << 2 | ((src[4] >> (2 * i)) & 3);
+        for (count += 10; count >= 8; count -= 8)
+            *dst++ = bits >> (count - 8);
+    }
+    if (count)
+        *dst = bits << (8 - count);
+}
+
+/* Two 12-bit samples in three bytes, the high bits of each then the low nibbles */
+void repack12(const uint8_t *src, uint8_t *dst, unsigned int width)
+{
+    unsigned int x = 0;
+
+    for (; x + 2 <= width; x += 2, src += 3, dst += 3) {
+        uint16_t p0 = src[0] << 4 | (src[2] & 15);
+        uint16_t p1 = src[1] << 4 | (src[2] >> 4);
+
+        dst[0] = p0 >> 4;
+        dst[1] = (p0 & 15) << 4 | p1 >> 8;
+        dst[2] = p1;
+    }
+
+    if (x < width) {
+        dst[0] = src[0];
+        dst[1] = (src[2] & 15) << 4;
+    }
+}
+
+} // namespace
+
+bool DngWriter::supports(const libcamera::PixelFormat &format)
+{
+    return rawFormats.count(format) > 0;
+}
+
+bool DngWriter::write(const QString &fileName, const libcamera::StreamConfiguration &cfg,
+                      Image *image, libcamera::Orientation orientation, const ExifWriter &exif)
+{
+    auto it = rawFormats.find(cfg.pixelFormat);
+    if (it == rawFormats.end()) {
+        return false;
+    }
+    const RawFormat &format = it->second;
+    const libcamera::ControlList &metadata = exif.metadata();
+
+    const unsigned int width = cfg.size.width;
+    const unsigned int height = cfg.size.height;
+    const unsigned int storedBits = format.csi2Packed ? format.bits : (format.bits > 8 ? 16 : 8);
+    // CSI-2 rows hold whole groups of samples even when the width doesn't
+    const size_t srcRowBytes = !format.csi2Packed ? static_cast<size_t>(width) * storedBits / 8
+                               : format.bits == 10 ? (width + 3) / 4 * 5
+                                                   : (width + 1) / 2 * 3;
+    const size_t rowBytes = (static_cast<size_t>(width) * storedBits + 7) / 8;
+
+    libcamera::Span<uint8_t> plane = image->data(0);
+    if (height == 0 || cfg.stride < srcRowBytes ||
+        plane.size() < static_cast<size_t>(cfg.stride) * (height - 1) + srcRowBytes) {
+        qWarning() << "Raw buffer too small for" << width << "x" << height;
+        return false;
+    }
+
+    TiffDirectory ifd;
+    ifd.addLong(NewSubFileType, 0);
+    ifd.addLong(ImageWidth, width);
+    ifd.addLong(ImageLength, height);
+    ifd.addShort(BitsPerSample, storedBits);
+    ifd.addShort(Compression, 1);
+    ifd.addShort(PhotometricInterpretation, 32803);
+    ifd.addShort(Orientation, static_cast<uint16_t>(orientation));
+    ifd.addShort(SamplesPerPixel, 1);
+    ifd.addLong(RowsPerStrip, height);
+    ifd.addLong(StripByteCounts, rowBytes * height);
+    ifd.addShort(PlanarConfiguration, 1);
+    ifd.addAscii(Software, "Shutter");
+    ifd.addAscii(DateTime, exif.dateTime().toString(QStringLiteral("yyyy:MM:dd HH:mm:ss")).toStdString());
+
+    const std::string model = exif.model().empty() ? std::string("Unknown") : exif.model();
+    ifd.addAscii(Model, model);
+    ifd.addAscii(UniqueCameraModel, model);
+
+    ifd.addBytes(DngVersion, { 1, 4, 0, 0 });
+    ifd.addBytes(DngBackwardVersion, { 1, 1, 0, 0 });
+    ifd.addShorts(CfaRepeatPatternDim, { 2, 2 });
+    ifd.addBytes(CfaPattern, std::vector<uint8_t>(format.cfa.begin(), format.cfa.end()));
+    ifd.addBytes(CfaPlaneColor, { Red, Green, Blue });
+    ifd.addShort(CfaLayout, 1);
+    ifd.addLong(WhiteLevel, (1u << format.bits) - 1);
+
+    // Reported in the order R, Gr, Gb, B on a 16-bit scale
+    if (auto levels = metadata.get(libcamera::controls::SensorBlackLevels)) {
+        std::vector<uint32_t> black;
+        for (unsigned int i = 0; i < 4; i++) {
+            uint8_t colour = format.cfa[i];
+            uint8_t neighbour = format.cfa[(i & 2) | (~i & 1)];
+            unsigned int index = colour == Red ? 0 : colour == Blue ? 3 : neighbour == Red ? 1 : 2;
+            black.push_back(std::max<int32_t>((*levels)[index], 0) >> (16 - format.bits));
+        }
+        ifd.addShorts(BlackLevelRepeatDim, { 2, 2 });
+        ifd.addLongs(BlackLevel, black);
+    }
+
+    /*
+     * The pipeline turns camera RGB into linear sRGB by white balance gains
+     * then the colour correction matrix, DNG wants the reverse from XYZ.
+     */
+    Matrix ccm = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    if (auto matrix = metadata.get(libcamera::controls::ColourCorrectionMatrix)) {
+        std::copy(matrix->begin(), matrix->end(), ccm.begin());
+    }
+    float redGain = 1.0f;
+    float blueGain = 1.0f;
+    if (auto gains = metadata.get(libcamera::controls::ColourGains)) {
+        redGain = std::max((*gains)[0], 0.01f);
+        blueGain = std::max((*gains)[1], 0.01f);
+    }
+
+    const Matrix whiteBalance = { redGain, 0, 0, 0, 1, 0, 0, 0, blueGain };
+    Matrix xyzToCamera;
+    if (!invert(multiply(multiply(RgbToXyz, ccm), whiteBalance), &xyzToCamera)) {
+        invert(multiply(RgbToXyz, whiteBalance), &xyzToCamera);
+    }
+
+    std::vector<std::pair<int32_t, int32_t>> colorMatrix;
+    for (float value : xyzToCamera) {
+        colorMatrix.push_back({ static_cast<int32_t>(std::lround(value * 10000)), 10000 });
+    }
+    ifd.addSRationals(ColorMatrix1, colorMatrix);
+    ifd.addShort(CalibrationIlluminant1, 21);
+    ifd.addRationals(AsShotNeutral, { { static_cast<uint32_t>(std::lround(10000 / redGain)), 10000 },
+                                      { 10000, 10000 },
+                                      { static_cast<uint32_t>(std::lround(10000 / blueGain)), 10000 } });
+
+    if (auto exposure = metadata.get(libcamera::controls::ExposureTime)) {
+        ifd.addRational(ExposureTime, *exposure, 1000000);
+    }
+    if (auto gain = metadata.get(libcamera::controls::AnalogueGain)) {
+        float total = *gain * metadata.get(libcamera::controls::DigitalGain).value_or(1.0f);
+        ifd.addShort(IsoSpeedRatings, std::clamp<long>(std::lround(total * 100), 1, 65535));
+    }
+
+    ifd.addLong(StripOffsets, 0);
+    ifd.addLong(StripOffsets, 8 + ifd.size());
+
+    std::vector<uint8_t> header = { 'I', 'I', 0x2a, 0x00 };
+    TiffDirectory::put32(header, 8);
+    ifd.write(header, 0);
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Unable to open" << fileName;
+        return false;
+    }
+
+    bool ok = file.write(reinterpret_cast<const char *>(header.data()), header.size()) ==
+              static_cast<qint64>(header.size());
+
+    const uint8_t *src = plane.data();
+
+    if (!format.csi2Packed && cfg.stride == rowBytes) {
+        // Rows are contiguous, the whole plane goes in one write
+        qint64 size = rowBytes * height;
+        ok = ok && file.write(reinterpret_cast<const char *>(src), size) == size;
+    } else if (!format.csi2Packed) {
+        for (unsigned int y = 0; ok && y < height; y++) {
+            ok = file.write(reinterpret_cast<const char *>(src + y * cfg.stride), rowBytes) ==
+                 static_cast<qint64>(rowBytes);
+        }
+    } else {
+        std::vector<uint8_t> row(rowBytes);
+        for (unsigned int y = 0; ok && y < height; y++) {
+            if (format.bits == 10)
+                repack10(src + y * cfg.stride, row.data(), width);
+            else
+                repack12(src + y * cfg.stride, row.data(), width);
+            ok = file.write(reinterpret_cast<const char *>(row.data()), rowBytes) ==
+                 static_cast<qint64>(rowBytes);
+        }
+    }
+
+    file.close();
+    if (!ok) {
+        qWarning() << "Unable to write" << fileName;
+        file.remove();
+    }
+
+    return ok;
+}
@@ -0,0 +1,31 @@
+#ifndef DNGWRITER_H
+#define DNGWRITER_H
+
+#include <QString>
+
+#include <libcamera/orientation.h>
+#include <libcamera/pixel_format.h>
+#include <libcamera/stream.h>
+
+class ExifWriter;
+class Image;
+
+/*
+ * Writes a raw Bayer still as an uncompressed DNG. The TIFF header and tags
+ * are written first, then the mapped sensor data row by row: unpacked
+ * samples go to disk as they are, CSI-2 packed rows are repacked to TIFF
+ * bit order through a one row buffer. The CFA pattern comes from the pixel
+ * format, black level, white balance and colour matrix from the metadata
+ * of the capture.
+ */
+class DngWriter
+{
+public:
+    static bool supports(const libcamera::PixelFormat &format);
+
+    static bool write(const QString &fileName, const libcamera::StreamConfiguration &cfg,
+                      Image *image, libcamera::Orientation orientation,
+                      const ExifWriter &exif);
+};
+
+#endif // DNGWRITER_H
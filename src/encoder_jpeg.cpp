@@ -1,73 +1,611 @@
 #include "encoder_jpeg.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fcntl.h>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <QImage>
+#include <QThread>
 
 #include <libcamera/camera.h>
 #include <libcamera/libcamera/formats.h>
 
+#include <jpeglib.h>
+
+#include "exifwriter.h"
 #include "image.h"
 #include "format_converter.h"
 #include "qdebug.h"
+#include "workerpool.h"
+
+/*
+ * Stills smaller than this many MCU rows per thread aren't worth splitting,
+ * each strip costs a set of headers and a thread handoff.
+ */
+static constexpr unsigned int MinStripMcuRows = 16;
+
+namespace {
+
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
 
-static const QMap<libcamera::PixelFormat, QImage::Format> nativeFormats
+void jpegErrorExit(j_common_ptr cinfo)
 {
-#if QT_VERSION >= QT_VERSION_CHECK(5, 2, 0)
-    { libcamera::formats::ABGR8888, QImage::Format_RGBX8888 },
-    { libcamera::formats::XBGR8888, QImage::Format_RGBX8888 },
-#endif
-    { libcamera::formats::ARGB8888, QImage::Format_RGB32 },
-    { libcamera::formats::XRGB8888, QImage::Format_RGB32 },
-#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
-    { libcamera::formats::RGB888, QImage::Format_BGR888 },
-#endif
-    { libcamera::formats::BGR888, QImage::Format_RGB888 },
+    JpegErrorManager *error = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    qWarning() << "Unable to encode JPEG:" << message;
+
+    longjmp(error->jump, 1);
+}
+
+/*
+ * JPEG stores full range BT.601 YCbCr. Stretch limited range samples to it,
+ * full range ones pass through unchanged.
+ */
+struct RangeTables {
+    explicit RangeTables(bool limited)
+    {
+        for (int i = 0; i < 256; i++) {
+            luma[i] = limited ? std::clamp<long>(std::lround((i - 16) * 255 / 219.0), 0, 255) : i;
+            chroma[i] = limited ? std::clamp<long>(std::lround((i - 128) * 255 / 224.0) + 128, 0, 255) : i;
+        }
+    }
+
+    uint8_t luma[256];
+    uint8_t chroma[256];
+};
+
+/* Offset of the entropy coded data of a libjpeg baseline JPEG, 0 if malformed */
+size_t scanOffset(const std::vector<uint8_t> &jpeg, size_t *sofOffset)
+{
+    size_t pos = 2;
+
+    while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xff) {
+        uint8_t marker = jpeg[pos + 1];
+        size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+
+        if (marker == 0xc0)
+            *sofOffset = pos;
+        if (marker == 0xda)
+            return pos + 2 + length;
+
+        pos += 2 + length;
+    }
+
+    return 0;
+}
+
+/*
+ * Join strips compressed with a restart marker every MCU row into a single
+ * baseline JPEG: the headers of the first strip with the full image height,
+ * then the entropy coded data of every strip. Each strip starts after a
+ * restart marker, so the DC predictors reset there just as the encoder reset
+ * them, and all markers are renumbered to continue the modulo 8 sequence.
+ */
+bool stitch(std::vector<std::vector<uint8_t>> &strips, unsigned int height, FILE *file)
+{
+    unsigned int restart = 0;
+
+    for (size_t i = 0; i < strips.size(); i++) {
+        std::vector<uint8_t> &strip = strips[i];
+        size_t sofOffset = 0;
+        size_t scan = scanOffset(strip, &sofOffset);
+
+        if (!scan || strip.size() < scan + 2 ||
+            strip[strip.size() - 2] != 0xff || strip[strip.size() - 1] != 0xd9)
+            return false;
+
+        uint8_t *data = strip.data();
+        uint8_t *end = data + strip.size() - 2;
+        uint8_t *pos = data + scan;
+
+        if (i == 0) {
+            if (!sofOffset)
+                return false;
+
+            data[sofOffset + 5] = height >> 8;
+            data[sofOffset + 6] = height & 0xff;
+        } else {
+            /* Replace the end of the previous strip's data with a marker */
+            uint8_t marker[2] = { 0xff, static_cast<uint8_t>(0xd0 + (restart++ & 7)) };
+            if (fwrite(marker, 1, 2, file) != 2)
+                return false;
+            data = pos;
+        }
+
+        /*
+         * Renumber markers in place. Stuffed 0xff00 pairs are skipped whole
+         * so a marker is never mistaken in the middle of one.
+         */
+        while ((pos = static_cast<uint8_t *>(memchr(pos, 0xff, end - pos)))) {
+            if (pos + 1 < end && (pos[1] & 0xf8) == 0xd0)
+                pos[1] = 0xd0 + (restart++ & 7);
+            pos += 2;
+            if (pos >= end)
+                break;
+        }
+
+        if (fwrite(data, 1, end - data, file) != static_cast<size_t>(end - data))
+            return false;
+    }
+
+    static const uint8_t eoi[2] = { 0xff, 0xd9 };
+    return fwrite(eoi, 1, 2, file) == 2;
+}
+
+} /* namespace */
+
+/*
+ * An image to compress with 2x2 subsampled chroma, so MCU rows are 16 pixel
+ * rows high. write() feeds the MCU row starting at top to a started
+ * compressor, using scratch as it likes; it may run on several threads at
+ * once for different rows. sample() reads one pixel in the colour space
+ * compressed, as three components, for the thumbnail.
+ */
+struct EncoderJpeg::JpegSource {
+    unsigned int width;
+    unsigned int height;
+    J_COLOR_SPACE colorSpace;
+    int components;
+    /* YCbCr fed with jpeg_write_raw_data() rather than scanlines */
+    bool raw;
+    int quality;
+    std::function<void(jpeg_compress_struct &cinfo, unsigned int top,
+                       std::vector<uint8_t> &scratch)> write;
+    std::function<void(unsigned int x, unsigned int y, uint8_t *out)> sample;
 };
 
 EncoderJpeg::EncoderJpeg()
 {
+    setParallelism(QThread::idealThreadCount());
+}
+
+void EncoderJpeg::setParallelism(unsigned int threads)
+{
+    parallelism_ = std::max(threads, 1u);
+    converter_.setParallelism(parallelism_);
+}
+
+void EncoderJpeg::setQuality(int quality)
+{
+    quality_ = quality < 0 ? DefaultQuality : std::clamp(quality, 1, 100);
+}
 
+void EncoderJpeg::setOrientation(libcamera::Orientation orientation)
+{
+    converter_.setOrientation(orientation);
 }
 
-bool EncoderJpeg::encode(const libcamera::StreamConfiguration &cfg, libcamera::FrameBuffer *buffer, Image *image, std::string outFileName)
+void EncoderJpeg::setProgressHandler(std::function<void(int)> handler)
+{
+    progress_ = std::move(handler);
+}
+
+bool EncoderJpeg::encode(const libcamera::StreamConfiguration &cfg, libcamera::FrameBuffer *buffer, Image *image, std::string outFileName,
+                         const ExifWriter *exif)
 {
     qDebug() << Q_FUNC_INFO;
 
-    size_t size = 0;
-    for (uint plane = 0; plane < buffer->metadata().planes().size(); ++plane) {
-        size += buffer->metadata().planes()[plane].bytesused;
+    /* 4:2:0 stills are handed to libjpeg as they are, without going through RGB. */
+    if (!converter_.isOriented() && canEncodeYuv(cfg)) {
+        qInfo() << "Encoding directly from" << cfg.pixelFormat.toString().c_str();
+        return encodeYuv(cfg, image, outFileName, exif);
     }
 
-    QSize qs = QSize(cfg.size.width, cfg.size.height);
-    QImage image_;
+    QImage image_ = frameImage(converter_, cfg, buffer, image);
+    if (image_.isNull())
+        return false;
 
-    libcamera::PixelFormat pixelFormat_  = cfg.pixelFormat;
+    return encodeImage(image_, outFileName, exif);
+}
 
-    /* If format conversion is needed, configure the converter and allocate
-    * the destination image.
-    */
-    if (!::nativeFormats.contains(pixelFormat_)) {
-        int ret = converter_.configure(pixelFormat_, qs, cfg.stride);
-        if (ret < 0) {
-            qDebug() << "Unable to configure converter" << ret << qs << cfg.stride;
-            return false;
+bool EncoderJpeg::canEncodeYuv(const libcamera::StreamConfiguration &cfg)
+{
+    switch (cfg.pixelFormat) {
+    case libcamera::formats::NV12:
+    case libcamera::formats::NV21:
+    case libcamera::formats::YUV420:
+    case libcamera::formats::YVU420:
+        break;
+    default:
+        return false;
+    }
+
+    /* Other matrices would need converting, leave them to the RGB path. */
+    libcamera::ColorSpace colorSpace = cfg.colorSpace.value_or(libcamera::ColorSpace::Sycc);
+    return colorSpace.ycbcrEncoding == libcamera::ColorSpace::YcbcrEncoding::Rec601;
+}
+
+/*
+ * Feed libjpeg raw 4:2:0 data, one MCU row (16 luma and 8 chroma rows) at a
+ * time. Full range luma rows are passed straight from the mapped plane when
+ * the width is a whole number of MCUs, everything else goes through small
+ * row buffers that also provide the edge padding libjpeg expects.
+ */
+bool EncoderJpeg::encodeYuv(const libcamera::StreamConfiguration &cfg, Image *image,
+                            const std::string &outFileName, const ExifWriter *exif)
+{
+    const bool semiPlanar = cfg.pixelFormat == libcamera::formats::NV12 ||
+                            cfg.pixelFormat == libcamera::formats::NV21;
+    const bool swap = cfg.pixelFormat == libcamera::formats::NV21 ||
+                      cfg.pixelFormat == libcamera::formats::YVU420;
+    const bool limited = cfg.colorSpace.value_or(libcamera::ColorSpace::Sycc).range ==
+                         libcamera::ColorSpace::Range::Limited;
+
+    const unsigned int width = cfg.size.width;
+    const unsigned int height = cfg.size.height;
+    const unsigned int stride = cfg.stride;
+    const unsigned int chromaWidth = (width + 1) / 2;
+    const unsigned int chromaHeight = (height + 1) / 2;
+    const unsigned int chromaStride = semiPlanar ? stride : stride / 2;
+
+    /* Padded to whole MCUs */
+    const unsigned int lumaPadded = (width + 15) & ~15u;
+    const unsigned int chromaPadded = lumaPadded / 2;
+
+    const RangeTables tables(limited);
+    // libjpeg reads up to lumaPadded, which must repeat the last column
+    // rather than read the stride padding
+    const bool directLuma = !limited && width == lumaPadded;
+
+    const uint8_t *srcY = image->data(0).data();
+    const uint8_t *srcCb = image->data(semiPlanar ? 1 : (swap ? 2 : 1)).data();
+    const uint8_t *srcCr = image->data(semiPlanar ? 1 : (swap ? 1 : 2)).data();
+
+    JpegSource source;
+    source.width = width;
+    source.height = height;
+    source.colorSpace = JCS_YCbCr;
+    source.components = 3;
+    source.raw = true;
+    source.quality = quality_;
+    source.write = [&](jpeg_compress_struct &cinfo, unsigned int top, std::vector<uint8_t> &scratch) {
+        scratch.resize((directLuma ? 0 : 16 * lumaPadded) + 16 * chromaPadded);
+
+        uint8_t *cbRows = scratch.data();
+        uint8_t *crRows = cbRows + 8 * chromaPadded;
+        uint8_t *lumaRows = crRows + 8 * chromaPadded;
+
+        JSAMPROW yPointers[16];
+        JSAMPROW cbPointers[8];
+        JSAMPROW crPointers[8];
+        JSAMPARRAY planes[3] = { yPointers, cbPointers, crPointers };
+
+        /* Rows past the bottom repeat the last one */
+        for (unsigned int i = 0; i < 16; i++) {
+            const uint8_t *src = srcY + std::min(top + i, height - 1) * stride;
+
+            if (directLuma) {
+                yPointers[i] = const_cast<uint8_t *>(src);
+                continue;
+            }
+
+            uint8_t *dst = lumaRows + i * lumaPadded;
+            for (unsigned int x = 0; x < width; x++)
+                dst[x] = tables.luma[src[x]];
+            std::fill(dst + width, dst + lumaPadded, dst[width - 1]);
+            yPointers[i] = dst;
         }
 
-        image_ = QImage(qs, QImage::Format_RGB32);
+        for (unsigned int i = 0; i < 8; i++) {
+            unsigned int line = std::min(top / 2 + i, chromaHeight - 1) * chromaStride;
+            uint8_t *cb = cbRows + i * chromaPadded;
+            uint8_t *cr = crRows + i * chromaPadded;
 
-        qInfo() << "Using software format conversion from" << pixelFormat_.toString().c_str();
-        converter_.convert(image, size, &image_);
-    } else {
-        qInfo() << "Zero-copy enabled";
-        image_ = QImage(image->data(0).data(), qs.width(),
-                        qs.height(), size / qs.height(),
-                        ::nativeFormats[pixelFormat_]);
-        std::swap(buffer, buffer_);
+            if (semiPlanar) {
+                const uint8_t *src = srcCb + line;
+                const unsigned int cbPos = swap ? 1 : 0;
+
+                for (unsigned int x = 0; x < chromaWidth; x++) {
+                    cb[x] = tables.chroma[src[2 * x + cbPos]];
+                    cr[x] = tables.chroma[src[2 * x + 1 - cbPos]];
+                }
+            } else {
+                for (unsigned int x = 0; x < chromaWidth; x++) {
+                    cb[x] = tables.chroma[srcCb[line + x]];
+                    cr[x] = tables.chroma[srcCr[line + x]];
+                }
+            }
+
+            std::fill(cb + chromaWidth, cb + chromaPadded, cb[chromaWidth - 1]);
+            std::fill(cr + chromaWidth, cr + chromaPadded, cr[chromaWidth - 1]);
+            cbPointers[i] = cb;
+            crPointers[i] = cr;
+        }
+
+        jpeg_write_raw_data(&cinfo, planes, 16);
+    };
+    source.sample = [&](unsigned int x, unsigned int y, uint8_t *out) {
+        unsigned int line = y / 2 * chromaStride;
+
+        out[0] = tables.luma[srcY[y * stride + x]];
+        if (semiPlanar) {
+            const unsigned int cbPos = swap ? 1 : 0;
+            out[1] = tables.chroma[srcCb[line + x / 2 * 2 + cbPos]];
+            out[2] = tables.chroma[srcCb[line + x / 2 * 2 + 1 - cbPos]];
+        } else {
+            out[1] = tables.chroma[srcCb[line + x / 2]];
+            out[2] = tables.chroma[srcCr[line + x / 2]];
+        }
+    };
+
+    return writeJpeg(source, outFileName, exif);
+}
+
+/*
+ * Compress a converted or zero-copy RGB image with libjpeg directly, for the
+ * strip parallelism QImage::save() lacks. Formats libjpeg can't read fall
+ * back to Qt.
+ */
+bool EncoderJpeg::encodeImage(const QImage &image, const std::string &outFileName,
+                              const ExifWriter *exif)
+{
+    JpegSource source;
+    source.width = image.width();
+    source.height = image.height();
+    source.raw = false;
+    source.quality = quality_;
+
+    switch (image.format()) {
+    case QImage::Format_RGB32:
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        source.colorSpace = JCS_EXT_BGRX;
+#else
+        source.colorSpace = JCS_EXT_XRGB;
+#endif
+        source.components = 4;
+        break;
+    case QImage::Format_RGBX8888:
+        source.colorSpace = JCS_EXT_RGBX;
+        source.components = 4;
+        break;
+    case QImage::Format_RGB888:
+        source.colorSpace = JCS_EXT_RGB;
+        source.components = 3;
+        break;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    case QImage::Format_BGR888:
+        source.colorSpace = JCS_EXT_BGR;
+        source.components = 3;
+        break;
+#endif
+    default:
+        return image.save(QString::fromStdString(outFileName), "JPG", quality_);
+    }
+
+    source.write = [&](jpeg_compress_struct &cinfo, unsigned int top, std::vector<uint8_t> &) {
+        JSAMPROW rows[16];
+        unsigned int count = std::min(top + 16, source.height) - top;
+
+        for (unsigned int i = 0; i < count; i++)
+            rows[i] = const_cast<uint8_t *>(image.constScanLine(top + i));
+
+        jpeg_write_scanlines(&cinfo, rows, count);
+    };
+    source.sample = [&](unsigned int x, unsigned int y, uint8_t *out) {
+        QRgb pixel = image.pixel(x, y);
+        out[0] = qRed(pixel);
+        out[1] = qGreen(pixel);
+        out[2] = qBlue(pixel);
+    };
+
+    return writeJpeg(source, outFileName, exif);
+}
+
+/*
+ * Compress rows [top, bottom) of source as a JPEG of their own, to file or,
+ * when file is null, to memory. A restart marker after every MCU row lets
+ * strips compressed this way be stitched together. An EXIF APP1 segment,
+ * when given, replaces the JFIF header.
+ */
+bool EncoderJpeg::compress(const JpegSource &source, unsigned int top, unsigned int bottom,
+                           bool restart, FILE *file, std::vector<uint8_t> *memory,
+                           const std::vector<uint8_t> *app1,
+                           const std::function<void(int)> &progress)
+{
+    jpeg_compress_struct cinfo;
+    JpegErrorManager error;
+    unsigned char *buffer = nullptr;
+    unsigned long size = 0;
+    std::vector<uint8_t> scratch;
+
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = jpegErrorExit;
+
+    if (setjmp(error.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    if (file)
+        jpeg_stdio_dest(&cinfo, file);
+    else
+        jpeg_mem_dest(&cinfo, &buffer, &size);
+
+    cinfo.image_width = source.width;
+    cinfo.image_height = bottom - top;
+    cinfo.input_components = source.components;
+    cinfo.in_color_space = source.colorSpace;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, source.quality, TRUE);
+
+    if (restart)
+        cinfo.restart_in_rows = 1;
+
+    if (source.raw) {
+        cinfo.raw_data_in = TRUE;
+        cinfo.comp_info[0].h_samp_factor = 2;
+        cinfo.comp_info[0].v_samp_factor = 2;
+        cinfo.comp_info[1].h_samp_factor = 1;
+        cinfo.comp_info[1].v_samp_factor = 1;
+        cinfo.comp_info[2].h_samp_factor = 1;
+        cinfo.comp_info[2].v_samp_factor = 1;
+    }
+
+    if (app1)
+        cinfo.write_JFIF_header = FALSE;
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    if (app1)
+        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1->data(), app1->size());
+
+    int reported = 0;
+
+    for (unsigned int row = top; row < bottom; row += 16) {
+        source.write(cinfo, row, scratch);
+
+        int percent = (std::min(row + 16, bottom) - top) * 100 / (bottom - top);
+        if (progress && percent >= reported + 10) {
+            progress(percent);
+            reported = percent;
+        }
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    if (memory) {
+        memory->assign(buffer, buffer + size);
+        free(buffer);
     }
 
-    image_.save(QString::fromStdString(outFileName), "JPG", 92);
     return true;
 }
+
+/*
+ * Shrink source to fit the EXIF thumbnail size, averaging a 4x4 grid of
+ * samples for each pixel, and compress it. Empty if that fails.
+ */
+std::vector<uint8_t> EncoderJpeg::thumbnail(const JpegSource &source)
+{
+    const double scale = std::min(double(ExifWriter::ThumbnailWidth) / source.width,
+                                  double(ExifWriter::ThumbnailHeight) / source.height);
+    const unsigned int width = std::max(1l, std::lround(source.width * scale));
+    const unsigned int height = std::max(1l, std::lround(source.height * scale));
+
+    std::vector<uint8_t> pixels(width * height * 3);
+
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned int sum[3] = {};
+
+            for (unsigned int j = 0; j < 4; j++) {
+                for (unsigned int i = 0; i < 4; i++) {
+                    uint8_t sample[3];
+                    source.sample((x * 8 + i * 2 + 1) * source.width / (width * 8),
+                                  (y * 8 + j * 2 + 1) * source.height / (height * 8), sample);
+                    sum[0] += sample[0];
+                    sum[1] += sample[1];
+                    sum[2] += sample[2];
+                }
+            }
+
+            uint8_t *out = &pixels[(y * width + x) * 3];
+            out[0] = (sum[0] + 8) / 16;
+            out[1] = (sum[1] + 8) / 16;
+            out[2] = (sum[2] + 8) / 16;
+        }
+    }
+
+    JpegSource small;
+    small.width = width;
+    small.height = height;
+    small.colorSpace = source.raw ? JCS_YCbCr : JCS_RGB;
+    small.components = 3;
+    small.raw = false;
+    small.quality = source.quality;
+    small.write = [&](jpeg_compress_struct &cinfo, unsigned int top, std::vector<uint8_t> &) {
+        JSAMPROW rows[16];
+        unsigned int count = std::min(top + 16, height) - top;
+
+        for (unsigned int i = 0; i < count; i++)
+            rows[i] = &pixels[(top + i) * width * 3];
+
+        jpeg_write_scanlines(&cinfo, rows, count);
+    };
+
+    std::vector<uint8_t> jpeg;
+    if (!compress(small, 0, height, false, nullptr, &jpeg, nullptr, nullptr))
+        jpeg.clear();
+
+    return jpeg;
+}
+
+/*
+ * Large stills are compressed as MCU row aligned strips on the worker pool,
+ * each with a restart marker every MCU row, and stitched into one baseline
+ * JPEG. The quantised coefficients are the same as a single pass produces,
+ * so any decoder gives identical pixels either way. EXIF goes in the
+ * headers of the first strip, written in the same pass as the image.
+ */
+bool EncoderJpeg::writeJpeg(const JpegSource &source, const std::string &outFileName,
+                            const ExifWriter *exif)
+{
+    const unsigned int mcuRows = (source.height + 15) / 16;
+    const unsigned int strips = std::clamp(mcuRows / MinStripMcuRows, 1u, parallelism_);
+
+    FILE *file = fopen(outFileName.c_str(), "wb");
+    if (!file) {
+        qWarning() << "Unable to open" << outFileName.c_str();
+        return false;
+    }
+
+    std::vector<uint8_t> app1;
+    if (exif) {
+        ExifWriter tags = *exif;
+        tags.setImageSize(QSize(source.width, source.height));
+        tags.setThumbnail(thumbnail(source));
+        app1 = tags.app1();
+    }
+    const std::vector<uint8_t> *header = app1.empty() ? nullptr : &app1;
+
+    bool ok;
+
+    if (strips == 1) {
+        ok = compress(source, 0, source.height, false, file, nullptr, header, progress_);
+    } else {
+        std::vector<std::vector<uint8_t>> data(strips);
+        std::vector<char> done(strips, false);
+        std::mutex progressMutex;
+        unsigned int finished = 0;
+
+        WorkerPool::instance()->run(strips, [&](unsigned int i) {
+            unsigned int top = mcuRows * i / strips * 16;
+            unsigned int bottom = std::min(mcuRows * (i + 1) / strips * 16, source.height);
+
+            done[i] = compress(source, top, bottom, true, nullptr, &data[i],
+                               i == 0 ? header : nullptr, nullptr);
+
+            std::lock_guard<std::mutex> locker(progressMutex);
+            finished++;
+            if (progress_)
+                progress_(finished * 100 / strips);
+        });
+
+        ok = std::all_of(done.begin(), done.end(), [](char d) { return d; }) &&
+             stitch(data, source.height, file);
+    }
+
+    if (fclose(file) != 0) {
+        qWarning() << "Unable to write" << outFileName.c_str();
+        ok = false;
+    }
+
+    if (!ok)
+        remove(outFileName.c_str());
+
+    return ok;
+}
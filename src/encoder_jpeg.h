@@ -1,18 +1,49 @@
 #pragma once
 
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
 #include <vector>
 #include "format_converter.h"
+#include "stillencoder.h"
+#include <libcamera/orientation.h>
 #include <libcamera/stream.h>
 
-class EncoderJpeg
+class EncoderJpeg : public StillEncoder
 {
 public:
+    static constexpr int DefaultQuality = 92;
+
     EncoderJpeg();
 
     int configure(const libcamera::StreamConfiguration &cfg);
-    bool encode(const libcamera::StreamConfiguration &cfg, libcamera::FrameBuffer *buffer, class Image *image, std::string outFileName);
+    /* libjpeg quality */
+    void setQuality(int quality) override;
+    /* Threads for conversion and, on large stills, strip compression */
+    void setParallelism(unsigned int threads) override;
+    void setOrientation(libcamera::Orientation orientation) override;
+    void setProgressHandler(std::function<void(int)> handler) override;
+    /* exif, when given, is written with the image size and a thumbnail added */
+    bool encode(const libcamera::StreamConfiguration &cfg, libcamera::FrameBuffer *buffer, class Image *image, std::string outFileName,
+                const ExifWriter *exif = nullptr) override;
 
 private:
+    /* An image to compress, defined with libjpeg in the source */
+    struct JpegSource;
+
+    static bool canEncodeYuv(const libcamera::StreamConfiguration &cfg);
+    bool encodeYuv(const libcamera::StreamConfiguration &cfg, class Image *image,
+                   const std::string &outFileName, const ExifWriter *exif);
+    bool encodeImage(const QImage &image, const std::string &outFileName, const ExifWriter *exif);
+    bool writeJpeg(const JpegSource &source, const std::string &outFileName, const ExifWriter *exif);
+    static bool compress(const JpegSource &source, unsigned int top, unsigned int bottom,
+                         bool restart, FILE *file, std::vector<uint8_t> *memory,
+                         const std::vector<uint8_t> *app1,
+                         const std::function<void(int)> &progress);
+    static std::vector<uint8_t> thumbnail(const JpegSource &source);
+
     FormatConverter converter_;
-    libcamera::FrameBuffer *buffer_;
+    std::function<void(int)> progress_;
+    int quality_ = DefaultQuality;
+    unsigned int parallelism_ = 1;
 };
@@ -0,0 +1,190 @@
+#include "exifwriter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <time.h>
+
+#include <libcamera/control_ids.h>
+
+#include "tiffdirectory.h"
+
+namespace {
+
+enum Tag : uint16_t {
+    Compression = 0x0103,
+    Model = 0x0110,
+    Orientation = 0x0112,
+    XResolution = 0x011a,
+    YResolution = 0x011b,
+    ResolutionUnit = 0x0128,
+    Software = 0x0131,
+    DateTime = 0x0132,
+    JpegInterchangeFormat = 0x0201,
+    JpegInterchangeFormatLength = 0x0202,
+    YCbCrPositioning = 0x0213,
+    ExposureTime = 0x829a,
+    ExifIfdPointer = 0x8769,
+    PhotographicSensitivity = 0x8827,
+    ExifVersion = 0x9000,
+    DateTimeOriginal = 0x9003,
+    OffsetTimeOriginal = 0x9011,
+    ComponentsConfiguration = 0x9101,
+    SubjectDistance = 0x9206,
+    UserComment = 0x9286,
+    SubSecTimeOriginal = 0x9291,
+    FlashpixVersion = 0xa000,
+    ColorSpace = 0xa001,
+    PixelXDimension = 0xa002,
+    PixelYDimension = 0xa003,
+};
+
+void addResolution(TiffDirectory &ifd)
+{
+    ifd.addRational(XResolution, 72, 1);
+    ifd.addRational(YResolution, 72, 1);
+    ifd.addShort(ResolutionUnit, 2);
+}
+
+} // namespace
+
+ExifWriter::ExifWriter()
+    : m_dateTime(QDateTime::currentDateTime())
+{
+}
+
+void ExifWriter::setModel(const std::string &model)
+{
+    m_model = model;
+}
+
+void ExifWriter::setMetadata(const libcamera::ControlList &metadata)
+{
+    m_metadata = metadata;
+    m_exposureTime = metadata.get(libcamera::controls::ExposureTime);
+    m_colourTemperature = metadata.get(libcamera::controls::ColourTemperature);
+    m_lensPosition = metadata.get(libcamera::controls::LensPosition);
+
+    if (std::optional<float> analogue = metadata.get(libcamera::controls::AnalogueGain)) {
+        m_gain = *analogue * metadata.get(libcamera::controls::DigitalGain).value_or(1.0f);
+    }
+
+    // Sensor timestamps count from boot, date the exposure rather than the save
+    if (std::optional<int64_t> timestamp = metadata.get(libcamera::controls::SensorTimestamp)) {
+        timespec now;
+        clock_gettime(CLOCK_BOOTTIME, &now);
+        int64_t age = now.tv_sec * 1000000000LL + now.tv_nsec - *timestamp;
+        m_dateTime = QDateTime::currentDateTime().addMSecs(-std::max<int64_t>(age, 0) / 1000000);
+    }
+}
+
+const std::string &ExifWriter::model() const
+{
+    return m_model;
+}
+
+const libcamera::ControlList &ExifWriter::metadata() const
+{
+    return m_metadata;
+}
+
+QDateTime ExifWriter::dateTime() const
+{
+    return m_dateTime;
+}
+
+void ExifWriter::setImageSize(const QSize &size)
+{
+    m_size = size;
+}
+
+void ExifWriter::setThumbnail(std::vector<uint8_t> jpeg)
+{
+    m_thumbnail = std::move(jpeg);
+}
+
+std::vector<uint8_t> ExifWriter::app1() const
+{
+    static const char header[] = "Exif\0\0";
+    const std::string dateTime = m_dateTime.toString(QStringLiteral("yyyy:MM:dd HH:mm:ss")).toStdString();
+
+    TiffDirectory ifd0;
+    TiffDirectory exif;
+    TiffDirectory ifd1;
+
+    if (!m_model.empty())
+        ifd0.addAscii(Model, m_model);
+    // Orientation is applied to the pixels while encoding
+    ifd0.addShort(Orientation, 1);
+    addResolution(ifd0);
+    ifd0.addAscii(Software, "Shutter");
+    ifd0.addAscii(DateTime, dateTime);
+    ifd0.addShort(YCbCrPositioning, 1);
+    ifd0.addLong(ExifIfdPointer, 0);
+
+    if (m_exposureTime)
+        exif.addRational(ExposureTime, *m_exposureTime, 1000000);
+    // Taking unity gain as ISO 100, sensors don't report their base sensitivity
+    if (m_gain)
+        exif.addShort(PhotographicSensitivity, std::clamp<long>(std::lround(*m_gain * 100), 1, 65535));
+    exif.addUndefined(ExifVersion, "0232");
+    exif.addAscii(DateTimeOriginal, dateTime);
+    const int offset = m_dateTime.offsetFromUtc() / 60;
+    exif.addAscii(OffsetTimeOriginal, QStringLiteral("%1%2:%3")
+                                          .arg(offset < 0 ? QLatin1Char('-') : QLatin1Char('+'))
+                                          .arg(std::abs(offset) / 60, 2, 10, QLatin1Char('0'))
+                                          .arg(std::abs(offset) % 60, 2, 10, QLatin1Char('0'))
+                                          .toStdString());
+    exif.addUndefined(ComponentsConfiguration, std::string("\1\2\3\0", 4));
+    // Lens positions are in dioptres, the reciprocal of the focus distance
+    if (m_lensPosition && *m_lensPosition > 0)
+        exif.addRational(SubjectDistance, std::lround(1000 / *m_lensPosition), 1000);
+    // EXIF has no colour temperature tag, keep it readable in the comment
+    if (m_colourTemperature)
+        exif.addUndefined(UserComment, std::string("ASCII\0\0\0", 8) + "ColourTemperature=" +
+                                       std::to_string(*m_colourTemperature) + "K");
+    exif.addAscii(SubSecTimeOriginal, QStringLiteral("%1").arg(m_dateTime.time().msec(), 3, 10, QLatin1Char('0')).toStdString());
+    exif.addUndefined(FlashpixVersion, "0100");
+    exif.addShort(ColorSpace, 1);
+    if (m_size.isValid()) {
+        exif.addLong(PixelXDimension, m_size.width());
+        exif.addLong(PixelYDimension, m_size.height());
+    }
+
+    const bool thumbnail = !m_thumbnail.empty();
+    if (thumbnail) {
+        ifd1.addShort(Compression, 6);
+        addResolution(ifd1);
+        ifd1.addLong(JpegInterchangeFormat, 0);
+        ifd1.addLong(JpegInterchangeFormatLength, m_thumbnail.size());
+    }
+
+    const uint32_t exifOffset = 8 + ifd0.size();
+    const uint32_t ifd1Offset = exifOffset + exif.size();
+    const uint32_t thumbnailOffset = ifd1Offset + ifd1.size();
+
+    ifd0.addLong(ExifIfdPointer, exifOffset);
+    if (thumbnail)
+        ifd1.addLong(JpegInterchangeFormat, thumbnailOffset);
+
+    std::vector<uint8_t> out(header, header + sizeof(header) - 1);
+    std::vector<uint8_t> tiff = { 'I', 'I', 0x2a, 0x00 };
+    TiffDirectory::put32(tiff, 8);
+
+    ifd0.write(tiff, thumbnail ? ifd1Offset : 0);
+    exif.write(tiff, 0);
+    if (thumbnail) {
+        ifd1.write(tiff, 0);
+        tiff.insert(tiff.end(), m_thumbnail.begin(), m_thumbnail.end());
+    }
+
+    out.insert(out.end(), tiff.begin(), tiff.end());
+
+    // A thumbnail that doesn't fit in the segment is dropped
+    if (out.size() > 65533 && thumbnail) {
+        ExifWriter withoutThumbnail = *this;
+        withoutThumbnail.m_thumbnail.clear();
+        return withoutThumbnail.app1();
+    }
+
+    return out;
+}
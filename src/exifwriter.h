@@ -0,0 +1,54 @@
+#ifndef EXIFWRITER_H
+#define EXIFWRITER_H
+
+#include <optional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <QDateTime>
+#include <QSize>
+
+#include <libcamera/controls.h>
+
+/*
+ * Builds the EXIF APP1 segment of a still from the metadata of the request
+ * that captured it, for the encoder to write with the image data. Only a
+ * thumbnail, already compressed, and the final image size are added at
+ * encode time. Values the pipeline didn't report are left out.
+ */
+class ExifWriter
+{
+public:
+    static constexpr int ThumbnailWidth = 160;
+    static constexpr int ThumbnailHeight = 120;
+
+    ExifWriter();
+
+    void setModel(const std::string &model);
+    void setMetadata(const libcamera::ControlList &metadata);
+    void setImageSize(const QSize &size);
+    void setThumbnail(std::vector<uint8_t> jpeg);
+
+    /* "Exif\0\0" and the TIFF structure, at most 65533 bytes for one APP1 */
+    std::vector<uint8_t> app1() const;
+
+    /* For formats that record more of the capture, such as DNG */
+    const std::string &model() const;
+    const libcamera::ControlList &metadata() const;
+    /* When the exposure was taken, or the writer created without a timestamp */
+    QDateTime dateTime() const;
+
+private:
+    std::string m_model;
+    libcamera::ControlList m_metadata;
+    QDateTime m_dateTime;
+    std::optional<int32_t> m_exposureTime;
+    std::optional<float> m_gain;
+    std::optional<int32_t> m_colourTemperature;
+    std::optional<float> m_lensPosition;
+    QSize m_size;
+    std::vector<uint8_t> m_thumbnail;
+};
+
+#endif // EXIFWRITER_H
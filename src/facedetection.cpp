@@ -4,6 +4,8 @@
 #include <QTemporaryFile>
 #include <QImage>
 
+#include <algorithm>
+
 FaceDetection::FaceDetection()
 {
     QFile xml(QLatin1String(":assets/classifiers/lbpcascade_frontalface.xml"));
@@ -35,44 +37,37 @@ FaceDetection::FaceDetection()
     }
 }
 
-QList<QRectF> FaceDetection::detect(QImage image)
+QList<QRectF> FaceDetection::detect(const AnalysisFrame &frame)
 {
     //qDebug() << Q_FUNC_INFO;
 
-    if (image.isNull()) {
+    if (frame.isNull()) {
          QList<QRectF> r;
             return r;
     }
 
-    image = image.convertToFormat(QImage::Format_RGB888);
-    cv::Mat frame(image.height(),
-                  image.width(),
-                  CV_8UC3,
-                  image.bits(),
-                  image.bytesPerLine());
-
-    //cv::flip(frame, frame, 0);
-
-    cv::Mat frameGray;
-
-    if(frame.channels() == 3){
-        cvtColor( frame, frameGray, cv::COLOR_BGR2GRAY );
-    }else if(frame.channels() == 4) {
-        cvtColor( frame, frameGray, cv::COLOR_BGRA2GRAY );
-    }
-
-    cv::equalizeHist( frameGray, frameGray );
+    // Box filter most of the way down on the luma plane, cv::resize does the rest
+    AnalysisFrame luma = frame.subsampled(std::max(1, frame.size().width() / 320));
+    cv::Mat frameGray(luma.size().height(),
+                      luma.size().width(),
+                      CV_8UC1,
+                      const_cast<uint8_t *>(luma.data()),
+                      luma.stride());
 
     std::vector<cv::Rect> detected;
 
     //resize the frame
-    double imageWidth = image.size().width();
-    double imageHeight = image.size().height();
+    double imageWidth = frame.size().width();
+    double imageHeight = frame.size().height();
 
     double resizedWidth = 320;
     double resizedHeight = (imageHeight/imageWidth) * resizedWidth;
 
-    cv::resize(frameGray, frameGray, cv::Size((int)resizedWidth, (int)resizedHeight));
+    cv::Mat resized;
+    cv::resize(frameGray, resized, cv::Size((int)resizedWidth, (int)resizedHeight));
+    frameGray = resized;
+
+    cv::equalizeHist( frameGray, frameGray );
 
     classifier.detectMultiScale(frameGray, detected, 1.1, 2, 0|cv::CASCADE_SCALE_IMAGE, cv::Size(30, 30));
 
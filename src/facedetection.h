@@ -8,11 +8,13 @@
 #include <opencv2/objdetect.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "analysisframe.h"
+
 class FaceDetection
 {
 public:
     FaceDetection();
-    QList<QRectF> detect(QImage image);
+    QList<QRectF> detect(const AnalysisFrame &frame);
 
 private:
     cv::CascadeClassifier classifier;
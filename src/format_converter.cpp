@@ -7,8 +7,9 @@
 
 #include "format_converter.h"
 
+#include <algorithm>
+#include <cmath>
 #include <errno.h>
-#include <utility>
 
 #include <QImage>
 
@@ -16,347 +17,1160 @@
 
 #include "image.h"
 #include "qdebug.h"
+#include "workerpool.h"
 
-#define RGBSHIFT		8
-#ifndef MAX
-#define MAX(a,b)		((a)>(b)?(a):(b))
-#endif
-#ifndef MIN
-#define MIN(a,b)		((a)<(b)?(a):(b))
-#endif
-#ifndef CLAMP
-#define CLAMP(a,low,high)	MAX((low),MIN((high),(a)))
-#endif
-#ifndef CLIP
-#define CLIP(x)			CLAMP(x,0,255)
-#endif
+/*
+ * Only the Y'CbCr encoding and the quantisation range matter here, the
+ * primaries and transfer function are left to the display.
+ */
+FormatConverterSimd::YuvCoefficients
+FormatConverter::yuvCoefficients(const libcamera::ColorSpace &colorSpace)
+{
+	double kr, kb;
+
+	switch (colorSpace.ycbcrEncoding) {
+	case libcamera::ColorSpace::YcbcrEncoding::Rec709:
+		kr = 0.2126;
+		kb = 0.0722;
+		break;
+	case libcamera::ColorSpace::YcbcrEncoding::Rec2020:
+		kr = 0.2627;
+		kb = 0.0593;
+		break;
+	case libcamera::ColorSpace::YcbcrEncoding::None:
+	case libcamera::ColorSpace::YcbcrEncoding::Rec601:
+	default:
+		kr = 0.299;
+		kb = 0.114;
+		break;
+	}
+
+	bool limited = colorSpace.range == libcamera::ColorSpace::Range::Limited;
+	double yScale = limited ? 255.0 / 219.0 : 1.0;
+	double cScale = limited ? 255.0 / 224.0 : 1.0;
+	double kg = 1.0 - kr - kb;
+
+	auto fixed = [](double value) {
+		return static_cast<int16_t>(std::lround(value * 256));
+	};
+
+	FormatConverterSimd::YuvCoefficients k;
+	k.yOffset = limited ? 16 : 0;
+	k.y = fixed(yScale);
+	k.crR = fixed((2 - 2 * kr) * cScale);
+	k.cbG = fixed(-(2 - 2 * kb) * kb / kg * cScale);
+	k.crG = fixed(-(2 - 2 * kr) * kr / kg * cScale);
+	k.cbB = fixed((2 - 2 * kb) * cScale);
+
+	return k;
+}
 
 int FormatConverter::configure(const libcamera::PixelFormat &format,
-			       const QSize &size, unsigned int stride)
+			       const QSize &size, unsigned int stride,
+			       const libcamera::ColorSpace &colorSpace)
 {
-    qDebug() << Q_FUNC_INFO << QString::fromStdString(format.toString()) << size << stride;
+    qDebug() << Q_FUNC_INFO << QString::fromStdString(format.toString()) << size << stride
+             << QString::fromStdString(colorSpace.toString());
+
+	/* Bayer formats are validated before any state changes. */
+	unsigned int bayerBits = 0;
+	FormatConverterSimd::BayerRowLayout bayerLayout = FormatConverterSimd::BayerRowLayout::BG;
 
 	switch (format) {
 	case libcamera::formats::NV12:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = false;
+		useYUVSemiPlanar<2, 2, false>();
 		break;
 	case libcamera::formats::NV21:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = true;
+		useYUVSemiPlanar<2, 2, true>();
 		break;
 	case libcamera::formats::NV16:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 1;
-		nvSwap_ = false;
+		useYUVSemiPlanar<2, 1, false>();
 		break;
 	case libcamera::formats::NV61:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 1;
-		nvSwap_ = true;
+		useYUVSemiPlanar<2, 1, true>();
 		break;
 	case libcamera::formats::NV24:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 1;
-		vertSubSample_ = 1;
-		nvSwap_ = false;
+		useYUVSemiPlanar<1, 1, false>();
 		break;
 	case libcamera::formats::NV42:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 1;
-		vertSubSample_ = 1;
-		nvSwap_ = true;
+		useYUVSemiPlanar<1, 1, true>();
 		break;
 
 	case libcamera::formats::R8:
-		formatFamily_ = RGB;
-		r_pos_ = 0;
-		g_pos_ = 0;
-		b_pos_ = 0;
-		bpp_ = 1;
+		useRGB<1, 0, 0, 0>();
 		break;
 	case libcamera::formats::RGB888:
-		formatFamily_ = RGB;
-		r_pos_ = 2;
-		g_pos_ = 1;
-		b_pos_ = 0;
-		bpp_ = 3;
+		useRGB<3, 2, 1, 0>();
 		break;
 	case libcamera::formats::BGR888:
-		formatFamily_ = RGB;
-		r_pos_ = 0;
-		g_pos_ = 1;
-		b_pos_ = 2;
-		bpp_ = 3;
+		useRGB<3, 0, 1, 2>();
 		break;
 	case libcamera::formats::ARGB8888:
 	case libcamera::formats::XRGB8888:
-		formatFamily_ = RGB;
-		r_pos_ = 2;
-		g_pos_ = 1;
-		b_pos_ = 0;
-		bpp_ = 4;
+		useRGB<4, 2, 1, 0>();
 		break;
 	case libcamera::formats::RGBA8888:
 	case libcamera::formats::RGBX8888:
-		formatFamily_ = RGB;
-		r_pos_ = 3;
-		g_pos_ = 2;
-		b_pos_ = 1;
-		bpp_ = 4;
+		useRGB<4, 3, 2, 1>();
 		break;
 	case libcamera::formats::ABGR8888:
 	case libcamera::formats::XBGR8888:
-		formatFamily_ = RGB;
-		r_pos_ = 0;
-		g_pos_ = 1;
-		b_pos_ = 2;
-		bpp_ = 4;
+		useRGB<4, 0, 1, 2>();
 		break;
 	case libcamera::formats::BGRA8888:
 	case libcamera::formats::BGRX8888:
-		formatFamily_ = RGB;
-		r_pos_ = 1;
-		g_pos_ = 2;
-		b_pos_ = 3;
-		bpp_ = 4;
+		useRGB<4, 1, 2, 3>();
 		break;
 
 	case libcamera::formats::VYUY:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 1;
-		cb_pos_ = 2;
+		useYUVPacked<1, 2>();
 		break;
 	case libcamera::formats::YVYU:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 0;
-		cb_pos_ = 3;
+		useYUVPacked<0, 3>();
 		break;
 	case libcamera::formats::UYVY:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 1;
-		cb_pos_ = 0;
+		useYUVPacked<1, 0>();
 		break;
 	case libcamera::formats::YUYV:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 0;
-		cb_pos_ = 1;
+		useYUVPacked<0, 1>();
 		break;
 
 	case libcamera::formats::YUV420:
-		formatFamily_ = YUVPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = false;
+		useYUVPlanar<2, false>();
 		break;
 	case libcamera::formats::YVU420:
-		formatFamily_ = YUVPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = true;
+		useYUVPlanar<2, true>();
 		break;
 	case libcamera::formats::YUV422:
-		formatFamily_ = YUVPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 1;
-		nvSwap_ = false;
+		useYUVPlanar<1, false>();
+		break;
+
+	case libcamera::formats::SBGGR8:
+		bayerBits = 8;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::BG;
+		break;
+	case libcamera::formats::SGBRG8:
+		bayerBits = 8;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::GB;
+		break;
+	case libcamera::formats::SGRBG8:
+		bayerBits = 8;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::GR;
+		break;
+	case libcamera::formats::SRGGB8:
+		bayerBits = 8;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::RG;
+		break;
+	case libcamera::formats::SBGGR10_CSI2P:
+		bayerBits = 10;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::BG;
+		break;
+	case libcamera::formats::SGBRG10_CSI2P:
+		bayerBits = 10;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::GB;
+		break;
+	case libcamera::formats::SGRBG10_CSI2P:
+		bayerBits = 10;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::GR;
+		break;
+	case libcamera::formats::SRGGB10_CSI2P:
+		bayerBits = 10;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::RG;
+		break;
+	case libcamera::formats::SBGGR12_CSI2P:
+		bayerBits = 12;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::BG;
+		break;
+	case libcamera::formats::SGBRG12_CSI2P:
+		bayerBits = 12;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::GB;
+		break;
+	case libcamera::formats::SGRBG12_CSI2P:
+		bayerBits = 12;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::GR;
+		break;
+	case libcamera::formats::SRGGB12_CSI2P:
+		bayerBits = 12;
+		bayerLayout = FormatConverterSimd::BayerRowLayout::RG;
 		break;
 
 	case libcamera::formats::MJPEG:
 		formatFamily_ = MJPEG;
+		rowKernel_ = nullptr;
+		scaleKernel_ = nullptr;
 		break;
 
 	default:
 		return -EINVAL;
 	};
 
+	if (bayerBits) {
+		/* Demosaicing works on 2x2 CFA quads, with a mirrored border. */
+		if (size.width() < 2 || size.height() < 2 || size.width() % 2)
+			return -EINVAL;
+
+		if (bayerBits == 8)
+			useBayer<8>(bayerLayout);
+		else if (bayerBits == 10)
+			useBayer<10>(bayerLayout);
+		else
+			useBayer<12>(bayerLayout);
+	}
+
 	format_ = format;
 	width_ = size.width();
 	height_ = size.height();
 	stride_ = stride;
 
+	yuvTables_.build(yuvCoefficients(colorSpace));
+
+	if (formatFamily_ == Bayer)
+		updateBayer();
+
+	updateScaling();
+
 	return 0;
 }
 
+void FormatConverter::setParallelism(unsigned int threads,
+				     unsigned int minBandHeight)
+{
+	threads_ = std::max(threads, 1u);
+	minBandHeight_ = std::max(minBandHeight, 2u);
+}
+
+void FormatConverter::setSimdLevel(FormatConverterSimd::SimdLevel level)
+{
+	simdLevel_ = level;
+}
+
+namespace {
+
+/*
+ * Rows converted at a time before being written out oriented, few enough
+ * for the strip to stay in the cache.
+ */
+constexpr unsigned int OrientationStripHeight = 32;
+
+unsigned char *orientationStrip(unsigned int width)
+{
+	static thread_local std::vector<unsigned char> strip;
+
+	strip.resize(OrientationStripHeight * width * 4);
+	return strip.data();
+}
+
+} /* namespace */
+
 void FormatConverter::convert(const Image *src, size_t size, QImage *dst)
 {
-	switch (formatFamily_) {
-	case MJPEG:
-		dst->loadFromData(src->data(0).data(), size, "JPEG");
-		break;
-	case RGB:
-		convertRGB(src, dst->bits());
-		break;
-	case YUVPacked:
-		convertYUVPacked(src, dst->bits());
-		break;
-	case YUVSemiPlanar:
-		convertYUVSemiPlanar(src, dst->bits());
-		break;
-	case YUVPlanar:
-		convertYUVPlanar(src, dst->bits());
-		break;
-	};
+	if (formatFamily_ == MJPEG) {
+		/*
+		 * Fall back to Qt for anything libjpeg rejects, at full size and
+		 * unoriented, as the destination will be reallocated for the next
+		 * frame anyway.
+		 */
+		if (dst->format() != QImage::Format_RGB32 ||
+		    dst->size() != outputSize() ||
+		    !decodeJpeg(src, size, dst->bits()))
+			dst->loadFromData(src->data(0).data(), size, "JPEG");
+		return;
+	}
+
+	unsigned char *bits = dst->bits();
+	unsigned int bands = std::min({ threads_, outHeight_ / minBandHeight_,
+				       WorkerPool::instance()->threadCount() });
+
+	if (bands <= 1) {
+		convertRows(src, bits, 0, outHeight_);
+		return;
+	}
+
+	/*
+	 * Every output row only depends on its own source row (and chroma row
+	 * pair for 4:2:0), so bands are independent. Keep them on an even row
+	 * to not split chroma rows between threads.
+	 */
+	unsigned int bandHeight = (outHeight_ + bands - 1) / bands;
+	bandHeight = (bandHeight + 1) & ~1u;
+	bands = (outHeight_ + bandHeight - 1) / bandHeight;
+
+	WorkerPool::instance()->run(bands, [&](unsigned int band) {
+		unsigned int top = band * bandHeight;
+		unsigned int bottom = std::min(top + bandHeight, outHeight_);
+
+		convertRows(src, bits, top, bottom);
+	});
 }
 
-static void yuv_to_rgb(int y, int u, int v, int *r, int *g, int *b)
+void FormatConverter::convertRows(const Image *src, unsigned char *dst,
+				  unsigned int top, unsigned int bottom)
 {
-	int c = y - 16;
-	int d = u - 128;
-	int e = v - 128;
-	*r = CLIP(( 298 * c           + 409 * e + 128) >> RGBSHIFT);
-	*g = CLIP(( 298 * c - 100 * d - 208 * e + 128) >> RGBSHIFT);
-	*b = CLIP(( 298 * c + 516 * d           + 128) >> RGBSHIFT);
+	if (!oriented_) {
+		(this->*kernel_)(src, dst + top * outWidth_ * 4, top, bottom);
+		return;
+	}
+
+	/*
+	 * Convert a few rows at a time to a strip that stays in cache and write
+	 * it out oriented, rather than orienting a whole converted frame.
+	 */
+	unsigned char *strip = orientationStrip(outWidth_);
+
+	for (unsigned int y = top; y < bottom; y += OrientationStripHeight) {
+		unsigned int end = std::min(y + OrientationStripHeight, bottom);
+
+		(this->*kernel_)(src, strip, y, end);
+		orientRows(strip, dst, y, end);
+	}
 }
 
-void FormatConverter::convertRGB(const Image *srcImage, unsigned char *dst)
+bool FormatConverter::decodeJpeg(const Image *src, size_t size, unsigned char *dst)
 {
-	const unsigned char *src = srcImage->data(0).data();
-	unsigned int x, y;
-	int r, g, b;
-
-	for (y = 0; y < height_; y++) {
-		for (x = 0; x < width_; x++) {
-			r = src[bpp_ * x + r_pos_];
-			g = src[bpp_ * x + g_pos_];
-			b = src[bpp_ * x + b_pos_];
-
-			dst[4 * x + 0] = b;
-			dst[4 * x + 1] = g;
-			dst[4 * x + 2] = r;
-			dst[4 * x + 3] = 0xff;
+	const uint8_t *data = src->data(0).data();
+	QSize frameSize(width_, height_);
+
+	if (!oriented_)
+		return jpegDecoder_.decode(data, size, frameSize, jpegDenominator_,
+					   dst, outWidth_ * 4);
+
+	unsigned char *strip = orientationStrip(outWidth_);
+
+	if (!jpegDecoder_.start(data, size, frameSize, jpegDenominator_))
+		return false;
+
+	for (unsigned int y = 0; y < outHeight_; y += OrientationStripHeight) {
+		unsigned int end = std::min(y + OrientationStripHeight, outHeight_);
+
+		if (!jpegDecoder_.readRows(strip, outWidth_ * 4, end - y))
+			return false;
+
+		orientRows(strip, dst, y, end);
+	}
+
+	return jpegDecoder_.finish();
+}
+
+
+/* -----------------------------------------------------------------------------
+ * Format kernels
+ *
+ * The layout of each format is a template parameter, so every supported
+ * format gets its own instantiation with constant offsets and strides.
+ */
+
+template<unsigned int Bpp, unsigned int RPos, unsigned int GPos, unsigned int BPos>
+void FormatConverter::convertRGB(const Image *srcImage, unsigned char *dst,
+				 unsigned int top, unsigned int bottom)
+{
+	const unsigned char *src = srcImage->data(0).data() + top * stride_;
+
+	for (unsigned int y = top; y < bottom; y++) {
+		const unsigned char *line = src;
+
+		for (unsigned int x = 0; x < width_; x++) {
+			dst[0] = line[BPos];
+			dst[1] = line[GPos];
+			dst[2] = line[RPos];
+			dst[3] = 0xff;
+
+			line += Bpp;
+			dst += 4;
 		}
 
 		src += stride_;
-		dst += width_ * 4;
 	}
 }
 
-void FormatConverter::convertYUVPacked(const Image *srcImage, unsigned char *dst)
+template<unsigned int YPos, unsigned int CbPos>
+void FormatConverter::convertYUVPacked(const Image *srcImage, unsigned char *dst,
+				       unsigned int top, unsigned int bottom)
 {
-	const unsigned char *src = srcImage->data(0).data();
-	unsigned int src_x, src_y, dst_x, dst_y;
-	unsigned int src_stride;
-	unsigned int dst_stride;
-	unsigned int cr_pos;
-	int r, g, b, y, cr, cb;
-
-	cr_pos = (cb_pos_ + 2) % 4;
-	src_stride = stride_;
-	dst_stride = width_ * 4;
-
-	for (src_y = 0, dst_y = 0; dst_y < height_; src_y++, dst_y++) {
-		for (src_x = 0, dst_x = 0; dst_x < width_; ) {
-			cb = src[src_y * src_stride + src_x * 4 + cb_pos_];
-			cr = src[src_y * src_stride + src_x * 4 + cr_pos];
-
-			y = src[src_y * src_stride + src_x * 4 + y_pos_];
-			yuv_to_rgb(y, cb, cr, &r, &g, &b);
-			dst[dst_y * dst_stride + 4 * dst_x + 0] = b;
-			dst[dst_y * dst_stride + 4 * dst_x + 1] = g;
-			dst[dst_y * dst_stride + 4 * dst_x + 2] = r;
-			dst[dst_y * dst_stride + 4 * dst_x + 3] = 0xff;
-			dst_x++;
-
-			y = src[src_y * src_stride + src_x * 4 + y_pos_ + 2];
-			yuv_to_rgb(y, cb, cr, &r, &g, &b);
-			dst[dst_y * dst_stride + 4 * dst_x + 0] = b;
-			dst[dst_y * dst_stride + 4 * dst_x + 1] = g;
-			dst[dst_y * dst_stride + 4 * dst_x + 2] = r;
-			dst[dst_y * dst_stride + 4 * dst_x + 3] = 0xff;
-			dst_x++;
-
-			src_x++;
+	constexpr unsigned int CrPos = (CbPos + 2) % 4;
+	const unsigned char *src = srcImage->data(0).data() + top * stride_;
+	unsigned int dst_stride = width_ * 4;
+
+	for (unsigned int y = top; y < bottom; y++) {
+		const unsigned char *line = src;
+		unsigned char *out = dst;
+
+		for (unsigned int x = 0; x < width_; x += 2) {
+			unsigned int cb = line[CbPos];
+			unsigned int cr = line[CrPos];
+
+			FormatConverterSimd::yuvToBgra(line[YPos], cb, cr,
+						       yuvTables_, out);
+			FormatConverterSimd::yuvToBgra(line[YPos + 2], cb, cr,
+						       yuvTables_, out + 4);
+
+			line += 4;
+			out += 8;
 		}
+
+		src += stride_;
+		dst += dst_stride;
 	}
 }
 
-void FormatConverter::convertYUVPlanar(const Image *srcImage, unsigned char *dst)
+template<unsigned int VertSubSample, bool Swap>
+void FormatConverter::convertYUVPlanar(const Image *srcImage, unsigned char *dst,
+				       unsigned int top, unsigned int bottom)
 {
-	unsigned int c_stride = stride_ / horzSubSample_;
-	unsigned int c_inc = horzSubSample_ == 1 ? 1 : 0;
+	unsigned int c_stride = stride_ / 2;
 	const unsigned char *src_y = srcImage->data(0).data();
-	const unsigned char *src_cb = srcImage->data(1).data();
-	const unsigned char *src_cr = srcImage->data(2).data();
-	int r, g, b;
-
-	if (nvSwap_)
-		std::swap(src_cb, src_cr);
+	const unsigned char *src_cb = srcImage->data(Swap ? 2 : 1).data();
+	const unsigned char *src_cr = srcImage->data(Swap ? 1 : 2).data();
 
-	for (unsigned int y = 0; y < height_; y++) {
+	for (unsigned int y = top; y < bottom; y++) {
 		const unsigned char *line_y = src_y + y * stride_;
-		const unsigned char *line_cb = src_cb + (y / vertSubSample_) *
+		const unsigned char *line_cb = src_cb + (y / VertSubSample) *
 					       c_stride;
-		const unsigned char *line_cr = src_cr + (y / vertSubSample_) *
+		const unsigned char *line_cr = src_cr + (y / VertSubSample) *
 					       c_stride;
 
-		for (unsigned int x = 0; x < width_; x += 2) {
-			yuv_to_rgb(*line_y, *line_cb, *line_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			line_y++;
-			line_cb += c_inc;
-			line_cr += c_inc;
+		yuvRow_(line_y, line_cb, line_cr, dst, width_, yuvTables_);
+		dst += width_ * 4;
+	}
+}
+
+template<unsigned int HorzSubSample, unsigned int VertSubSample>
+void FormatConverter::convertYUVSemiPlanar(const Image *srcImage, unsigned char *dst,
+					   unsigned int top, unsigned int bottom)
+{
+	unsigned int c_stride = stride_ * (2 / HorzSubSample);
+	const unsigned char *src = srcImage->data(0).data();
+	const unsigned char *src_c = srcImage->data(1).data();
+
+	for (unsigned int y = top; y < bottom; y++) {
+		const unsigned char *line_y = src + y * stride_;
+		const unsigned char *line_c = src_c + (y / VertSubSample) *
+					      c_stride;
+
+		yuvRow_(line_y, line_c, nullptr, dst, width_, yuvTables_);
+		dst += width_ * 4;
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Fused downscaling
+ */
+
+void FormatConverter::setOutputSize(const QSize &size, Scaling scaling)
+{
+	/* configure() and setOrientation() rebuild the taps they affect. */
+	if (size == requestedSize_ && scaling == scaling_)
+		return;
+
+	requestedSize_ = size;
+	scaling_ = scaling;
+
+	updateScaling();
+}
+
+QSize FormatConverter::outputSize() const
+{
+	if (transposed_)
+		return QSize(outHeight_, outWidth_);
+
+	return QSize(outWidth_, outHeight_);
+}
+
+void FormatConverter::updateScaling()
+{
+	outWidth_ = width_;
+	outHeight_ = height_;
+	scaled_ = false;
+	kernel_ = rowKernel_;
+
+	jpegDenominator_ = 1;
+
+	/* Scale the unoriented image, to the requested size before orientation */
+	QSize requested = transposed_ ? requestedSize_.transposed() : requestedSize_;
+
+	if (requested.isEmpty() ||
+	    (static_cast<unsigned int>(requested.width()) >= width_ &&
+	     static_cast<unsigned int>(requested.height()) >= height_))
+		return;
+
+	if (formatFamily_ == MJPEG) {
+		QSize size(width_, height_);
+
+		jpegDenominator_ = DecoderJpeg::scaleDenominator(size, requested);
+		size = DecoderJpeg::scaledSize(size, jpegDenominator_);
+		outWidth_ = size.width();
+		outHeight_ = size.height();
+		return;
+	}
+
+	outWidth_ = std::min<unsigned int>(requested.width(), width_);
+	outHeight_ = std::min<unsigned int>(requested.height(), height_);
+	scaled_ = true;
+	kernel_ = scaleKernel_;
+
+	/*
+	 * Map each output sample to its footprint in the source, in 16.16 fixed
+	 * point. Box filtering averages the whole footprint, bilinear filtering
+	 * interpolates between the two samples around its centre. Chroma is
+	 * always taken from the sample nearest to the centre.
+	 */
+	auto buildTaps = [this](std::vector<ScaleTap> &taps, unsigned int src,
+				unsigned int dst) {
+		taps.resize(dst);
+
+		for (unsigned int i = 0; i < dst; i++) {
+			ScaleTap &tap = taps[i];
+			uint64_t start = (uint64_t)i * src * 65536 / dst;
+			uint64_t end = (uint64_t)(i + 1) * src * 65536 / dst;
+			uint64_t centre = (start + end) / 2;
+
+			tap.centre = std::min<unsigned int>(centre >> 16, src - 1);
+
+			if (scaling_ == Scaling::Box) {
+				tap.first = start >> 16;
+				tap.last = std::clamp<unsigned int>((end - 1) >> 16,
+								    tap.first, src - 1);
+				tap.weight = 0;
+			} else {
+				uint64_t pos = centre > 32768 ? centre - 32768 : 0;
+
+				tap.first = std::min<unsigned int>(pos >> 16, src - 1);
+				tap.last = std::min(tap.first + 1, src - 1);
+				tap.weight = (pos & 0xffff) >> 8;
+			}
+		}
+	};
+
+	buildTaps(xTaps_, width_, outWidth_);
+	buildTaps(yTaps_, height_, outHeight_);
+}
+
+namespace {
+
+/* Sample accessors for the source layouts, see scaleYUVRows(). */
+
+template<unsigned int VertSubSample, bool Swap>
+struct PlanarSource {
+	PlanarSource(const Image *image, unsigned int stride)
+		: y(image->data(0).data()),
+		  cb(image->data(Swap ? 2 : 1).data()),
+		  cr(image->data(Swap ? 1 : 2).data()),
+		  stride(stride), cStride(stride / 2)
+	{
+	}
+
+	const uint8_t *row(unsigned int line) const { return y + line * stride; }
+	unsigned int sample(const uint8_t *line, unsigned int x) const { return line[x]; }
+
+	void chroma(unsigned int x, unsigned int line, unsigned int *u, unsigned int *v) const
+	{
+		unsigned int offset = (line / VertSubSample) * cStride + x / 2;
+
+		*u = cb[offset];
+		*v = cr[offset];
+	}
+
+	const uint8_t *y;
+	const uint8_t *cb;
+	const uint8_t *cr;
+	unsigned int stride;
+	unsigned int cStride;
+};
+
+template<unsigned int HorzSubSample, unsigned int VertSubSample, bool Swap>
+struct SemiPlanarSource {
+	SemiPlanarSource(const Image *image, unsigned int stride)
+		: y(image->data(0).data()), c(image->data(1).data()),
+		  stride(stride), cStride(stride * (2 / HorzSubSample))
+	{
+	}
+
+	const uint8_t *row(unsigned int line) const { return y + line * stride; }
+	unsigned int sample(const uint8_t *line, unsigned int x) const { return line[x]; }
+
+	void chroma(unsigned int x, unsigned int line, unsigned int *u, unsigned int *v) const
+	{
+		const uint8_t *pair = c + (line / VertSubSample) * cStride +
+				      (x / HorzSubSample) * 2;
+
+		*u = pair[Swap ? 1 : 0];
+		*v = pair[Swap ? 0 : 1];
+	}
+
+	const uint8_t *y;
+	const uint8_t *c;
+	unsigned int stride;
+	unsigned int cStride;
+};
+
+template<unsigned int YPos, unsigned int CbPos>
+struct PackedSource {
+	static constexpr unsigned int CrPos = (CbPos + 2) % 4;
+
+	PackedSource(const Image *image, unsigned int stride)
+		: src(image->data(0).data()), stride(stride)
+	{
+	}
+
+	const uint8_t *row(unsigned int line) const { return src + line * stride; }
+
+	unsigned int sample(const uint8_t *line, unsigned int x) const
+	{
+		return line[(x / 2) * 4 + YPos + (x & 1) * 2];
+	}
+
+	void chroma(unsigned int x, unsigned int line, unsigned int *u, unsigned int *v) const
+	{
+		const uint8_t *pair = row(line) + (x / 2) * 4;
+
+		*u = pair[CbPos];
+		*v = pair[CrPos];
+	}
+
+	const uint8_t *src;
+	unsigned int stride;
+};
+
+/* One channel of an RGB source, selected by its byte offset. */
+template<unsigned int Bpp, unsigned int Pos>
+struct RGBChannelSource {
+	const uint8_t *row(unsigned int line) const { return src + line * stride; }
+	unsigned int sample(const uint8_t *line, unsigned int x) const { return line[Bpp * x + Pos]; }
+
+	const uint8_t *src;
+	unsigned int stride;
+};
+
+template<typename Source, typename Tap>
+unsigned int filterBox(const Source &src, const Tap &tx, const Tap &ty)
+{
+	unsigned int count = (tx.last - tx.first + 1) * (ty.last - ty.first + 1);
+	unsigned int sum = count / 2;
+
+	for (unsigned int y = ty.first; y <= ty.last; y++) {
+		const uint8_t *line = src.row(y);
+
+		for (unsigned int x = tx.first; x <= tx.last; x++)
+			sum += src.sample(line, x);
+	}
+
+	return sum / count;
+}
+
+template<typename Source, typename Tap>
+unsigned int filterBilinear(const Source &src, const Tap &tx, const Tap &ty)
+{
+	const uint8_t *line0 = src.row(ty.first);
+	const uint8_t *line1 = src.row(ty.last);
+	unsigned int top = src.sample(line0, tx.first) * (256 - tx.weight) +
+			   src.sample(line0, tx.last) * tx.weight;
+	unsigned int bottom = src.sample(line1, tx.first) * (256 - tx.weight) +
+			      src.sample(line1, tx.last) * tx.weight;
+
+	return (top * (256 - ty.weight) + bottom * ty.weight + (1 << 15)) >> 16;
+}
+
+template<typename Source, typename Tap>
+unsigned int filter(const Source &src, const Tap &tx, const Tap &ty, bool box)
+{
+	return box ? filterBox(src, tx, ty) : filterBilinear(src, tx, ty);
+}
+
+template<typename Source, typename Tap>
+void scaleYUVRows(const Source &src, const std::vector<Tap> &xTaps,
+		  const std::vector<Tap> &yTaps, bool box,
+		  const FormatConverterSimd::YuvTables &tables,
+		  unsigned char *dst, unsigned int top, unsigned int bottom)
+{
+	for (unsigned int y = top; y < bottom; y++) {
+		const Tap &ty = yTaps[y];
+
+		for (const Tap &tx : xTaps) {
+			unsigned int luma = filter(src, tx, ty, box);
+			unsigned int cb, cr;
+
+			src.chroma(tx.centre, ty.centre, &cb, &cr);
+			FormatConverterSimd::yuvToBgra(luma, cb, cr, tables, dst);
 			dst += 4;
+		}
+	}
+}
 
-			yuv_to_rgb(*line_y, *line_cb, *line_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
+template<typename RSource, typename GSource, typename BSource, typename Tap>
+void scaleRGBRows(const RSource &r, const GSource &g, const BSource &b,
+		  const std::vector<Tap> &xTaps, const std::vector<Tap> &yTaps,
+		  bool box, unsigned char *dst, unsigned int top,
+		  unsigned int bottom)
+{
+	for (unsigned int y = top; y < bottom; y++) {
+		const Tap &ty = yTaps[y];
+
+		for (const Tap &tx : xTaps) {
+			dst[0] = filter(b, tx, ty, box);
+			dst[1] = filter(g, tx, ty, box);
+			dst[2] = filter(r, tx, ty, box);
 			dst[3] = 0xff;
-			line_y++;
-			line_cb += 1;
-			line_cr += 1;
 			dst += 4;
 		}
 	}
 }
 
-void FormatConverter::convertYUVSemiPlanar(const Image *srcImage, unsigned char *dst)
+} /* namespace */
+
+template<unsigned int Bpp, unsigned int RPos, unsigned int GPos, unsigned int BPos>
+void FormatConverter::scaleRGB(const Image *srcImage, unsigned char *dst,
+			       unsigned int top, unsigned int bottom)
 {
-	unsigned int c_stride = stride_ * (2 / horzSubSample_);
-	unsigned int c_inc = horzSubSample_ == 1 ? 2 : 0;
-	unsigned int cb_pos = nvSwap_ ? 1 : 0;
-	unsigned int cr_pos = nvSwap_ ? 0 : 1;
-	const unsigned char *src = srcImage->data(0).data();
-	const unsigned char *src_c = srcImage->data(1).data();
-	int r, g, b;
+	const uint8_t *src = srcImage->data(0).data();
 
-	for (unsigned int y = 0; y < height_; y++) {
-		const unsigned char *src_y = src + y * stride_;
-		const unsigned char *src_cb = src_c + (y / vertSubSample_) *
-					      c_stride + cb_pos;
-		const unsigned char *src_cr = src_c + (y / vertSubSample_) *
-					      c_stride + cr_pos;
+	scaleRGBRows(RGBChannelSource<Bpp, RPos>{ src, stride_ },
+		     RGBChannelSource<Bpp, GPos>{ src, stride_ },
+		     RGBChannelSource<Bpp, BPos>{ src, stride_ },
+		     xTaps_, yTaps_, scaling_ == Scaling::Box, dst, top, bottom);
+}
 
-		for (unsigned int x = 0; x < width_; x += 2) {
-			yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			src_y++;
-			src_cb += c_inc;
-			src_cr += c_inc;
-			dst += 4;
+template<typename Source>
+void FormatConverter::scaleYUV(const Image *srcImage, unsigned char *dst,
+			       unsigned int top, unsigned int bottom)
+{
+	scaleYUVRows(Source(srcImage, stride_), xTaps_, yTaps_,
+		     scaling_ == Scaling::Box, yuvTables_, dst, top, bottom);
+}
+
+/* -----------------------------------------------------------------------------
+ * Orientation
+ */
+
+void FormatConverter::setOrientation(libcamera::Orientation orientation, bool mirror)
+{
+	using libcamera::Orientation;
+
+	OrientationMap &m = orientationMap_;
+
+	switch (orientation) {
+	case Orientation::Rotate0:
+	default:
+		m = { 0, 1, 0, 0, 0, 1 };
+		break;
+	case Orientation::Rotate0Mirror:
+		m = { 1, -1, 0, 0, 0, 1 };
+		break;
+	case Orientation::Rotate180:
+		m = { 1, -1, 0, 1, 0, -1 };
+		break;
+	case Orientation::Rotate180Mirror:
+		m = { 0, 1, 0, 1, 0, -1 };
+		break;
+	case Orientation::Rotate90Mirror:
+		m = { 0, 0, 1, 0, 1, 0 };
+		break;
+	case Orientation::Rotate270:
+		m = { 1, 0, -1, 0, 1, 0 };
+		break;
+	case Orientation::Rotate270Mirror:
+		m = { 1, 0, -1, 1, -1, 0 };
+		break;
+	case Orientation::Rotate90:
+		m = { 0, 0, 1, 1, -1, 0 };
+		break;
+	}
+
+	if (mirror) {
+		m.cx = 1 - m.cx;
+		m.ax = -m.ax;
+		m.ay = -m.ay;
+	}
+
+	transposed_ = m.ax == 0;
+	oriented_ = m.cx != 0 || m.ax != 1 || m.cy != 0 || m.by != 1;
+
+	updateScaling();
+}
+
+QRectF FormatConverter::mapRect(const QRectF &rect) const
+{
+	const OrientationMap &m = orientationMap_;
+	auto map = [&m](const QPointF &p) {
+		return QPointF(m.cx + m.ax * p.x() + m.ay * p.y(),
+			       m.cy + m.bx * p.x() + m.by * p.y());
+	};
+
+	return QRectF(map(rect.topLeft()), map(rect.bottomRight())).normalized();
+}
+
+/*
+ * Write unoriented rows top to bottom (exclusive), stored contiguously at
+ * rows, to their place in the oriented output image dst.
+ */
+void FormatConverter::orientRows(const unsigned char *rows, unsigned char *dst,
+				 unsigned int top, unsigned int bottom) const
+{
+	const OrientationMap &m = orientationMap_;
+	const ptrdiff_t width = transposed_ ? outHeight_ : outWidth_;
+	const ptrdiff_t height = transposed_ ? outWidth_ : outHeight_;
+
+	/* Output offsets of unoriented pixel (0, 0) and of steps along x and y */
+	const ptrdiff_t origin = m.cy * (height - 1) * width + m.cx * (width - 1);
+	const ptrdiff_t dx = m.bx * width + m.ax;
+	const ptrdiff_t dy = m.by * width + m.ay;
+
+	const uint32_t *in = reinterpret_cast<const uint32_t *>(rows);
+	uint32_t *out = reinterpret_cast<uint32_t *>(dst);
+	unsigned int count = bottom - top;
+
+	if (transposed_) {
+		/* Unoriented columns become output rows, write them in runs. */
+		for (unsigned int x = 0; x < outWidth_; x++) {
+			const uint32_t *src = in + x;
+			uint32_t *line = out + origin + x * dx + top * dy;
+
+			for (unsigned int y = 0; y < count; y++) {
+				*line = *src;
+				src += outWidth_;
+				line += dy;
+			}
+		}
+
+		return;
+	}
+
+	for (unsigned int y = 0; y < count; y++) {
+		const uint32_t *src = in + y * outWidth_;
+		uint32_t *line = out + origin + (top + y) * dy;
+
+		if (dx == 1) {
+			std::copy_n(src, outWidth_, line);
+			continue;
+		}
+
+		std::reverse_copy(src, src + outWidth_, line - (outWidth_ - 1));
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Bayer demosaicing
+ */
+
+namespace {
+
+/*
+ * Unpack a row of raw samples through the lookup tables of the even and
+ * odd columns, and mirror one sample on each side. CSI-2 packing stores
+ * the 8 MSBs of each sample followed by a byte with the LSBs of the group,
+ * 4 samples in 5 bytes for 10 bits and 2 samples in 3 bytes for 12 bits.
+ */
+template<unsigned int Bits>
+void unpackBayerRow(const uint8_t *src, unsigned int width,
+		    const uint8_t *lut0, const uint8_t *lut1, uint8_t *dst)
+{
+	unsigned int x = 0;
+
+	if constexpr (Bits == 8) {
+		for (; x < width; x += 2) {
+			dst[x] = lut0[src[x]];
+			dst[x + 1] = lut1[src[x + 1]];
+		}
+	} else if constexpr (Bits == 10) {
+		for (; x + 4 <= width; x += 4, src += 5) {
+			dst[x] = lut0[(src[0] << 2) | (src[4] & 3)];
+			dst[x + 1] = lut1[(src[1] << 2) | ((src[4] >> 2) & 3)];
+			dst[x + 2] = lut0[(src[2] << 2) | ((src[4] >> 4) & 3)];
+			dst[x + 3] = lut1[(src[3] << 2) | (src[4] >> 6)];
+		}
+
+		/* A last group of two samples still has its LSB byte. */
+		if (x < width) {
+			dst[x] = lut0[(src[0] << 2) | (src[4] & 3)];
+			dst[x + 1] = lut1[(src[1] << 2) | ((src[4] >> 2) & 3)];
+		}
+	} else {
+		for (; x < width; x += 2, src += 3) {
+			dst[x] = lut0[(src[0] << 4) | (src[2] & 0xf)];
+			dst[x + 1] = lut1[(src[1] << 4) | (src[2] >> 4)];
+		}
+	}
+
+	dst[-1] = dst[1];
+	dst[width] = dst[width - 2];
+}
+
+/* One channel of demosaiced BGRA rows cached modulo rows. */
+template<unsigned int Pos>
+struct CachedRowSource {
+	const uint8_t *row(unsigned int line) const { return base + (line % rows) * stride; }
+	unsigned int sample(const uint8_t *line, unsigned int x) const { return line[4 * x + Pos]; }
+
+	const uint8_t *base;
+	unsigned int stride;
+	unsigned int rows;
+};
+
+/* Colours of the even and odd samples of a row, 0 to 2 for R, G and B. */
+void bayerColours(FormatConverterSimd::BayerRowLayout layout, unsigned int *colours)
+{
+	using FormatConverterSimd::BayerRowLayout;
+
+	colours[0] = layout == BayerRowLayout::BG ? 2 : layout == BayerRowLayout::RG ? 0 : 1;
+	colours[1] = layout == BayerRowLayout::GB ? 2 : layout == BayerRowLayout::GR ? 0 : 1;
+}
+
+FormatConverterSimd::BayerRowLayout nextBayerRow(FormatConverterSimd::BayerRowLayout layout)
+{
+	using FormatConverterSimd::BayerRowLayout;
+
+	switch (layout) {
+	case BayerRowLayout::BG:
+		return BayerRowLayout::GR;
+	case BayerRowLayout::GB:
+		return BayerRowLayout::RG;
+	case BayerRowLayout::GR:
+		return BayerRowLayout::BG;
+	case BayerRowLayout::RG:
+	default:
+		return BayerRowLayout::GB;
+	}
+}
+
+} /* namespace */
+
+/*
+ * Bands run on pool threads and each thread keeps its own buffers, which
+ * are only reallocated when the frame gets wider. Rows are tagged with
+ * their index so neighbouring output rows reuse them.
+ */
+struct FormatConverter::BayerScratch {
+	void reset(unsigned int width, unsigned int rgbRows)
+	{
+		lineStride = width + 2;
+		lines.resize(3 * lineStride);
+		std::fill(std::begin(lineTags), std::end(lineTags), -1);
+
+		rgbStride = width * 4;
+		rgb.resize(rgbRows * rgbStride);
+		rgbTags.assign(rgbRows, -1);
+	}
+
+	/* Unpacked rows, with one mirrored sample on each side */
+	std::vector<uint8_t> lines;
+	unsigned int lineStride;
+	int lineTags[3];
+
+	/* Demosaiced rows for the scaling kernel */
+	std::vector<uint8_t> rgb;
+	unsigned int rgbStride;
+	std::vector<int> rgbTags;
+};
+
+FormatConverter::BayerScratch &FormatConverter::bayerScratch()
+{
+	static thread_local BayerScratch scratch;
+	return scratch;
+}
+
+void FormatConverter::setBayerParameters(const BayerParameters &params)
+{
+	/* Rebuilding the tables is costly, and metadata mostly repeats. */
+	if (params == bayerParams_)
+		return;
+
+	bayerParams_ = params;
+
+	if (formatFamily_ == Bayer)
+		updateBayer();
+}
+
+void FormatConverter::updateBayer()
+{
+	using namespace FormatConverterSimd;
 
-			yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
+	const float gains[3] = {
+		bayerParams_.redGain,
+		bayerParams_.greenGain,
+		bayerParams_.blueGain,
+	};
+	unsigned int size = 1 << bayerBits_;
+	double black = std::min(bayerParams_.blackLevel, 65535u) / 65536.0;
+	double gamma = bayerParams_.gamma > 0 ? 1.0 / bayerParams_.gamma : 1.0;
+
+	for (unsigned int c = 0; c < 3; c++) {
+		bayerLut_[c].resize(size);
+
+		for (unsigned int v = 0; v < size; v++) {
+			double value = (static_cast<double>(v) / size - black) /
+				       (1.0 - black) * gains[c];
+
+			value = std::clamp(value, 0.0, 1.0);
+			bayerLut_[c][v] = std::lround(std::pow(value, gamma) * 255);
+		}
+	}
+
+	BayerRowLayout layouts[2] = { bayerLayout_, nextBayerRow(bayerLayout_) };
+	bool edgeAware = bayerParams_.demosaic == Demosaic::EdgeAware;
+
+	for (unsigned int i = 0; i < 2; i++) {
+		unsigned int colours[2];
+
+		bayerColours(layouts[i], colours);
+		bayerRowLut_[i][0] = bayerLut_[colours[0]].data();
+		bayerRowLut_[i][1] = bayerLut_[colours[1]].data();
+		bayerRow_[i] = bayerRowFunction(layouts[i], edgeAware, simdLevel_);
+	}
+}
+
+template<unsigned int Bits>
+const uint8_t *FormatConverter::bayerLine(const Image *src, BayerScratch &scratch,
+					  int y)
+{
+	/* Mirror around the first and last rows, keeping the CFA phase. */
+	if (y < 0)
+		y = 1;
+	else if (y >= static_cast<int>(height_))
+		y = height_ - 2;
+
+	unsigned int slot = y % 3;
+	uint8_t *line = scratch.lines.data() + slot * scratch.lineStride + 1;
+
+	if (scratch.lineTags[slot] != y) {
+		unpackBayerRow<Bits>(src->data(0).data() + y * stride_, width_,
+				     bayerRowLut_[y & 1][0], bayerRowLut_[y & 1][1],
+				     line);
+		scratch.lineTags[slot] = y;
+	}
+
+	return line;
+}
+
+template<unsigned int Bits>
+void FormatConverter::demosaicRow(const Image *src, BayerScratch &scratch,
+				  unsigned int y, uint8_t *dst)
+{
+	const uint8_t *above = bayerLine<Bits>(src, scratch, y - 1);
+	const uint8_t *row = bayerLine<Bits>(src, scratch, y);
+	const uint8_t *below = bayerLine<Bits>(src, scratch, y + 1);
+
+	bayerRow_[y & 1](above, row, below, dst, width_);
+}
+
+template<unsigned int Bits>
+void FormatConverter::convertBayer(const Image *src, unsigned char *dst,
+				   unsigned int top, unsigned int bottom)
+{
+	BayerScratch &scratch = bayerScratch();
+
+	scratch.reset(width_, 0);
+
+	for (unsigned int y = top; y < bottom; y++) {
+		demosaicRow<Bits>(src, scratch, y, dst);
+		dst += width_ * 4;
+	}
+}
+
+/*
+ * Demosaic the source rows of each output row's footprint at full
+ * resolution, then filter them like an RGB source.
+ */
+template<unsigned int Bits>
+void FormatConverter::scaleBayer(const Image *src, unsigned char *dst,
+				 unsigned int top, unsigned int bottom)
+{
+	BayerScratch &scratch = bayerScratch();
+	bool box = scaling_ == Scaling::Box;
+	unsigned int rows = 1;
+
+	for (unsigned int y = top; y < bottom; y++)
+		rows = std::max(rows, yTaps_[y].last - yTaps_[y].first + 1);
+
+	scratch.reset(width_, rows);
+
+	const CachedRowSource<0> blue{ scratch.rgb.data(), scratch.rgbStride, rows };
+	const CachedRowSource<1> green{ scratch.rgb.data(), scratch.rgbStride, rows };
+	const CachedRowSource<2> red{ scratch.rgb.data(), scratch.rgbStride, rows };
+
+	for (unsigned int y = top; y < bottom; y++) {
+		const ScaleTap &ty = yTaps_[y];
+
+		for (unsigned int line = ty.first; line <= ty.last; line++) {
+			unsigned int slot = line % rows;
+
+			if (scratch.rgbTags[slot] == static_cast<int>(line))
+				continue;
+
+			demosaicRow<Bits>(src, scratch, line,
+					  scratch.rgb.data() + slot * scratch.rgbStride);
+			scratch.rgbTags[slot] = line;
+		}
+
+		for (const ScaleTap &tx : xTaps_) {
+			dst[0] = filter(blue, tx, ty, box);
+			dst[1] = filter(green, tx, ty, box);
+			dst[2] = filter(red, tx, ty, box);
 			dst[3] = 0xff;
-			src_y++;
-			src_cb += 2;
-			src_cr += 2;
 			dst += 4;
 		}
 	}
 }
+
+/* -----------------------------------------------------------------------------
+ * Kernel selection
+ */
+
+template<unsigned int Bpp, unsigned int RPos, unsigned int GPos, unsigned int BPos>
+void FormatConverter::useRGB()
+{
+	formatFamily_ = RGB;
+	rowKernel_ = &FormatConverter::convertRGB<Bpp, RPos, GPos, BPos>;
+	scaleKernel_ = &FormatConverter::scaleRGB<Bpp, RPos, GPos, BPos>;
+}
+
+template<unsigned int YPos, unsigned int CbPos>
+void FormatConverter::useYUVPacked()
+{
+	formatFamily_ = YUVPacked;
+	rowKernel_ = &FormatConverter::convertYUVPacked<YPos, CbPos>;
+	scaleKernel_ = &FormatConverter::scaleYUV<PackedSource<YPos, CbPos>>;
+}
+
+template<unsigned int VertSubSample, bool Swap>
+void FormatConverter::useYUVPlanar()
+{
+	formatFamily_ = YUVPlanar;
+	rowKernel_ = &FormatConverter::convertYUVPlanar<VertSubSample, Swap>;
+	scaleKernel_ = &FormatConverter::scaleYUV<PlanarSource<VertSubSample, Swap>>;
+
+	selectYuvRow(FormatConverterSimd::YuvRowLayout::Planar422);
+}
+
+template<unsigned int HorzSubSample, unsigned int VertSubSample, bool Swap>
+void FormatConverter::useYUVSemiPlanar()
+{
+	using FormatConverterSimd::YuvRowLayout;
+
+	formatFamily_ = YUVSemiPlanar;
+	rowKernel_ = &FormatConverter::convertYUVSemiPlanar<HorzSubSample, VertSubSample>;
+	scaleKernel_ = &FormatConverter::scaleYUV<
+		SemiPlanarSource<HorzSubSample, VertSubSample, Swap>>;
+
+	if (HorzSubSample == 2)
+		selectYuvRow(Swap ? YuvRowLayout::SemiPlanar422Swap
+				  : YuvRowLayout::SemiPlanar422);
+	else
+		selectYuvRow(Swap ? YuvRowLayout::SemiPlanar444Swap
+				  : YuvRowLayout::SemiPlanar444);
+}
+
+template<unsigned int Bits>
+void FormatConverter::useBayer(FormatConverterSimd::BayerRowLayout layout)
+{
+	formatFamily_ = Bayer;
+	rowKernel_ = &FormatConverter::convertBayer<Bits>;
+	scaleKernel_ = &FormatConverter::scaleBayer<Bits>;
+	bayerBits_ = Bits;
+	bayerLayout_ = layout;
+}
+
+void FormatConverter::selectYuvRow(FormatConverterSimd::YuvRowLayout layout)
+{
+	yuvRow_ = FormatConverterSimd::yuvRowFunction(layout, simdLevel_);
+
+	qDebug() << "Using" << FormatConverterSimd::simdLevelName(simdLevel_)
+		 << "YUV row kernel";
+}
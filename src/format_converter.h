@@ -8,11 +8,18 @@
 #pragma once
 
 #include <stddef.h>
+#include <vector>
 
+#include <QRectF>
 #include <QSize>
 
+#include <libcamera/color_space.h>
+#include <libcamera/orientation.h>
 #include <libcamera/pixel_format.h>
 
+#include "decoder_jpeg.h"
+#include "format_converter_simd.h"
+
 class Image;
 class QImage;
 
@@ -20,10 +27,96 @@ class FormatConverter
 {
 public:
 	int configure(const libcamera::PixelFormat &format, const QSize &size,
-		      unsigned int stride);
+		      unsigned int stride, const libcamera::ColorSpace &colorSpace);
 
 	void convert(const Image *src, size_t size, QImage *dst);
 
+	/*
+	 * Convert in horizontal bands of at least minBandHeight rows on up to
+	 * threads threads of the shared worker pool. The default of a single
+	 * thread converts on the calling thread only.
+	 */
+	void setParallelism(unsigned int threads, unsigned int minBandHeight = 32);
+
+	enum class Scaling {
+		Box,
+		Bilinear,
+	};
+
+	/*
+	 * Downscale to fit size (keeping the aspect ratio is left to the
+	 * caller) while converting, so no full resolution image is produced.
+	 * An invalid size, or one not smaller than the stream, disables
+	 * scaling. The destination image must be outputSize() large.
+	 *
+	 * MJPEG is scaled by 1/2, 1/4 or 1/8 in the DCT domain while decoding,
+	 * so outputSize() is the smallest of those not below size.
+	 *
+	 * Setting the current size and scaling again does nothing, so callers
+	 * may set it for every frame.
+	 */
+	void setOutputSize(const QSize &size, Scaling scaling = Scaling::Bilinear);
+	QSize outputSize() const;
+
+	/*
+	 * Write the output upright. The orientation is the one of the frames,
+	 * as reported by libcamera::CameraConfiguration::orientation, and is
+	 * undone while converting. Mirroring then flips the upright output
+	 * horizontally, as expected of front camera previews. Orientations
+	 * with a 90 or 270 degree rotation transpose outputSize() and the size
+	 * passed to setOutputSize().
+	 */
+	void setOrientation(libcamera::Orientation orientation, bool mirror = false);
+	bool isOriented() const { return oriented_; }
+	bool isTransposed() const { return transposed_; }
+
+	/* Map a rectangle normalised to the frame to the oriented output. */
+	QRectF mapRect(const QRectF &rect) const;
+
+	enum class Demosaic {
+		Bilinear,
+		EdgeAware,
+	};
+
+	/*
+	 * Raw Bayer processing. Samples are black level corrected, multiplied
+	 * by the gain of their colour and gamma encoded through lookup tables
+	 * before demosaicing. The black level is on the 16-bit scale used by
+	 * libcamera::controls::SensorBlackLevels.
+	 */
+	struct BayerParameters {
+		unsigned int blackLevel = 4096;
+		float redGain = 1.0f;
+		float greenGain = 1.0f;
+		float blueGain = 1.0f;
+		float gamma = 2.2f;
+		Demosaic demosaic = Demosaic::Bilinear;
+
+		bool operator==(const BayerParameters &other) const
+		{
+			return blackLevel == other.blackLevel &&
+			       redGain == other.redGain &&
+			       greenGain == other.greenGain &&
+			       blueGain == other.blueGain &&
+			       gamma == other.gamma &&
+			       demosaic == other.demosaic;
+		}
+	};
+
+	/* Setting the current parameters again does nothing. */
+	void setBayerParameters(const BayerParameters &params);
+
+	/*
+	 * Use row kernels of at most the given instruction set, for checking
+	 * them against the scalar reference. Defaults to the best the CPU
+	 * supports, and takes effect at the next configure().
+	 */
+	void setSimdLevel(FormatConverterSimd::SimdLevel level);
+
+	/* Fixed point YCbCr to RGB matrix used for a colour space. */
+	static FormatConverterSimd::YuvCoefficients
+	yuvCoefficients(const libcamera::ColorSpace &colorSpace);
+
 private:
 	enum FormatFamily {
 		MJPEG,
@@ -31,32 +124,142 @@ private:
 		YUVPacked,
 		YUVPlanar,
 		YUVSemiPlanar,
+		Bayer,
 	};
 
-	void convertRGB(const Image *src, unsigned char *dst);
-	void convertYUVPacked(const Image *src, unsigned char *dst);
-	void convertYUVPlanar(const Image *src, unsigned char *dst);
-	void convertYUVSemiPlanar(const Image *src, unsigned char *dst);
+	/* Per thread line buffers of the Bayer kernels */
+	struct BayerScratch;
+
+	/*
+	 * Converts rows top to bottom (exclusive) of the unoriented output
+	 * image, writing them contiguously from dst.
+	 */
+	using ConvertFunc = void (FormatConverter::*)(const Image *src,
+						      unsigned char *dst,
+						      unsigned int top,
+						      unsigned int bottom);
+
+	void convertRows(const Image *src, unsigned char *dst,
+			 unsigned int top, unsigned int bottom);
+	bool decodeJpeg(const Image *src, size_t size, unsigned char *dst);
+
+	template<unsigned int Bpp, unsigned int RPos, unsigned int GPos, unsigned int BPos>
+	void convertRGB(const Image *src, unsigned char *dst,
+			unsigned int top, unsigned int bottom);
+	template<unsigned int YPos, unsigned int CbPos>
+	void convertYUVPacked(const Image *src, unsigned char *dst,
+			      unsigned int top, unsigned int bottom);
+	template<unsigned int VertSubSample, bool Swap>
+	void convertYUVPlanar(const Image *src, unsigned char *dst,
+			      unsigned int top, unsigned int bottom);
+	template<unsigned int HorzSubSample, unsigned int VertSubSample>
+	void convertYUVSemiPlanar(const Image *src, unsigned char *dst,
+				  unsigned int top, unsigned int bottom);
+
+	template<unsigned int Bpp, unsigned int RPos, unsigned int GPos, unsigned int BPos>
+	void scaleRGB(const Image *src, unsigned char *dst,
+		      unsigned int top, unsigned int bottom);
+	template<typename Source>
+	void scaleYUV(const Image *src, unsigned char *dst,
+		      unsigned int top, unsigned int bottom);
+
+	template<unsigned int Bits>
+	void convertBayer(const Image *src, unsigned char *dst,
+			  unsigned int top, unsigned int bottom);
+	template<unsigned int Bits>
+	void scaleBayer(const Image *src, unsigned char *dst,
+			unsigned int top, unsigned int bottom);
+	template<unsigned int Bits>
+	const uint8_t *bayerLine(const Image *src, BayerScratch &scratch, int y);
+	template<unsigned int Bits>
+	void demosaicRow(const Image *src, BayerScratch &scratch,
+			 unsigned int y, uint8_t *dst);
+	static BayerScratch &bayerScratch();
+
+	template<unsigned int Bpp, unsigned int RPos, unsigned int GPos, unsigned int BPos>
+	void useRGB();
+	template<unsigned int YPos, unsigned int CbPos>
+	void useYUVPacked();
+	template<unsigned int VertSubSample, bool Swap>
+	void useYUVPlanar();
+	template<unsigned int HorzSubSample, unsigned int VertSubSample, bool Swap>
+	void useYUVSemiPlanar();
+	template<unsigned int Bits>
+	void useBayer(FormatConverterSimd::BayerRowLayout layout);
+	void selectYuvRow(FormatConverterSimd::YuvRowLayout layout);
+	void updateBayer();
+
+	void updateScaling();
+	void orientRows(const unsigned char *rows, unsigned char *dst,
+			unsigned int top, unsigned int bottom) const;
 
 	libcamera::PixelFormat format_;
-	unsigned int width_;
-	unsigned int height_;
+	unsigned int width_ = 0;
+	unsigned int height_ = 0;
 	unsigned int stride_;
 
-	enum FormatFamily formatFamily_;
+	enum FormatFamily formatFamily_ = RGB;
+
+	/* Banded conversion */
+	unsigned int threads_ = 1;
+	unsigned int minBandHeight_ = 32;
+
+	/* Fused downscaling, source samples for each output column and row */
+	struct ScaleTap {
+		unsigned int first;
+		unsigned int last;
+		unsigned int weight;	/* bilinear weight of last, in 1/256 */
+		unsigned int centre;
+	};
+
+	QSize requestedSize_;
+	Scaling scaling_ = Scaling::Bilinear;
+	bool scaled_ = false;
+	unsigned int outWidth_ = 0;
+	unsigned int outHeight_ = 0;
+	std::vector<ScaleTap> xTaps_;
+	std::vector<ScaleTap> yTaps_;
+
+	/*
+	 * Output orientation. Unoriented pixel (x, y) lands on output column
+	 * cx * (width - 1) + ax * x + ay * y and row cy * (height - 1) +
+	 * bx * x + by * y.
+	 */
+	struct OrientationMap {
+		int cx, ax, ay;
+		int cy, bx, by;
+	};
+
+	OrientationMap orientationMap_ = { 0, 1, 0, 0, 0, 1 };
+	bool oriented_ = false;
+	bool transposed_ = false;
+
+	/* MJPEG decoder, reused across frames, and its DCT scaling factor */
+	DecoderJpeg jpegDecoder_;
+	unsigned int jpegDenominator_ = 1;
+
+	/*
+	 * Kernels for the configured format, with its layout as template
+	 * parameters. kernel_ is the one in use for the current output size.
+	 */
+	ConvertFunc rowKernel_ = nullptr;
+	ConvertFunc scaleKernel_ = nullptr;
+	ConvertFunc kernel_ = nullptr;
+
+	/* Instruction set cap of the row kernels */
+	FormatConverterSimd::SimdLevel simdLevel_ = FormatConverterSimd::detectSimdLevel();
 
-	/* NV parameters */
-	unsigned int horzSubSample_;
-	unsigned int vertSubSample_;
-	bool nvSwap_;
+	/* Colour space dependent YUV to RGB tables */
+	FormatConverterSimd::YuvTables yuvTables_;
 
-	/* RGB parameters */
-	unsigned int bpp_;
-	unsigned int r_pos_;
-	unsigned int g_pos_;
-	unsigned int b_pos_;
+	/* Planar and semi-planar row kernel, vectorised when available */
+	FormatConverterSimd::YuvRowFunc yuvRow_;
 
-	/* YUV parameters */
-	unsigned int y_pos_;
-	unsigned int cb_pos_;
+	/* Bayer parameters, tables and row kernels, indexed by row parity */
+	BayerParameters bayerParams_;
+	unsigned int bayerBits_ = 8;
+	FormatConverterSimd::BayerRowLayout bayerLayout_;
+	std::vector<uint8_t> bayerLut_[3];
+	const uint8_t *bayerRowLut_[2][2];
+	FormatConverterSimd::BayerRowFunc bayerRow_[2];
 };
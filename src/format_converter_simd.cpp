@@ -0,0 +1,817 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * format_converter_simd.cpp - Vectorised YUV and Bayer to RGB32 row kernels
+ *
+ * All YUV kernels compute exactly the same fixed point arithmetic as the scalar
+ * reference: (c * Y' + cr * Cr' + cb * Cb' + 128) >> 8, saturated to 8 bits.
+ * The scalar version looks the products up in tables, the vector versions
+ * multiply-accumulate into 32 bits and saturate with the narrowing packs, so
+ * their output is bit-exact with the reference.
+ */
+
+#include "format_converter_simd.h"
+
+#include <stdlib.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FORMAT_CONVERTER_HAVE_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FORMAT_CONVERTER_HAVE_NEON 1
+#endif
+
+namespace FormatConverterSimd {
+
+void YuvTables::build(const YuvCoefficients &k)
+{
+	coeffs = k;
+
+	for (int i = 0; i < 256; i++) {
+		y[i] = (i - k.yOffset) * k.y + 128;
+		crR[i] = (i - 128) * k.crR;
+		cbG[i] = (i - 128) * k.cbG;
+		crG[i] = (i - 128) * k.crG;
+		cbB[i] = (i - 128) * k.cbB;
+	}
+}
+
+namespace {
+
+/* -----------------------------------------------------------------------------
+ * Scalar reference
+ */
+
+template<YuvRowLayout Layout>
+inline void chromaAt(const uint8_t *c0, const uint8_t *c1, unsigned int x,
+		     int *cb, int *cr)
+{
+	switch (Layout) {
+	case YuvRowLayout::Planar422:
+		*cb = c0[x / 2];
+		*cr = c1[x / 2];
+		break;
+	case YuvRowLayout::SemiPlanar422:
+		*cb = c0[x & ~1u];
+		*cr = c0[(x & ~1u) + 1];
+		break;
+	case YuvRowLayout::SemiPlanar422Swap:
+		*cr = c0[x & ~1u];
+		*cb = c0[(x & ~1u) + 1];
+		break;
+	case YuvRowLayout::SemiPlanar444:
+		*cb = c0[2 * x];
+		*cr = c0[2 * x + 1];
+		break;
+	case YuvRowLayout::SemiPlanar444Swap:
+		*cr = c0[2 * x];
+		*cb = c0[2 * x + 1];
+		break;
+	}
+}
+
+template<YuvRowLayout Layout>
+void yuvRowC(const uint8_t *y, const uint8_t *c0, const uint8_t *c1,
+	     uint8_t *dst, unsigned int width, const YuvTables &t)
+{
+	for (unsigned int x = 0; x < width; x++) {
+		int cb, cr;
+
+		chromaAt<Layout>(c0, c1, x, &cb, &cr);
+		yuvToBgra(y[x], cb, cr, t, dst + 4 * x);
+	}
+}
+
+/*
+ * Finish a row with the scalar reference, starting at pixel x. The vector
+ * loops always stop on an even pixel, so chroma offsets stay aligned on a
+ * sample.
+ */
+template<YuvRowLayout Layout>
+void yuvRowTail(const uint8_t *y, const uint8_t *c0, const uint8_t *c1,
+		uint8_t *dst, unsigned int x, unsigned int width,
+		const YuvTables &t)
+{
+	if (x >= width)
+		return;
+
+	switch (Layout) {
+	case YuvRowLayout::Planar422:
+		c0 += x / 2;
+		c1 += x / 2;
+		break;
+	case YuvRowLayout::SemiPlanar422:
+	case YuvRowLayout::SemiPlanar422Swap:
+		c0 += x;
+		break;
+	case YuvRowLayout::SemiPlanar444:
+	case YuvRowLayout::SemiPlanar444Swap:
+		c0 += 2 * x;
+		break;
+	}
+
+	yuvRowC<Layout>(y + x, c0, c1, dst + 4 * x, width - x, t);
+}
+
+constexpr bool isSwapped(YuvRowLayout layout)
+{
+	return layout == YuvRowLayout::SemiPlanar422Swap ||
+	       layout == YuvRowLayout::SemiPlanar444Swap;
+}
+
+#if FORMAT_CONVERTER_HAVE_X86
+
+/* -----------------------------------------------------------------------------
+ * SSE2, 16 pixels per iteration
+ */
+
+struct Sse2Constants {
+	explicit Sse2Constants(const YuvCoefficients &k)
+	{
+		yOffset = _mm_set1_epi16(k.yOffset);
+		bias = _mm_set1_epi16(128);
+		one = _mm_set1_epi16(1);
+		round = _mm_set1_epi32(128);
+		/* Pairs of 16-bit coefficients for _mm_madd_epi16(). */
+		yCrR = _mm_set1_epi32((uint16_t)k.y | (k.crR << 16));
+		yCbG = _mm_set1_epi32((uint16_t)k.y | (k.cbG << 16));
+		crGRound = _mm_set1_epi32((uint16_t)k.crG | (128 << 16));
+		yCbB = _mm_set1_epi32((uint16_t)k.y | (k.cbB << 16));
+	}
+
+	__m128i yOffset;
+	__m128i bias;
+	__m128i one;
+	__m128i round;
+	__m128i yCrR;
+	__m128i yCbG;
+	__m128i crGRound;
+	__m128i yCbB;
+};
+
+/* Convert 8 pixels held as 16-bit Y, Cb and Cr and store 32 BGRA bytes. */
+inline void convert8Sse2(__m128i y, __m128i cb, __m128i cr,
+			 const Sse2Constants &k, uint8_t *dst)
+{
+	__m128i c = _mm_sub_epi16(y, k.yOffset);
+	__m128i d = _mm_sub_epi16(cb, k.bias);
+	__m128i e = _mm_sub_epi16(cr, k.bias);
+
+	__m128i ceLo = _mm_unpacklo_epi16(c, e);
+	__m128i ceHi = _mm_unpackhi_epi16(c, e);
+	__m128i cdLo = _mm_unpacklo_epi16(c, d);
+	__m128i cdHi = _mm_unpackhi_epi16(c, d);
+	__m128i e1Lo = _mm_unpacklo_epi16(e, k.one);
+	__m128i e1Hi = _mm_unpackhi_epi16(e, k.one);
+
+	__m128i rLo = _mm_add_epi32(_mm_madd_epi16(ceLo, k.yCrR), k.round);
+	__m128i rHi = _mm_add_epi32(_mm_madd_epi16(ceHi, k.yCrR), k.round);
+	__m128i gLo = _mm_add_epi32(_mm_madd_epi16(cdLo, k.yCbG),
+				    _mm_madd_epi16(e1Lo, k.crGRound));
+	__m128i gHi = _mm_add_epi32(_mm_madd_epi16(cdHi, k.yCbG),
+				    _mm_madd_epi16(e1Hi, k.crGRound));
+	__m128i bLo = _mm_add_epi32(_mm_madd_epi16(cdLo, k.yCbB), k.round);
+	__m128i bHi = _mm_add_epi32(_mm_madd_epi16(cdHi, k.yCbB), k.round);
+
+	__m128i r = _mm_packs_epi32(_mm_srai_epi32(rLo, 8), _mm_srai_epi32(rHi, 8));
+	__m128i g = _mm_packs_epi32(_mm_srai_epi32(gLo, 8), _mm_srai_epi32(gHi, 8));
+	__m128i b = _mm_packs_epi32(_mm_srai_epi32(bLo, 8), _mm_srai_epi32(bHi, 8));
+
+	r = _mm_packus_epi16(r, r);
+	g = _mm_packus_epi16(g, g);
+	b = _mm_packus_epi16(b, b);
+
+	__m128i bg = _mm_unpacklo_epi8(b, g);
+	__m128i ra = _mm_unpacklo_epi8(r, _mm_set1_epi8(-1));
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+			 _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16),
+			 _mm_unpackhi_epi16(bg, ra));
+}
+
+template<YuvRowLayout Layout>
+void yuvRowSse2(const uint8_t *y, const uint8_t *c0, const uint8_t *c1,
+		uint8_t *dst, unsigned int width, const YuvTables &tables)
+{
+	const Sse2Constants k(tables.coeffs);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+		__m128i yLo = _mm_unpacklo_epi8(y8, zero);
+		__m128i yHi = _mm_unpackhi_epi8(y8, zero);
+		__m128i cbLo, cbHi, crLo, crHi;
+
+		if constexpr (Layout == YuvRowLayout::Planar422) {
+			__m128i cb = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c0 + x / 2));
+			__m128i cr = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c1 + x / 2));
+
+			cb = _mm_unpacklo_epi8(cb, cb);
+			cr = _mm_unpacklo_epi8(cr, cr);
+			cbLo = _mm_unpacklo_epi8(cb, zero);
+			cbHi = _mm_unpackhi_epi8(cb, zero);
+			crLo = _mm_unpacklo_epi8(cr, zero);
+			crHi = _mm_unpackhi_epi8(cr, zero);
+		} else {
+			__m128i lo, hi;
+
+			if constexpr (Layout == YuvRowLayout::SemiPlanar422 ||
+				      Layout == YuvRowLayout::SemiPlanar422Swap) {
+				/* Duplicate each 16-bit chroma pair for two pixels. */
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c0 + x));
+				lo = _mm_unpacklo_epi16(c, c);
+				hi = _mm_unpackhi_epi16(c, c);
+			} else {
+				lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c0 + 2 * x));
+				hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c0 + 2 * x + 16));
+			}
+
+			__m128i firstLo = _mm_and_si128(lo, lowBytes);
+			__m128i firstHi = _mm_and_si128(hi, lowBytes);
+			__m128i secondLo = _mm_srli_epi16(lo, 8);
+			__m128i secondHi = _mm_srli_epi16(hi, 8);
+
+			if constexpr (isSwapped(Layout)) {
+				crLo = firstLo;
+				crHi = firstHi;
+				cbLo = secondLo;
+				cbHi = secondHi;
+			} else {
+				cbLo = firstLo;
+				cbHi = firstHi;
+				crLo = secondLo;
+				crHi = secondHi;
+			}
+		}
+
+		convert8Sse2(yLo, cbLo, crLo, k, dst + 4 * x);
+		convert8Sse2(yHi, cbHi, crHi, k, dst + 4 * x + 32);
+	}
+
+	yuvRowTail<Layout>(y, c0, c1, dst, x, width, tables);
+}
+
+/* -----------------------------------------------------------------------------
+ * AVX2, 16 pixels per iteration
+ */
+
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+struct Avx2Constants {
+	AVX2_FUNCTION explicit Avx2Constants(const YuvCoefficients &k)
+	{
+		yOffset = _mm256_set1_epi16(k.yOffset);
+		bias = _mm256_set1_epi16(128);
+		one = _mm256_set1_epi16(1);
+		round = _mm256_set1_epi32(128);
+		yCrR = _mm256_set1_epi32((uint16_t)k.y | (k.crR << 16));
+		yCbG = _mm256_set1_epi32((uint16_t)k.y | (k.cbG << 16));
+		crGRound = _mm256_set1_epi32((uint16_t)k.crG | (128 << 16));
+		yCbB = _mm256_set1_epi32((uint16_t)k.y | (k.cbB << 16));
+	}
+
+	__m256i yOffset;
+	__m256i bias;
+	__m256i one;
+	__m256i round;
+	__m256i yCrR;
+	__m256i yCbG;
+	__m256i crGRound;
+	__m256i yCbB;
+};
+
+/*
+ * Convert 16 pixels held as 16-bit Y, Cb and Cr and store 64 BGRA bytes.
+ * The unpacks work within 128-bit lanes, the final permutes put the pixels
+ * back in memory order.
+ */
+AVX2_FUNCTION inline void convert16Avx2(__m256i y, __m256i cb, __m256i cr,
+					const Avx2Constants &k, uint8_t *dst)
+{
+	__m256i c = _mm256_sub_epi16(y, k.yOffset);
+	__m256i d = _mm256_sub_epi16(cb, k.bias);
+	__m256i e = _mm256_sub_epi16(cr, k.bias);
+
+	__m256i ceLo = _mm256_unpacklo_epi16(c, e);
+	__m256i ceHi = _mm256_unpackhi_epi16(c, e);
+	__m256i cdLo = _mm256_unpacklo_epi16(c, d);
+	__m256i cdHi = _mm256_unpackhi_epi16(c, d);
+	__m256i e1Lo = _mm256_unpacklo_epi16(e, k.one);
+	__m256i e1Hi = _mm256_unpackhi_epi16(e, k.one);
+
+	__m256i rLo = _mm256_add_epi32(_mm256_madd_epi16(ceLo, k.yCrR), k.round);
+	__m256i rHi = _mm256_add_epi32(_mm256_madd_epi16(ceHi, k.yCrR), k.round);
+	__m256i gLo = _mm256_add_epi32(_mm256_madd_epi16(cdLo, k.yCbG),
+				       _mm256_madd_epi16(e1Lo, k.crGRound));
+	__m256i gHi = _mm256_add_epi32(_mm256_madd_epi16(cdHi, k.yCbG),
+				       _mm256_madd_epi16(e1Hi, k.crGRound));
+	__m256i bLo = _mm256_add_epi32(_mm256_madd_epi16(cdLo, k.yCbB), k.round);
+	__m256i bHi = _mm256_add_epi32(_mm256_madd_epi16(cdHi, k.yCbB), k.round);
+
+	__m256i r = _mm256_packs_epi32(_mm256_srai_epi32(rLo, 8), _mm256_srai_epi32(rHi, 8));
+	__m256i g = _mm256_packs_epi32(_mm256_srai_epi32(gLo, 8), _mm256_srai_epi32(gHi, 8));
+	__m256i b = _mm256_packs_epi32(_mm256_srai_epi32(bLo, 8), _mm256_srai_epi32(bHi, 8));
+
+	r = _mm256_packus_epi16(r, r);
+	g = _mm256_packus_epi16(g, g);
+	b = _mm256_packus_epi16(b, b);
+
+	__m256i bg = _mm256_unpacklo_epi8(b, g);
+	__m256i ra = _mm256_unpacklo_epi8(r, _mm256_set1_epi8(-1));
+	__m256i lo = _mm256_unpacklo_epi16(bg, ra);
+	__m256i hi = _mm256_unpackhi_epi16(bg, ra);
+
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst),
+			    _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 32),
+			    _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+template<YuvRowLayout Layout>
+AVX2_FUNCTION void yuvRowAvx2(const uint8_t *y, const uint8_t *c0,
+			      const uint8_t *c1, uint8_t *dst,
+			      unsigned int width, const YuvTables &tables)
+{
+	const Avx2Constants k(tables.coeffs);
+	const __m256i lowBytes = _mm256_set1_epi16(0x00ff);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i y16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x)));
+		__m256i cb, cr;
+
+		if constexpr (Layout == YuvRowLayout::Planar422) {
+			__m128i cb8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c0 + x / 2));
+			__m128i cr8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c1 + x / 2));
+
+			cb = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(cb8, cb8));
+			cr = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(cr8, cr8));
+		} else {
+			__m256i c;
+
+			if constexpr (Layout == YuvRowLayout::SemiPlanar422 ||
+				      Layout == YuvRowLayout::SemiPlanar422Swap) {
+				__m128i c8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c0 + x));
+				c = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(c8, c8)),
+							    _mm_unpackhi_epi16(c8, c8), 1);
+			} else {
+				c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(c0 + 2 * x));
+			}
+
+			__m256i first = _mm256_and_si256(c, lowBytes);
+			__m256i second = _mm256_srli_epi16(c, 8);
+
+			cb = isSwapped(Layout) ? second : first;
+			cr = isSwapped(Layout) ? first : second;
+		}
+
+		convert16Avx2(y16, cb, cr, k, dst + 4 * x);
+	}
+
+	yuvRowTail<Layout>(y, c0, c1, dst, x, width, tables);
+}
+
+#endif /* FORMAT_CONVERTER_HAVE_X86 */
+
+#if FORMAT_CONVERTER_HAVE_NEON
+
+/* -----------------------------------------------------------------------------
+ * NEON, 16 pixels per iteration
+ */
+
+inline uint8x8_t narrowNeon(int32x4_t lo, int32x4_t hi)
+{
+	int16x8_t v = vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, 8)),
+				   vqmovn_s32(vshrq_n_s32(hi, 8)));
+	return vqmovun_s16(v);
+}
+
+/* Convert 8 pixels and store 32 interleaved BGRA bytes. */
+inline void convert8Neon(uint8x8_t y, uint8x8_t cb, uint8x8_t cr,
+			 const YuvCoefficients &k, uint8_t *dst)
+{
+	int16x8_t c = vreinterpretq_s16_u16(vsubl_u8(y, vdup_n_u8(k.yOffset)));
+	int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(cb, vdup_n_u8(128)));
+	int16x8_t e = vreinterpretq_s16_u16(vsubl_u8(cr, vdup_n_u8(128)));
+	const int32x4_t round = vdupq_n_s32(128);
+
+	int32x4_t yLo = vmlal_n_s16(round, vget_low_s16(c), k.y);
+	int32x4_t yHi = vmlal_n_s16(round, vget_high_s16(c), k.y);
+
+	int32x4_t rLo = vmlal_n_s16(yLo, vget_low_s16(e), k.crR);
+	int32x4_t rHi = vmlal_n_s16(yHi, vget_high_s16(e), k.crR);
+	int32x4_t gLo = vmlal_n_s16(vmlal_n_s16(yLo, vget_low_s16(d), k.cbG),
+				    vget_low_s16(e), k.crG);
+	int32x4_t gHi = vmlal_n_s16(vmlal_n_s16(yHi, vget_high_s16(d), k.cbG),
+				    vget_high_s16(e), k.crG);
+	int32x4_t bLo = vmlal_n_s16(yLo, vget_low_s16(d), k.cbB);
+	int32x4_t bHi = vmlal_n_s16(yHi, vget_high_s16(d), k.cbB);
+
+	uint8x8x4_t bgra;
+	bgra.val[0] = narrowNeon(bLo, bHi);
+	bgra.val[1] = narrowNeon(gLo, gHi);
+	bgra.val[2] = narrowNeon(rLo, rHi);
+	bgra.val[3] = vdup_n_u8(0xff);
+
+	vst4_u8(dst, bgra);
+}
+
+template<YuvRowLayout Layout>
+void yuvRowNeon(const uint8_t *y, const uint8_t *c0, const uint8_t *c1,
+		uint8_t *dst, unsigned int width, const YuvTables &tables)
+{
+	const YuvCoefficients &coeffs = tables.coeffs;
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16_t y8 = vld1q_u8(y + x);
+		uint8x16_t cb, cr;
+
+		if constexpr (Layout == YuvRowLayout::Planar422) {
+			uint8x8x2_t cbDup = vzip_u8(vld1_u8(c0 + x / 2), vld1_u8(c0 + x / 2));
+			uint8x8x2_t crDup = vzip_u8(vld1_u8(c1 + x / 2), vld1_u8(c1 + x / 2));
+
+			cb = vcombine_u8(cbDup.val[0], cbDup.val[1]);
+			cr = vcombine_u8(crDup.val[0], crDup.val[1]);
+		} else if constexpr (Layout == YuvRowLayout::SemiPlanar422 ||
+				     Layout == YuvRowLayout::SemiPlanar422Swap) {
+			uint8x8x2_t c = vld2_u8(c0 + x);
+			uint8x8x2_t firstDup = vzip_u8(c.val[0], c.val[0]);
+			uint8x8x2_t secondDup = vzip_u8(c.val[1], c.val[1]);
+			uint8x16_t first = vcombine_u8(firstDup.val[0], firstDup.val[1]);
+			uint8x16_t second = vcombine_u8(secondDup.val[0], secondDup.val[1]);
+
+			cb = isSwapped(Layout) ? second : first;
+			cr = isSwapped(Layout) ? first : second;
+		} else {
+			uint8x16x2_t c = vld2q_u8(c0 + 2 * x);
+
+			cb = isSwapped(Layout) ? c.val[1] : c.val[0];
+			cr = isSwapped(Layout) ? c.val[0] : c.val[1];
+		}
+
+		convert8Neon(vget_low_u8(y8), vget_low_u8(cb), vget_low_u8(cr),
+			     coeffs, dst + 4 * x);
+		convert8Neon(vget_high_u8(y8), vget_high_u8(cb), vget_high_u8(cr),
+			     coeffs, dst + 4 * x + 32);
+	}
+
+	yuvRowTail<Layout>(y, c0, c1, dst, x, width, tables);
+}
+
+#endif /* FORMAT_CONVERTER_HAVE_NEON */
+
+template<template<YuvRowLayout> class Kernels>
+YuvRowFunc selectLayout(YuvRowLayout layout)
+{
+	switch (layout) {
+	case YuvRowLayout::Planar422:
+		return Kernels<YuvRowLayout::Planar422>::row;
+	case YuvRowLayout::SemiPlanar422:
+		return Kernels<YuvRowLayout::SemiPlanar422>::row;
+	case YuvRowLayout::SemiPlanar422Swap:
+		return Kernels<YuvRowLayout::SemiPlanar422Swap>::row;
+	case YuvRowLayout::SemiPlanar444:
+		return Kernels<YuvRowLayout::SemiPlanar444>::row;
+	case YuvRowLayout::SemiPlanar444Swap:
+		return Kernels<YuvRowLayout::SemiPlanar444Swap>::row;
+	}
+
+	return nullptr;
+}
+
+template<YuvRowLayout Layout>
+struct ScalarKernels {
+	static constexpr YuvRowFunc row = yuvRowC<Layout>;
+};
+
+#if FORMAT_CONVERTER_HAVE_X86
+template<YuvRowLayout Layout>
+struct Sse2Kernels {
+	static constexpr YuvRowFunc row = yuvRowSse2<Layout>;
+};
+
+template<YuvRowLayout Layout>
+struct Avx2Kernels {
+	static constexpr YuvRowFunc row = yuvRowAvx2<Layout>;
+};
+#endif
+
+#if FORMAT_CONVERTER_HAVE_NEON
+template<YuvRowLayout Layout>
+struct NeonKernels {
+	static constexpr YuvRowFunc row = yuvRowNeon<Layout>;
+};
+#endif
+
+/* -----------------------------------------------------------------------------
+ * Bayer demosaicing
+ *
+ * Every kernel averages with the rounding (a + b + 1) >> 1 of pavgb and
+ * vrhadd, nested for four samples, so the vector kernels are bit-exact with
+ * the scalar reference. X is the red or blue colour of the row, Y the other
+ * one, found on the rows above and below.
+ */
+
+constexpr bool bayerXFirst(BayerRowLayout layout)
+{
+	return layout == BayerRowLayout::BG || layout == BayerRowLayout::RG;
+}
+
+constexpr bool bayerXRed(BayerRowLayout layout)
+{
+	return layout == BayerRowLayout::GR || layout == BayerRowLayout::RG;
+}
+
+inline uint8_t average(unsigned int a, unsigned int b)
+{
+	return (a + b + 1) >> 1;
+}
+
+template<BayerRowLayout Layout, bool EdgeAware>
+void bayerRowC(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+	       uint8_t *dst, unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x++) {
+		const uint8_t *a = above + x;
+		const uint8_t *c = row + x;
+		const uint8_t *b = below + x;
+		bool xSite = ((x & 1) == 0) == bayerXFirst(Layout);
+		uint8_t h = average(c[-1], c[1]);
+		uint8_t v = average(a[0], b[0]);
+		uint8_t cx, cy, g;
+
+		if (xSite) {
+			uint8_t hv = average(h, v);
+
+			if (EdgeAware) {
+				unsigned int dh = abs(c[-1] - c[1]);
+				unsigned int dv = abs(a[0] - b[0]);
+
+				g = dh < dv ? h : dv < dh ? v : hv;
+			} else {
+				g = hv;
+			}
+
+			cx = c[0];
+			cy = average(average(a[-1], a[1]), average(b[-1], b[1]));
+		} else {
+			cx = h;
+			g = c[0];
+			cy = v;
+		}
+
+		dst[4 * x + 0] = bayerXRed(Layout) ? cy : cx;
+		dst[4 * x + 1] = g;
+		dst[4 * x + 2] = bayerXRed(Layout) ? cx : cy;
+		dst[4 * x + 3] = 0xff;
+	}
+}
+
+#if FORMAT_CONVERTER_HAVE_X86
+
+/* SSE2, 16 pixels per iteration. AVX2 gains little here and uses SSE2. */
+
+inline __m128i blendSse2(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+template<BayerRowLayout Layout, bool EdgeAware>
+void bayerRowSse2(const uint8_t *above, const uint8_t *row,
+		  const uint8_t *below, uint8_t *dst, unsigned int width)
+{
+	/* Selects the X sites, one byte out of two. */
+	const __m128i xMask = _mm_set1_epi16(bayerXFirst(Layout) ? 0x00ff : 0xff00);
+	const __m128i alpha = _mm_set1_epi8(-1);
+	unsigned int x;
+
+	auto load = [](const uint8_t *p) {
+		return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+	};
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i left = load(row + x - 1);
+		__m128i centre = load(row + x);
+		__m128i right = load(row + x + 1);
+		__m128i up = load(above + x);
+		__m128i down = load(below + x);
+
+		__m128i h = _mm_avg_epu8(left, right);
+		__m128i v = _mm_avg_epu8(up, down);
+		__m128i hv = _mm_avg_epu8(h, v);
+		__m128i diag = _mm_avg_epu8(_mm_avg_epu8(load(above + x - 1), load(above + x + 1)),
+					    _mm_avg_epu8(load(below + x - 1), load(below + x + 1)));
+		__m128i g;
+
+		if constexpr (EdgeAware) {
+			__m128i dh = _mm_or_si128(_mm_subs_epu8(left, right),
+						  _mm_subs_epu8(right, left));
+			__m128i dv = _mm_or_si128(_mm_subs_epu8(up, down),
+						  _mm_subs_epu8(down, up));
+			__m128i equal = _mm_cmpeq_epi8(dh, dv);
+			__m128i hLess = _mm_andnot_si128(equal,
+							 _mm_cmpeq_epi8(_mm_min_epu8(dh, dv), dh));
+			__m128i vLess = _mm_andnot_si128(_mm_or_si128(equal, hLess), alpha);
+
+			g = blendSse2(hLess, h, blendSse2(vLess, v, hv));
+		} else {
+			g = hv;
+		}
+
+		__m128i cx = blendSse2(xMask, centre, h);
+		__m128i cy = blendSse2(xMask, diag, v);
+		__m128i b = bayerXRed(Layout) ? cy : cx;
+		__m128i r = bayerXRed(Layout) ? cx : cy;
+
+		g = blendSse2(xMask, g, centre);
+
+		__m128i bgLo = _mm_unpacklo_epi8(b, g);
+		__m128i bgHi = _mm_unpackhi_epi8(b, g);
+		__m128i raLo = _mm_unpacklo_epi8(r, alpha);
+		__m128i raHi = _mm_unpackhi_epi8(r, alpha);
+		__m128i *out = reinterpret_cast<__m128i *>(dst + 4 * x);
+
+		_mm_storeu_si128(out, _mm_unpacklo_epi16(bgLo, raLo));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bgLo, raLo));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bgHi, raHi));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bgHi, raHi));
+	}
+
+	if (x < width)
+		bayerRowC<Layout, EdgeAware>(above + x, row + x, below + x,
+					     dst + 4 * x, width - x);
+}
+
+#endif /* FORMAT_CONVERTER_HAVE_X86 */
+
+#if FORMAT_CONVERTER_HAVE_NEON
+
+/* NEON, 16 pixels per iteration */
+
+template<BayerRowLayout Layout, bool EdgeAware>
+void bayerRowNeon(const uint8_t *above, const uint8_t *row,
+		  const uint8_t *below, uint8_t *dst, unsigned int width)
+{
+	const uint8x16_t xMask = vreinterpretq_u8_u16(vdupq_n_u16(bayerXFirst(Layout) ? 0x00ff : 0xff00));
+	unsigned int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		uint8x16_t left = vld1q_u8(row + x - 1);
+		uint8x16_t centre = vld1q_u8(row + x);
+		uint8x16_t right = vld1q_u8(row + x + 1);
+		uint8x16_t up = vld1q_u8(above + x);
+		uint8x16_t down = vld1q_u8(below + x);
+
+		uint8x16_t h = vrhaddq_u8(left, right);
+		uint8x16_t v = vrhaddq_u8(up, down);
+		uint8x16_t hv = vrhaddq_u8(h, v);
+		uint8x16_t diag = vrhaddq_u8(vrhaddq_u8(vld1q_u8(above + x - 1), vld1q_u8(above + x + 1)),
+					     vrhaddq_u8(vld1q_u8(below + x - 1), vld1q_u8(below + x + 1)));
+		uint8x16_t g;
+
+		if constexpr (EdgeAware) {
+			uint8x16_t dh = vabdq_u8(left, right);
+			uint8x16_t dv = vabdq_u8(up, down);
+
+			g = vbslq_u8(vcltq_u8(dh, dv), h,
+				     vbslq_u8(vcltq_u8(dv, dh), v, hv));
+		} else {
+			g = hv;
+		}
+
+		uint8x16_t cx = vbslq_u8(xMask, centre, h);
+		uint8x16_t cy = vbslq_u8(xMask, diag, v);
+
+		uint8x16x4_t bgra;
+		bgra.val[0] = bayerXRed(Layout) ? cy : cx;
+		bgra.val[1] = vbslq_u8(xMask, g, centre);
+		bgra.val[2] = bayerXRed(Layout) ? cx : cy;
+		bgra.val[3] = vdupq_n_u8(0xff);
+
+		vst4q_u8(dst + 4 * x, bgra);
+	}
+
+	if (x < width)
+		bayerRowC<Layout, EdgeAware>(above + x, row + x, below + x,
+					     dst + 4 * x, width - x);
+}
+
+#endif /* FORMAT_CONVERTER_HAVE_NEON */
+
+template<template<BayerRowLayout, bool> class Kernel>
+BayerRowFunc selectBayerLayout(BayerRowLayout layout, bool edgeAware)
+{
+	switch (layout) {
+	case BayerRowLayout::BG:
+		return edgeAware ? Kernel<BayerRowLayout::BG, true>::row
+				 : Kernel<BayerRowLayout::BG, false>::row;
+	case BayerRowLayout::GB:
+		return edgeAware ? Kernel<BayerRowLayout::GB, true>::row
+				 : Kernel<BayerRowLayout::GB, false>::row;
+	case BayerRowLayout::GR:
+		return edgeAware ? Kernel<BayerRowLayout::GR, true>::row
+				 : Kernel<BayerRowLayout::GR, false>::row;
+	case BayerRowLayout::RG:
+		return edgeAware ? Kernel<BayerRowLayout::RG, true>::row
+				 : Kernel<BayerRowLayout::RG, false>::row;
+	}
+
+	return nullptr;
+}
+
+template<BayerRowLayout Layout, bool EdgeAware>
+struct ScalarBayerKernel {
+	static constexpr BayerRowFunc row = bayerRowC<Layout, EdgeAware>;
+};
+
+#if FORMAT_CONVERTER_HAVE_X86
+template<BayerRowLayout Layout, bool EdgeAware>
+struct Sse2BayerKernel {
+	static constexpr BayerRowFunc row = bayerRowSse2<Layout, EdgeAware>;
+};
+#endif
+
+#if FORMAT_CONVERTER_HAVE_NEON
+template<BayerRowLayout Layout, bool EdgeAware>
+struct NeonBayerKernel {
+	static constexpr BayerRowFunc row = bayerRowNeon<Layout, EdgeAware>;
+};
+#endif
+
+} /* namespace */
+
+SimdLevel detectSimdLevel()
+{
+#if FORMAT_CONVERTER_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SimdLevel::AVX2;
+	return SimdLevel::SSE2;
+#elif FORMAT_CONVERTER_HAVE_NEON
+	return SimdLevel::NEON;
+#else
+	return SimdLevel::None;
+#endif
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+	switch (level) {
+	case SimdLevel::None:
+		return "scalar";
+	case SimdLevel::SSE2:
+		return "SSE2";
+	case SimdLevel::AVX2:
+		return "AVX2";
+	case SimdLevel::NEON:
+		return "NEON";
+	}
+
+	return "unknown";
+}
+
+YuvRowFunc yuvRowFunction(YuvRowLayout layout, SimdLevel level)
+{
+	switch (level) {
+#if FORMAT_CONVERTER_HAVE_X86
+	case SimdLevel::AVX2:
+		if (detectSimdLevel() == SimdLevel::AVX2)
+			return selectLayout<Avx2Kernels>(layout);
+		return selectLayout<Sse2Kernels>(layout);
+	case SimdLevel::SSE2:
+		return selectLayout<Sse2Kernels>(layout);
+#endif
+#if FORMAT_CONVERTER_HAVE_NEON
+	case SimdLevel::NEON:
+		return selectLayout<NeonKernels>(layout);
+#endif
+	default:
+		return selectLayout<ScalarKernels>(layout);
+	}
+}
+
+BayerRowFunc bayerRowFunction(BayerRowLayout layout, bool edgeAware,
+			      SimdLevel level)
+{
+	switch (level) {
+#if FORMAT_CONVERTER_HAVE_X86
+	case SimdLevel::AVX2:
+	case SimdLevel::SSE2:
+		return selectBayerLayout<Sse2BayerKernel>(layout, edgeAware);
+#endif
+#if FORMAT_CONVERTER_HAVE_NEON
+	case SimdLevel::NEON:
+		return selectBayerLayout<NeonBayerKernel>(layout, edgeAware);
+#endif
+	default:
+		return selectBayerLayout<ScalarBayerKernel>(layout, edgeAware);
+	}
+}
+
+} /* namespace FormatConverterSimd */
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * format_converter_simd.h - Vectorised YUV and Bayer to RGB32 row kernels
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace FormatConverterSimd {
+
+/*
+ * Instruction set used by the row kernels. None selects the scalar
+ * reference implementation, which every vectorised kernel must match.
+ */
+enum class SimdLevel {
+	None,
+	SSE2,
+	AVX2,
+	NEON,
+};
+
+/*
+ * Chroma layout of a single row. Planar layouts take separate Cb and Cr
+ * rows, semi-planar layouts take one interleaved CbCr (or CrCb when
+ * swapped) row and ignore the second chroma pointer.
+ */
+enum class YuvRowLayout {
+	Planar422,
+	SemiPlanar422,
+	SemiPlanar422Swap,
+	SemiPlanar444,
+	SemiPlanar444Swap,
+};
+
+/*
+ * Fixed point YCbCr to RGB matrix, scaled by 1 << 8. The G coefficients
+ * are negative, so every term is simply summed.
+ */
+struct YuvCoefficients {
+	int16_t yOffset;
+	int16_t y;
+	int16_t crR;
+	int16_t cbG;
+	int16_t crG;
+	int16_t cbB;
+};
+
+/* BT.601 limited range, as historically used by qcam. */
+constexpr YuvCoefficients Bt601Limited = { 16, 298, 409, -100, -208, 516 };
+
+/*
+ * The coefficients multiplied by every 8-bit sample value, so the scalar
+ * kernels only add. The vector kernels use the coefficients directly, both
+ * give identical results.
+ */
+struct YuvTables {
+	void build(const YuvCoefficients &k);
+
+	YuvCoefficients coeffs;
+	int32_t y[256];		/* includes the rounding term */
+	int32_t crR[256];
+	int32_t cbG[256];
+	int32_t crG[256];
+	int32_t cbB[256];
+};
+
+inline uint8_t clip(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/* Scalar reference conversion of one pixel to BGRA. */
+inline void yuvToBgra(unsigned int y, unsigned int cb, unsigned int cr,
+		      const YuvTables &t, uint8_t *dst)
+{
+	int c = t.y[y];
+
+	dst[0] = clip((c + t.cbB[cb]) >> 8);
+	dst[1] = clip((c + t.cbG[cb] + t.crG[cr]) >> 8);
+	dst[2] = clip((c + t.crR[cr]) >> 8);
+	dst[3] = 0xff;
+}
+
+/*
+ * Convert one row of width pixels (width must be even) to BGRA (Qt
+ * Format_RGB32 on little endian).
+ */
+using YuvRowFunc = void (*)(const uint8_t *y, const uint8_t *c0,
+			    const uint8_t *c1, uint8_t *dst,
+			    unsigned int width, const YuvTables &tables);
+
+SimdLevel detectSimdLevel();
+const char *simdLevelName(SimdLevel level);
+
+/*
+ * Return the row kernel for layout using at most the given instruction
+ * set. Levels not compiled in or not supported by the CPU fall back to
+ * the scalar reference.
+ */
+YuvRowFunc yuvRowFunction(YuvRowLayout layout, SimdLevel level);
+
+/* Bayer row layout, named after the colours of the first two samples. */
+enum class BayerRowLayout {
+	BG,
+	GB,
+	GR,
+	RG,
+};
+
+/*
+ * Demosaic one row of width 8-bit samples (width must be even) to BGRA,
+ * interpolating from the rows above and below. All three rows must be
+ * readable one sample before the first and one after the last sample.
+ * Edge aware kernels interpolate green along the smaller gradient instead
+ * of averaging all four neighbours.
+ */
+using BayerRowFunc = void (*)(const uint8_t *above, const uint8_t *row,
+			      const uint8_t *below, uint8_t *dst,
+			      unsigned int width);
+
+BayerRowFunc bayerRowFunction(BayerRowLayout layout, bool edgeAware,
+			      SimdLevel level);
+
+} /* namespace FormatConverterSimd */
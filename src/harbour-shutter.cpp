@@ -24,6 +24,7 @@
 #include "cameraproxy.h"
 #include "settings.h"
 #include "controlmodel.h"
+#include "writebehindcache.h"
 
 int main(int argc, char *argv[])
 {
@@ -54,6 +55,7 @@ int main(int argc, char *argv[])
     qmlRegisterUncreatableType<FormatModel>("uk.co.piggz.shutter", 1, 0, "FormatModel", QStringLiteral("Not to be created within QML"));
     qmlRegisterUncreatableType<ResolutionModel>("uk.co.piggz.shutter", 1, 0, "ResolutionModel", QStringLiteral("Not to be created within QML"));
     qmlRegisterUncreatableType<ControlModel>("uk.co.piggz.shutter", 1, 0, "ControlModel", QStringLiteral("Not to be created within QML"));
+    qmlRegisterUncreatableType<WriteBehindCache>("uk.co.piggz.shutter", 1, 0, "WriteBehindCache", QStringLiteral("Not to be created within QML"));
     qmlRegisterType<ViewFinderItem>("uk.co.piggz.shutter", 1, 0, "ViewFinderItem");
     qmlRegisterType<ViewFinder2D>("uk.co.piggz.shutter", 1, 0, "ViewFinder2D");
     qmlRegisterType<Settings>("uk.co.piggz.shutter", 1, 0, "Settings");
@@ -0,0 +1,207 @@
+#include "livephoto.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <utility>
+
+#include <QDebug>
+
+#include "aviwriter.h"
+
+/* Frames older than this are only kept for clips waiting to be written */
+static constexpr int64_t RingDurationNs = 1000000000;
+
+/* Ring frames are for a small clip, compress them harder than recordings */
+static constexpr int RingQuality = 70;
+
+LivePhoto::LivePhoto(QObject *parent)
+    : QObject(parent)
+{
+    m_compressor.setQuality(RingQuality);
+
+    m_thread.reset(QThread::create([this]() { run(); }));
+    m_thread->setObjectName(QStringLiteral("LivePhoto"));
+    m_thread->start(QThread::LowPriority);
+}
+
+LivePhoto::~LivePhoto()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+    }
+    m_wake.wakeAll();
+    m_thread->wait();
+}
+
+void LivePhoto::setMemoryBudget(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_budget = bytes;
+}
+
+void LivePhoto::push(const QImage &frame, int64_t timestamp)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_next = frame;
+        m_nextTimestamp = timestamp;
+    }
+    m_wake.wakeOne();
+}
+
+void LivePhoto::capture(const QString &fileName, int64_t timestamp)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_clips.append({ fileName, timestamp });
+    }
+    m_wake.wakeOne();
+}
+
+void LivePhoto::clear()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_next = QImage();
+        m_clear = true;
+    }
+    m_wake.wakeOne();
+}
+
+void LivePhoto::run()
+{
+    for (;;) {
+        QImage image;
+        int64_t timestamp;
+        bool clear;
+        bool quit;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_next.isNull() && !m_clear && !m_quit) {
+                m_wake.wait(&m_mutex);
+            }
+            std::swap(image, m_next);
+            timestamp = m_nextTimestamp;
+            clear = m_clear;
+            quit = m_quit;
+            m_clear = false;
+        }
+
+        if (!image.isNull() && !quit) {
+            if (m_compressor.compress(image)) {
+                Frame frame;
+                frame.jpeg = QByteArray(reinterpret_cast<const char *>(m_compressor.data()),
+                                        m_compressor.size());
+                frame.size = image.size();
+                frame.timestamp = timestamp;
+                m_ringBytes += frame.jpeg.size();
+                m_ring.push_back(std::move(frame));
+            }
+        }
+
+        // Clips are written once the ring has the frames after their press,
+        // or with what it has when it is being emptied
+        const int64_t newest = m_ring.empty() ? 0 : m_ring.back().timestamp;
+        QList<Clip> ready;
+        QList<Clip> pending;
+        {
+            QMutexLocker locker(&m_mutex);
+            for (auto it = m_clips.begin(); it != m_clips.end();) {
+                if (clear || quit || newest >= it->timestamp + HalfClipNs) {
+                    ready.append(*it);
+                    it = m_clips.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            pending = m_clips;
+        }
+
+        for (const Clip &clip : std::as_const(ready)) {
+            Q_EMIT saved(clip.fileName, writeClip(clip));
+        }
+
+        if (clear || quit) {
+            m_ring.clear();
+            m_ringBytes = 0;
+        } else {
+            trim(pending);
+        }
+
+        if (quit) {
+            return;
+        }
+    }
+}
+
+void LivePhoto::trim(const QList<Clip> &pending)
+{
+    if (m_ring.empty()) {
+        return;
+    }
+
+    int64_t oldest = m_ring.back().timestamp - RingDurationNs;
+    for (const Clip &clip : pending) {
+        oldest = std::min(oldest, clip.timestamp - HalfClipNs);
+    }
+
+    qint64 budget;
+    {
+        QMutexLocker locker(&m_mutex);
+        budget = m_budget;
+    }
+
+    // The budget wins over clips waiting for their frames
+    while (!m_ring.empty() &&
+           (m_ring.front().timestamp < oldest || m_ringBytes > budget)) {
+        m_ringBytes -= m_ring.front().jpeg.size();
+        m_ring.pop_front();
+    }
+}
+
+bool LivePhoto::writeClip(const Clip &clip)
+{
+    auto first = std::find_if(m_ring.begin(), m_ring.end(), [&](const Frame &frame) {
+        return frame.timestamp >= clip.timestamp - HalfClipNs;
+    });
+    auto last = std::find_if(first, m_ring.end(), [&](const Frame &frame) {
+        return frame.timestamp > clip.timestamp + HalfClipNs;
+    });
+
+    if (first == last) {
+        qWarning() << "No frames for live photo" << clip.fileName;
+        return false;
+    }
+
+    // The viewfinder may have been resized, keep to the size at the press
+    auto press = std::min_element(first, last, [&](const Frame &a, const Frame &b) {
+        return std::abs(a.timestamp - clip.timestamp) < std::abs(b.timestamp - clip.timestamp);
+    });
+    const QSize size = press->size;
+
+    // Play back at the rate the frames came in
+    const auto count = std::distance(first, last);
+    const int64_t span = std::prev(last)->timestamp - first->timestamp;
+    const double fps = count > 1 && span > 0 ? std::clamp((count - 1) * 1e9 / span, 5.0, 60.0) : 30;
+
+    AviWriter writer;
+    if (!writer.open(clip.fileName, size, fps)) {
+        return false;
+    }
+
+    bool ok = true;
+    for (auto it = first; ok && it != last; ++it) {
+        if (it->size == size) {
+            ok = writer.writeFrame(reinterpret_cast<const uint8_t *>(it->jpeg.constData()),
+                                   it->jpeg.size(), it->timestamp);
+        }
+    }
+
+    ok = writer.finish() && ok;
+
+    qDebug() << "Live photo" << clip.fileName << writer.frameCount() << "frames at" << fps << "fps";
+
+    return ok;
+}
@@ -0,0 +1,84 @@
+#ifndef LIVEPHOTO_H
+#define LIVEPHOTO_H
+
+#include <deque>
+#include <memory>
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QSize>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "mjpegcompressor.h"
+
+/*
+ * Keeps the last second of viewfinder frames as JPEGs, compressed on a
+ * dedicated thread, and writes the frames either side of a shutter press
+ * as a short Motion JPEG AVI once those after it have arrived. push() never
+ * waits, a frame arriving while the previous one is still queued replaces
+ * it. The ring is bounded by age and by its memory budget. Frames must be
+ * stamped with one clock, the ring and waiting clips then carry over pauses
+ * in the frames, such as camera restarts.
+ */
+class LivePhoto : public QObject
+{
+    Q_OBJECT
+public:
+    /* Clips cover this long before and after the press */
+    static constexpr int64_t HalfClipNs = 750000000;
+
+    explicit LivePhoto(QObject *parent = nullptr);
+    ~LivePhoto();
+
+    void setMemoryBudget(qint64 bytes);
+
+    /* Add a frame captured at timestamp nanoseconds, it must own its pixels */
+    void push(const QImage &frame, int64_t timestamp);
+    /* Write the clip around timestamp to fileName once its frames are in */
+    void capture(const QString &fileName, int64_t timestamp);
+    /* Write pending clips with the frames there are, and empty the ring */
+    void clear();
+
+Q_SIGNALS:
+    /* Emitted from the compression thread */
+    void saved(const QString &fileName, bool ok);
+
+private:
+    struct Frame {
+        QByteArray jpeg;
+        QSize size;
+        int64_t timestamp;
+    };
+
+    struct Clip {
+        QString fileName;
+        int64_t timestamp;
+    };
+
+    void run();
+    void trim(const QList<Clip> &pending);
+    bool writeClip(const Clip &clip);
+
+    std::unique_ptr<QThread> m_thread;
+
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    QImage m_next;
+    int64_t m_nextTimestamp = 0;
+    QList<Clip> m_clips;
+    qint64 m_budget = 32 * 1024 * 1024;
+    bool m_clear = false;
+    bool m_quit = false;
+
+    /* Owned by the compression thread */
+    MjpegCompressor m_compressor;
+    std::deque<Frame> m_ring;
+    qint64 m_ringBytes = 0;
+};
+
+#endif // LIVEPHOTO_H
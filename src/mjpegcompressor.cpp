@@ -0,0 +1,123 @@
+#include "mjpegcompressor.h"
+
+#include <algorithm>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <QDebug>
+
+#include <jpeglib.h>
+
+namespace {
+
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr cinfo)
+{
+    JpegErrorManager *error = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    qWarning() << "Unable to encode video frame:" << message;
+
+    longjmp(error->jump, 1);
+}
+
+} // namespace
+
+struct MjpegCompressor::Private {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager error;
+    unsigned char *buffer = nullptr;
+    unsigned long capacity = 0;
+    unsigned long size = 0;
+};
+
+MjpegCompressor::MjpegCompressor()
+    : d(std::make_unique<Private>())
+{
+    d->cinfo.err = jpeg_std_error(&d->error.pub);
+    d->error.pub.error_exit = jpegErrorExit;
+    jpeg_create_compress(&d->cinfo);
+}
+
+MjpegCompressor::~MjpegCompressor()
+{
+    jpeg_destroy_compress(&d->cinfo);
+    free(d->buffer);
+}
+
+void MjpegCompressor::setQuality(int quality)
+{
+    m_quality = quality < 0 ? DefaultQuality : std::min(quality, 100);
+}
+
+bool MjpegCompressor::compress(const QImage &frame)
+{
+    // Viewfinder frames are RGB32 unless shown without conversion
+    QImage image = frame;
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32) {
+        image = image.convertToFormat(QImage::Format_RGB32);
+    }
+
+    jpeg_compress_struct &cinfo = d->cinfo;
+    unsigned char *out = d->buffer;
+    unsigned long size = d->capacity;
+
+    d->size = 0;
+
+    if (setjmp(d->error.jump)) {
+        jpeg_abort_compress(&cinfo);
+        return false;
+    }
+
+    cinfo.image_width = image.width();
+    cinfo.image_height = image.height();
+    cinfo.input_components = 4;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    cinfo.in_color_space = JCS_EXT_BGRX;
+#else
+    cinfo.in_color_space = JCS_EXT_XRGB;
+#endif
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, m_quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+
+    jpeg_mem_dest(&cinfo, &out, &size);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW rows[16];
+        unsigned int count = std::min(cinfo.image_height - cinfo.next_scanline, 16u);
+        for (unsigned int i = 0; i < count; i++) {
+            rows[i] = const_cast<uint8_t *>(image.constScanLine(cinfo.next_scanline + i));
+        }
+        jpeg_write_scanlines(&cinfo, rows, count);
+    }
+
+    jpeg_finish_compress(&cinfo);
+
+    // libjpeg replaced the buffer with a larger one
+    if (out != d->buffer) {
+        free(d->buffer);
+        d->buffer = out;
+        d->capacity = size;
+    }
+    d->size = size;
+
+    return true;
+}
+
+const uint8_t *MjpegCompressor::data() const
+{
+    return d->buffer;
+}
+
+size_t MjpegCompressor::size() const
+{
+    return d->size;
+}
@@ -0,0 +1,38 @@
+#ifndef MJPEGCOMPRESSOR_H
+#define MJPEGCOMPRESSOR_H
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <QImage>
+
+/*
+ * Compresses video frames to JPEG in memory, keeping the libjpeg state and
+ * an output buffer grown to the largest frame across calls, so a frame
+ * costs its compression only. An instance is used by one thread at a time.
+ */
+class MjpegCompressor
+{
+public:
+    static constexpr int DefaultQuality = 85;
+
+    MjpegCompressor();
+    ~MjpegCompressor();
+
+    void setQuality(int quality);
+
+    /* Compress frame, data() holds the JPEG until the next call */
+    bool compress(const QImage &frame);
+    const uint8_t *data() const;
+    size_t size() const;
+
+private:
+    /* libjpeg state, defined in the source */
+    struct Private;
+
+    std::unique_ptr<Private> d;
+    int m_quality = DefaultQuality;
+};
+
+#endif // MJPEGCOMPRESSOR_H
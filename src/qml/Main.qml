@@ -36,6 +36,7 @@ ApplicationWindow {
         property string gridMode: "none"
         property bool useSizeAsOrientation: false
         property bool faceDetection: false
+        property bool zeroShutterLag: false
         property bool locationMetadata: false
         
         function getCameraValue(s, d) {
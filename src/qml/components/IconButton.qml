@@ -20,6 +20,8 @@ Item {
     property alias  pressed: mouse.pressed
 
     signal clicked
+    signal pressAndHold
+    signal released
 
     IconImage {
         id: iconimage
@@ -55,5 +57,7 @@ Item {
         id: mouse
         anchors.fill: parent
         onClicked: item.clicked()
+        onPressAndHold: item.pressAndHold()
+        onReleased: item.released()
     }
 }
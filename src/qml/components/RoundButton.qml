@@ -9,6 +9,8 @@ Item {
     //property alias down: iconButton.down
     signal clicked
     signal pressed
+    signal pressAndHold
+    signal released
 
     height: size
     width: size
@@ -33,6 +35,8 @@ Item {
                 button.clicked()
             }
             //onPressed: button.pressed()
+            onPressAndHold: button.pressAndHold()
+            onReleased: button.released()
             iconWidth: (parent.width / 4) * 3
             iconHeight: iconWidth
         }
@@ -13,7 +13,8 @@ Page {
     property bool _completed: false
     property bool _focusAndSnap: false
     property bool _loadParameters: true
-    property bool _recordingVideo: false
+    property bool _videoMode: false
+    property bool _recordingVideo: cameraProxy.state === CameraProxy.Recording
     property bool _manualModeSelected: false
     readonly property real zoomStepSize: 0.05
     readonly property real zoomStepButton: 5.0
@@ -249,7 +250,19 @@ Page {
                 rotation: page.controlsRotation
 
                 iconSource: shutterIcon()
+                // Stills are refused while the save pipeline is full
+                enabled: _videoMode || !cameraProxy.stillBusy
                 onClicked: doShutter()
+                onPressAndHold: {
+                    if (!_videoMode) {
+                        cameraProxy.startBurst(captureFileName(), 0)
+                    }
+                }
+                onReleased: {
+                    if (cameraProxy.burstActive) {
+                        cameraProxy.stopBurst()
+                    }
+                }
             }
 
             Column {
@@ -344,7 +357,6 @@ Page {
 
             IconSwitch {
                 id: btnModeSwitch
-                visible: false //Disable until video recording is implemented
                 anchors.bottom: parent.bottom
                 anchors.bottomMargin: styler.themePaddingMedium
                 anchors.right: parent.right
@@ -361,14 +373,11 @@ Page {
 
                 onClicked: {
                     console.log("selected:", name)
-                    camera.stop()
-                    settingsOverlay.setMode(name)
-                    if (name === button1Name) {
-                        camera.captureMode = Camera.CaptureStillImage
-                    } else {
-                        camera.captureMode = Camera.CaptureVideo
+                    if (cameraProxy.state === CameraProxy.Recording) {
+                        cameraProxy.stopRecording()
                     }
-                    camera.start()
+                    settingsOverlay.setMode(name)
+                    page._videoMode = name === button2Name
                 }
             }
 
@@ -481,6 +490,15 @@ Page {
 
         cameraProxy.setViewFinder(viewFinder);
         cameraProxy.setFaceDetectionEnabled(settings.faceDetection);
+        cameraProxy.setZslMemoryBudget(settings.get("global", "zslMemoryBudget", 256));
+        cameraProxy.setZslEnabled(settings.getGlobalValue("zeroShutterLag", false));
+        cameraProxy.setLivePhotoEnabled(settings.getGlobalValue("livePhoto", false));
+        var stillEncoder = settings.getGlobalValue("stillEncoder", "jpeg");
+        cameraProxy.setStillEncoder(stillEncoder);
+        cameraProxy.setStillQuality(settings.get("global", "stillQuality_" + stillEncoder, -1));
+        cameraProxy.setRawCompression(settings.getGlobalValue("rawCompression", "none"));
+        cameraProxy.setWriteBehindBudget(settings.get("global", "writeBehindBudget", 512));
+        cameraProxy.setWriteBehindEnabled(settings.getGlobalValue("writeBehind", true));
 
         for( var i = 0; i < modelCamera.rowCount; i++ ) {
             console.log("Camera: ", modelCamera.get(i) );
@@ -504,11 +522,9 @@ Page {
     Connections {
         target: cameraProxy
 
+        // The camera keeps running, single stream cameras get their
+        // viewfinder back from the proxy
         onStillCaptureFinished: {
-            console.log("Still capture finished, starting viewfinder timer");
-            cameraProxy.stop();
-            startViewfinder();
-
             console.log("Camera: image saved", path)
             galleryModel.append({
                                     "filePath": "file://" + path,
@@ -516,6 +532,53 @@ Page {
                                 })
 
         }
+
+        onBurstFrameSaved: {
+            animFlash.start();
+            galleryModel.append({
+                                    "filePath": "file://" + path,
+                                    "isVideo": false
+                                })
+        }
+
+        onRecordingFinished: {
+            console.log("Recording finished", path, ok, cameraProxy.recordingDropped, "dropped,",
+                        cameraProxy.recordingEncodeFps.toFixed(1), "encoded fps")
+            if (ok) {
+                galleryModel.append({
+                                        "filePath": "file://" + path,
+                                        "isVideo": true
+                                    })
+            }
+        }
+
+        onStillDropped: {
+            console.log("Still dropped, the save pipeline is full", path)
+        }
+
+        onLivePhotoSaved: {
+            console.log("Live photo saved", path, ok)
+        }
+
+        onBurstFinished: {
+            console.log("Burst finished,", saved, "saved,", cameraProxy.burstDropped, "dropped,",
+                        cameraProxy.burstShotsPerSecond.toFixed(1), "shots/s")
+        }
+    }
+
+    // Captures are shown from staging until they reach their storage
+    Connections {
+        target: cameraProxy.writeBehind
+        onFlushed: {
+            if (!ok) {
+                return;
+            }
+            for (var i = 0; i < galleryModel.count; i++) {
+                if (galleryModel.get(i).filePath === "file://" + staged) {
+                    galleryModel.setProperty(i, "filePath", "file://" + target);
+                }
+            }
+        }
     }
 
     Timer {
@@ -741,15 +804,37 @@ Page {
         return Qt.size(Screen.height, Screen.width)
     }
 
-    function doShutter() {
-        animFlash.start();
-
-        var filename = fsOperations.writableLocation(
+    function captureFileName() {
+        return fsOperations.writableLocation(
                     "image",
                     settings.get("global", "storagePath", "")) + "/IMG_" + Qt.formatDateTime(
                     new Date(), "yyyyMMdd_hhmmss") + "." + fileExtension();
+    }
+
+    function doShutter() {
+        if (_videoMode) {
+            if (_recordingVideo) {
+                cameraProxy.stopRecording();
+            } else {
+                cameraProxy.startRecording(videoFileName());
+            }
+            return;
+        }
+
+        if (cameraProxy.stillBusy) {
+            return;
+        }
 
-        cameraProxy.stillCapture(filename);
+        animFlash.start();
+
+        cameraProxy.stillCapture(captureFileName());
+    }
+
+    function videoFileName() {
+        return fsOperations.writableLocation(
+                    "video",
+                    settings.get("global", "storagePath", "")) + "/VID_" + Qt.formatDateTime(
+                    new Date(), "yyyyMMdd_hhmmss") + ".avi";
     }
 
     function fileExtension() {
@@ -783,16 +868,12 @@ Page {
     }
 
     function shutterIcon() {
-        //TODO
-        return  styler.customIconPrefix + "../pics/icon-camera-shutter.png";
-        if (camera.captureMode === Camera.CaptureStillImage) {
-            return "../pics/icon-camera-shutter.png"
+        if (!_videoMode) {
+            return styler.customIconPrefix + "../pics/icon-camera-shutter.png"
+        } else if (_recordingVideo) {
+            return styler.customIconPrefix + "../pics/icon-camera-video-shutter-off.png"
         } else {
-            if (camera.videoRecorder.recorderStatus === CameraRecorder.RecordingStatus) {
-                return "../pics/icon-camera-video-shutter-off.png"
-            } else {
-                return "../pics/icon-camera-video-shutter-on.png"
-            }
+            return styler.customIconPrefix + "../pics/icon-camera-video-shutter-on.png"
         }
     }
 
@@ -235,10 +235,12 @@ Item {
                     console.log("SettingsOverlay - panelGeneral - Loading settings.")
                     sldAudioBitrate.value = settings.get("global", "audioBitrate", 128000);
                     sldVideoBitrate.value = settings.get("global", "videoBitrate", 1280000);
+                    sldStillQuality.load();
                 } else {
                     console.log("SettingsOverlay - panelGeneral - Saving settings.")
                     settings.setGlobalValue("audioBitrate", sldAudioBitrate.value);
                     settings.setGlobalValue("videoBitrate", sldVideoBitrate.value);
+                    sldStillQuality.save();
                 }
             }
         }
@@ -337,6 +339,123 @@ Item {
                     }
                 }
 
+                TextSwitch {
+                    id: zeroShutterLagSwitch
+                    width: parent.width
+
+                    text: qsTr("Zero shutter lag")
+
+                    Component.onCompleted: {
+                        checked = settings.getGlobalValue("zeroShutterLag", false)
+                    }
+
+                    onCheckedChanged: {
+                        settings.setGlobalValue("zeroShutterLag", checked);
+                        cameraProxy.setZslEnabled(checked);
+                    }
+                }
+
+                TextSwitch {
+                    id: livePhotoSwitch
+                    width: parent.width
+
+                    text: qsTr("Live photo")
+                    enabled: cameraProxy.livePhotoSupported
+                    description: enabled ? "" : qsTr("Not available on this camera, its viewfinder stops while taking stills")
+
+                    Component.onCompleted: {
+                        checked = settings.getGlobalValue("livePhoto", false)
+                    }
+
+                    onCheckedChanged: {
+                        settings.setGlobalValue("livePhoto", checked);
+                        cameraProxy.setLivePhotoEnabled(checked);
+                    }
+                }
+
+                ComboBox {
+                    id: stillEncoderBox
+                    model: cameraProxy.stillEncoders()
+
+                    Component.onCompleted: {
+                        var index = find(settings.getGlobalValue("stillEncoder", "jpeg"));
+                        currentIndex = index >= 0 ? index : 0;
+                    }
+
+                    onActivated: {
+                        sldStillQuality.save();
+                        settings.setGlobalValue("stillEncoder", currentText);
+                        cameraProxy.setStillEncoder(currentText);
+                        sldStillQuality.load();
+                    }
+                }
+
+                TextSlider {
+                    id: sldStillQuality
+                    label: stillEncoderBox.currentText === "png" ? qsTr("Compression effort")
+                                                                 : qsTr("Quality (100 is lossless for WebP)")
+                    from: 0
+                    to: 100
+                    stepSize: 1
+
+                    // Each format keeps its own quality, as the scales differ
+                    property string encoder
+
+                    function load() {
+                        encoder = stillEncoderBox.currentText;
+                        value = settings.get("global", "stillQuality_" + encoder,
+                                             cameraProxy.defaultStillQuality(encoder));
+                    }
+                    function save() {
+                        if (!encoder) {
+                            return;
+                        }
+                        settings.setGlobalValue("stillQuality_" + encoder, value);
+                        if (encoder === stillEncoderBox.currentText) {
+                            cameraProxy.setStillQuality(value);
+                        }
+                    }
+                }
+
+                ComboBox {
+                    id: rawCompressionBox
+                    model: cameraProxy.rawCompressions()
+                    displayText: qsTr("Raw compression: %1").arg(currentText)
+                    // Nothing to choose when built without LZ4 and zstd
+                    visible: count > 1
+
+                    Component.onCompleted: {
+                        var index = find(settings.getGlobalValue("rawCompression", "none"));
+                        currentIndex = index >= 0 ? index : 0;
+                    }
+
+                    onActivated: {
+                        settings.setGlobalValue("rawCompression", currentText);
+                        cameraProxy.setRawCompression(currentText);
+                    }
+                }
+
+                TextSwitch {
+                    id: writeBehindSwitch
+                    width: parent.width
+
+                    text: qsTr("Stage captures on internal storage")
+                    description: cameraProxy.writeBehind.pendingFiles > 0
+                                 ? qsTr("%1 MB waiting, flushing at %2 MB/s")
+                                   .arg((cameraProxy.writeBehind.pendingBytes / 1048576).toFixed(1))
+                                   .arg((cameraProxy.writeBehind.flushRate / 1048576).toFixed(1))
+                                 : ""
+
+                    Component.onCompleted: {
+                        checked = settings.getGlobalValue("writeBehind", true)
+                    }
+
+                    onCheckedChanged: {
+                        settings.setGlobalValue("writeBehind", checked);
+                        cameraProxy.setWriteBehindEnabled(checked);
+                    }
+                }
+
                 TextSwitch {
                     id: sizeOrientationSwitch
                     width: parent.width
@@ -0,0 +1,530 @@
+#include "rawdump.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QFile>
+#include <QSemaphore>
+#include <QtEndian>
+
+#include <libcamera/base/shared_fd.h>
+#include <libcamera/control_ids.h>
+
+#if defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "image.h"
+#include "workerpool.h"
+
+namespace {
+
+constexpr char Magic[8] = { 'S', 'H', 'U', 'T', 'R', 'A', 'W', '\0' };
+/* Version 2 added compression, version 1 dumps load as uncompressed */
+constexpr uint32_t Version = 2;
+constexpr unsigned int MaxPlanes = 4;
+/* Plane data starts aligned, so a dump can be mapped and read in place */
+constexpr uint32_t DataAlignment = 64;
+/* Small enough to spread a frame over the workers, large enough to compress well */
+constexpr uint32_t ChunkSize = 1 << 20;
+/* zstd's own default, most of the gain of higher levels at a fraction of the time */
+constexpr int ZstdLevel = 3;
+
+/* Every field little endian */
+struct Header {
+    char magic[8];
+    uint32_t version;
+    /* Offset of the first plane, past the header, metadata and padding */
+    uint32_t dataOffset;
+    uint32_t fourcc;
+    uint32_t planeCount;
+    uint64_t modifier;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t metadataSize;
+    struct {
+        uint64_t offset;
+        uint64_t length;
+    } planes[MaxPlanes];
+    /*
+     * Since version 2. Compressed dumps store each plane as chunks of
+     * chunkSize bytes, the last one shorter, each after a ChunkHeader.
+     * Plane offsets are then those the planes would have uncompressed.
+     */
+    uint32_t compression;
+    uint32_t chunkSize;
+};
+
+static_assert(sizeof(Header) == 120, "Raw dump header layout changed");
+
+constexpr size_t HeaderV1Size = offsetof(Header, compression);
+
+struct ChunkHeader {
+    /* Bytes following the header, equal to size when stored uncompressed */
+    uint32_t compressedSize;
+    uint32_t size;
+};
+
+const char *compressionName(RawDump::Compression compression)
+{
+    switch (compression) {
+    case RawDump::Compression::Lz4:
+        return "lz4";
+    case RawDump::Compression::Zstd:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+bool available(RawDump::Compression compression)
+{
+    switch (compression) {
+    case RawDump::Compression::None:
+        return true;
+#if defined(HAVE_LZ4)
+    case RawDump::Compression::Lz4:
+        return true;
+#endif
+#if defined(HAVE_ZSTD)
+    case RawDump::Compression::Zstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* Compressed size, or 0 when the chunk doesn't shrink or can't be compressed */
+size_t compressChunk(RawDump::Compression compression, const uint8_t *src, size_t size,
+                     std::vector<uint8_t> *out)
+{
+    switch (compression) {
+#if defined(HAVE_LZ4)
+    case RawDump::Compression::Lz4: {
+        out->resize(LZ4_compressBound(size));
+        int written = LZ4_compress_default(reinterpret_cast<const char *>(src),
+                                           reinterpret_cast<char *>(out->data()),
+                                           size, out->size());
+        return written > 0 && static_cast<size_t>(written) < size ? written : 0;
+    }
+#endif
+#if defined(HAVE_ZSTD)
+    case RawDump::Compression::Zstd: {
+        out->resize(ZSTD_compressBound(size));
+        size_t written = ZSTD_compress(out->data(), out->size(), src, size, ZstdLevel);
+        return !ZSTD_isError(written) && written < size ? written : 0;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+bool decompressChunk(RawDump::Compression compression, const uint8_t *src, size_t compressedSize,
+                     uint8_t *dst, size_t size)
+{
+    if (compressedSize == size) {
+        memcpy(dst, src, size);
+        return true;
+    }
+
+    switch (compression) {
+#if defined(HAVE_LZ4)
+    case RawDump::Compression::Lz4:
+        return LZ4_decompress_safe(reinterpret_cast<const char *>(src), reinterpret_cast<char *>(dst),
+                                   compressedSize, size) == static_cast<int>(size);
+#endif
+#if defined(HAVE_ZSTD)
+    case RawDump::Compression::Zstd:
+        return ZSTD_decompress(dst, size, src, compressedSize) == size;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* writev until everything is written, it may stop short on large buffers */
+bool writeAll(int fd, std::vector<iovec> iov)
+{
+    size_t first = 0;
+
+    while (first < iov.size()) {
+        ssize_t written = ::writev(fd, iov.data() + first, std::min<size_t>(iov.size() - first, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        while (first < iov.size() && static_cast<size_t>(written) >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = static_cast<uint8_t *>(iov[first].iov_base) + written;
+            iov[first].iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Compress the planes chunk by chunk on the worker pool, a bounded window of
+ * chunks ahead of the one being written, and write them in order as they
+ * complete. Writing a chunk frees its slot for the next one.
+ */
+bool writeChunks(int fd, RawDump::Compression compression, const std::vector<iovec> &planes)
+{
+    struct Chunk {
+        const uint8_t *data;
+        size_t size;
+    };
+    struct Slot {
+        std::vector<uint8_t> out;
+        size_t compressedSize = 0;
+        QSemaphore done;
+    };
+
+    std::vector<Chunk> chunks;
+    for (const iovec &plane : planes) {
+        const uint8_t *data = static_cast<const uint8_t *>(plane.iov_base);
+        for (size_t offset = 0; offset < plane.iov_len; offset += ChunkSize) {
+            chunks.push_back({ data + offset, std::min<size_t>(ChunkSize, plane.iov_len - offset) });
+        }
+    }
+    if (chunks.empty()) {
+        return true;
+    }
+
+    WorkerPool *pool = WorkerPool::instance();
+    std::vector<Slot> slots(std::min<size_t>(chunks.size(), 2 * pool->threadCount()));
+    size_t queued = 0;
+
+    auto queue = [&]() {
+        Slot *slot = &slots[queued % slots.size()];
+        Chunk chunk = chunks[queued++];
+        pool->start([compression, slot, chunk]() {
+            slot->compressedSize = compressChunk(compression, chunk.data, chunk.size, &slot->out);
+            slot->done.release();
+        });
+    };
+
+    while (queued < slots.size()) {
+        queue();
+    }
+
+    // On failure stop queueing, but wait for the chunks in flight which use the slots
+    bool ok = true;
+    for (size_t i = 0; i < queued; i++) {
+        Slot &slot = slots[i % slots.size()];
+        slot.done.acquire();
+
+        if (ok) {
+            const Chunk &chunk = chunks[i];
+            const bool stored = slot.compressedSize == 0;
+            ChunkHeader header;
+            header.compressedSize = qToLittleEndian<uint32_t>(stored ? chunk.size : slot.compressedSize);
+            header.size = qToLittleEndian<uint32_t>(chunk.size);
+
+            ok = writeAll(fd, { { &header, sizeof(header) },
+                                { stored ? const_cast<uint8_t *>(chunk.data) : slot.out.data(),
+                                  stored ? chunk.size : slot.compressedSize } });
+        }
+
+        if (ok && queued < chunks.size()) {
+            queue();
+        }
+    }
+
+    return ok;
+}
+
+/* Read the chunks of every plane, then decompress them in parallel into the planes */
+bool readChunks(QFile *file, RawDump::Compression compression, uint32_t chunkSize, Image *image)
+{
+    struct Chunk {
+        const uint8_t *src;
+        size_t compressedSize;
+        uint8_t *dst;
+        size_t size;
+    };
+
+    const QByteArray data = file->readAll();
+    const uint8_t *pos = reinterpret_cast<const uint8_t *>(data.constData());
+    const uint8_t *end = pos + data.size();
+    std::vector<Chunk> chunks;
+
+    for (unsigned int i = 0; i < image->numPlanes(); i++) {
+        libcamera::Span<uint8_t> plane = image->data(i);
+
+        for (size_t offset = 0; offset < plane.size(); offset += chunkSize) {
+            ChunkHeader header;
+            if (static_cast<size_t>(end - pos) < sizeof(header)) {
+                return false;
+            }
+            memcpy(&header, pos, sizeof(header));
+            pos += sizeof(header);
+
+            const size_t compressedSize = qFromLittleEndian(header.compressedSize);
+            const size_t size = qFromLittleEndian(header.size);
+            if (size != std::min<size_t>(chunkSize, plane.size() - offset) || compressedSize > size ||
+                static_cast<size_t>(end - pos) < compressedSize) {
+                return false;
+            }
+
+            chunks.push_back({ pos, compressedSize, plane.data() + offset, size });
+            pos += compressedSize;
+        }
+    }
+
+    std::atomic<bool> ok{ true };
+    WorkerPool::instance()->run(chunks.size(), [&](unsigned int i) {
+        const Chunk &chunk = chunks[i];
+        if (!decompressChunk(compression, chunk.src, chunk.compressedSize, chunk.dst, chunk.size)) {
+            ok = false;
+        }
+    });
+
+    return ok;
+}
+
+} // namespace
+
+RawDump::RawDump() = default;
+
+RawDump::~RawDump() = default;
+
+QStringList RawDump::compressions()
+{
+    QStringList names;
+    for (Compression compression : { Compression::None, Compression::Lz4, Compression::Zstd }) {
+        if (available(compression)) {
+            names.append(QLatin1String(compressionName(compression)));
+        }
+    }
+    return names;
+}
+
+RawDump::Compression RawDump::compression(const QString &name)
+{
+    for (Compression compression : { Compression::Lz4, Compression::Zstd }) {
+        if (available(compression) && name == QLatin1String(compressionName(compression))) {
+            return compression;
+        }
+    }
+    return Compression::None;
+}
+
+bool RawDump::write(const QString &fileName, const libcamera::StreamConfiguration &cfg,
+                    const libcamera::FrameBuffer *buffer, const Image *image,
+                    const libcamera::ControlList &metadata, Compression compression)
+{
+    if (!available(compression)) {
+        qWarning() << "Raw dump compression" << compressionName(compression) << "is not available";
+        compression = Compression::None;
+    }
+
+    const unsigned int planeCount = image->numPlanes();
+    if (planeCount == 0 || planeCount > MaxPlanes) {
+        qWarning() << "Unable to dump" << planeCount << "planes";
+        return false;
+    }
+
+    std::string text;
+    if (cfg.colorSpace) {
+        text += "ColorSpace=" + cfg.colorSpace->toString() + "\n";
+    }
+    const libcamera::ControlIdMap &ids = metadata.idMap() ? *metadata.idMap() : libcamera::controls::controls;
+    for (const auto &[id, value] : metadata) {
+        auto control = ids.find(id);
+        text += (control != ids.end() ? control->second->name() : std::to_string(id)) + "=" +
+                value.toString() + "\n";
+    }
+
+    Header header = {};
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = qToLittleEndian(Version);
+    header.fourcc = qToLittleEndian(cfg.pixelFormat.fourcc());
+    header.planeCount = qToLittleEndian<uint32_t>(planeCount);
+    header.modifier = qToLittleEndian(cfg.pixelFormat.modifier());
+    header.width = qToLittleEndian(cfg.size.width);
+    header.height = qToLittleEndian(cfg.size.height);
+    header.stride = qToLittleEndian(cfg.stride);
+    header.metadataSize = qToLittleEndian<uint32_t>(text.size());
+    header.compression = qToLittleEndian(static_cast<uint32_t>(compression));
+    header.chunkSize = qToLittleEndian(ChunkSize);
+
+    const uint32_t dataOffset = (sizeof(Header) + text.size() + DataAlignment - 1) / DataAlignment * DataAlignment;
+    static const uint8_t padding[DataAlignment] = {};
+    header.dataOffset = qToLittleEndian(dataOffset);
+
+    std::vector<iovec> iov = {
+        { &header, sizeof(header) },
+        { const_cast<char *>(text.data()), text.size() },
+        { const_cast<uint8_t *>(padding), dataOffset - sizeof(Header) - text.size() },
+    };
+
+    // Each plane on its own, bytesused counts from the start of the plane
+    auto used = buffer->metadata().planes();
+    std::vector<iovec> planes;
+    uint64_t offset = dataOffset;
+    for (unsigned int i = 0; i < planeCount; i++) {
+        libcamera::Span<const uint8_t> data = image->data(i);
+        size_t length = data.size();
+        if (i < used.size() && used[i].bytesused) {
+            length = std::min<size_t>(used[i].bytesused, length);
+        }
+
+        header.planes[i].offset = qToLittleEndian(offset);
+        header.planes[i].length = qToLittleEndian<uint64_t>(length);
+        planes.push_back({ const_cast<uint8_t *>(data.data()), length });
+        offset += length;
+    }
+    if (compression == Compression::None) {
+        iov.insert(iov.end(), planes.begin(), planes.end());
+    }
+
+    const QByteArray path = QFile::encodeName(fileName);
+    int fd = ::open(path.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        qWarning() << "Unable to open" << fileName << strerror(errno);
+        return false;
+    }
+
+    bool ok = writeAll(fd, std::move(iov));
+    if (ok && compression != Compression::None) {
+        ok = writeChunks(fd, compression, planes);
+    }
+    ok = ::close(fd) == 0 && ok;
+    if (!ok) {
+        qWarning() << "Unable to write" << fileName << strerror(errno);
+        ::unlink(path.constData());
+    }
+
+    return ok;
+}
+
+std::unique_ptr<RawDump> RawDump::load(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Unable to open" << fileName;
+        return nullptr;
+    }
+
+    Header header = {};
+    if (file.read(reinterpret_cast<char *>(&header), HeaderV1Size) != HeaderV1Size ||
+        memcmp(header.magic, Magic, sizeof(Magic)) != 0 ||
+        qFromLittleEndian(header.version) < 1 || qFromLittleEndian(header.version) > Version) {
+        qWarning() << fileName << "is not a raw dump";
+        return nullptr;
+    }
+    if (qFromLittleEndian(header.version) >= 2 &&
+        file.read(reinterpret_cast<char *>(&header) + HeaderV1Size, sizeof(header) - HeaderV1Size) !=
+            static_cast<qint64>(sizeof(header) - HeaderV1Size)) {
+        qWarning() << "Truncated raw dump" << fileName;
+        return nullptr;
+    }
+
+    const Compression compression = static_cast<Compression>(qFromLittleEndian(header.compression));
+    const uint32_t chunkSize = qFromLittleEndian(header.chunkSize);
+    if (compression != Compression::None && (!available(compression) || chunkSize == 0)) {
+        qWarning() << "Unable to decompress" << fileName << "compressed with"
+                   << compressionName(compression);
+        return nullptr;
+    }
+
+    const unsigned int planeCount = qFromLittleEndian(header.planeCount);
+    const uint32_t metadataSize = qFromLittleEndian(header.metadataSize);
+    const size_t headerSize = qFromLittleEndian(header.version) >= 2 ? sizeof(Header) : HeaderV1Size;
+    if (planeCount == 0 || planeCount > MaxPlanes ||
+        qFromLittleEndian(header.dataOffset) < headerSize + uint64_t(metadataSize)) {
+        qWarning() << "Corrupt raw dump" << fileName;
+        return nullptr;
+    }
+
+    std::unique_ptr<RawDump> dump(new RawDump());
+    dump->config.pixelFormat = libcamera::PixelFormat(qFromLittleEndian(header.fourcc),
+                                                      qFromLittleEndian(header.modifier));
+    dump->config.size = libcamera::Size(qFromLittleEndian(header.width), qFromLittleEndian(header.height));
+    dump->config.stride = qFromLittleEndian(header.stride);
+
+    const QByteArray text = file.read(metadataSize);
+    for (const QByteArray &line : text.split('\n')) {
+        int separator = line.indexOf('=');
+        if (separator > 0) {
+            dump->metadata[line.left(separator).toStdString()] = line.mid(separator + 1).toStdString();
+        }
+    }
+    auto colorSpace = dump->metadata.find("ColorSpace");
+    if (colorSpace != dump->metadata.end()) {
+        dump->config.colorSpace = libcamera::ColorSpace::fromString(colorSpace->second);
+    }
+
+    std::vector<libcamera::FrameBuffer::Plane> planes(planeCount);
+    for (unsigned int i = 0; i < planeCount; i++) {
+        uint64_t length = qFromLittleEndian(header.planes[i].length);
+        if (compression == Compression::None &&
+            qFromLittleEndian(header.planes[i].offset) + length > static_cast<uint64_t>(file.size())) {
+            qWarning() << "Truncated raw dump" << fileName;
+            return nullptr;
+        }
+        planes[i].offset = dump->bytesUsed;
+        planes[i].length = length;
+        dump->bytesUsed += length;
+    }
+
+    int fd = memfd_create("raw-dump", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, dump->bytesUsed) < 0) {
+        if (fd >= 0)
+            close(fd);
+        qWarning() << "Unable to allocate" << dump->bytesUsed << "bytes for" << fileName;
+        return nullptr;
+    }
+
+    libcamera::SharedFD sharedFd(std::move(fd));
+    for (libcamera::FrameBuffer::Plane &plane : planes) {
+        plane.fd = sharedFd;
+    }
+
+    dump->buffer = std::make_unique<libcamera::FrameBuffer>(planes);
+    dump->image = Image::fromFrameBuffer(dump->buffer.get(), Image::MapMode::ReadWrite);
+    if (!dump->image) {
+        return nullptr;
+    }
+
+    if (compression != Compression::None) {
+        if (!file.seek(qFromLittleEndian(header.dataOffset)) ||
+            !readChunks(&file, compression, chunkSize, dump->image.get())) {
+            qWarning() << "Corrupt raw dump" << fileName;
+            return nullptr;
+        }
+        return dump;
+    }
+
+    for (unsigned int i = 0; i < planeCount; i++) {
+        libcamera::Span<uint8_t> data = dump->image->data(i);
+        if (!file.seek(qFromLittleEndian(header.planes[i].offset)) ||
+            file.read(reinterpret_cast<char *>(data.data()), data.size()) != static_cast<qint64>(data.size())) {
+            qWarning() << "Unable to read" << fileName;
+            return nullptr;
+        }
+    }
+
+    return dump;
+}
@@ -0,0 +1,68 @@
+#ifndef RAWDUMP_H
+#define RAWDUMP_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <QString>
+#include <QStringList>
+
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+class Image;
+
+/*
+ * A frame as the camera delivered it, for offline processing. The file
+ * starts with a fixed little endian header giving the pixel format, size,
+ * stride and where each plane is in the file, then the capture metadata as
+ * "Name=value" lines, then every plane back to back. Planes are written
+ * straight from the mapped buffer with one writev.
+ *
+ * Compressed dumps split each plane in chunks, compressed on the worker
+ * pool while the chunks before them are written, and decompressed in
+ * parallel when loaded. Chunks that don't shrink are stored as they are.
+ */
+class RawDump
+{
+public:
+    enum class Compression {
+        None,
+        /* Fast, to cut the time spent writing to slow storage */
+        Lz4,
+        /* Smaller files, for when space matters more than shot to shot time */
+        Zstd,
+    };
+
+    /* "none", then "lz4" and "zstd" when built with them */
+    static QStringList compressions();
+    /* None for unknown or unavailable names */
+    static Compression compression(const QString &name);
+
+    static bool write(const QString &fileName, const libcamera::StreamConfiguration &cfg,
+                      const libcamera::FrameBuffer *buffer, const Image *image,
+                      const libcamera::ControlList &metadata,
+                      Compression compression = Compression::None);
+
+    /* Loads a dump into a memfd backed FrameBuffer, laid out like the original */
+    static std::unique_ptr<RawDump> load(const QString &fileName);
+
+    ~RawDump();
+
+    /* Pixel format, size, stride and colour space of the frame */
+    libcamera::StreamConfiguration config;
+    std::unique_ptr<libcamera::FrameBuffer> buffer;
+    std::unique_ptr<Image> image;
+    /* Bytes of every plane, what the camera reported as used */
+    size_t bytesUsed = 0;
+    /* Metadata values as libcamera prints them, by control name */
+    std::map<std::string, std::string> metadata;
+
+private:
+    RawDump();
+};
+
+#endif // RAWDUMP_H
@@ -0,0 +1,66 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Lock-free ring of fixed capacity for one producer thread and one consumer
+ * thread. push() and pop() are wait-free and never allocate. reset() sizes
+ * the ring and drops its entries, it must not race with either side.
+ */
+template<typename T>
+class SpscRing
+{
+public:
+    /* Hold up to capacity entries, rounded up to a power of two */
+    void reset(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+
+        m_slots.assign(capacity ? size : 0, T());
+        m_mask = size - 1;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    }
+
+    /* Called by the producer, false when the ring is full */
+    bool push(const T &value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) >= m_slots.size()) {
+            return false;
+        }
+
+        m_slots[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Called by the consumer, false when the ring is empty */
+    bool pop(T *value)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        *value = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> m_slots;
+    size_t m_mask = 0;
+
+    /* Written by the consumer and the producer respectively, kept apart */
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+};
+
+#endif // SPSCRING_H
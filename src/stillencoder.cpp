@@ -0,0 +1,223 @@
+#include "stillencoder.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <QDebug>
+#include <QImageWriter>
+#include <QMap>
+#include <QThread>
+
+#include <libcamera/formats.h>
+
+#include "encoder_jpeg.h"
+#include "format_converter.h"
+#include "image.h"
+
+static const QMap<libcamera::PixelFormat, QImage::Format> nativeFormats
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 2, 0)
+    { libcamera::formats::ABGR8888, QImage::Format_RGBX8888 },
+    { libcamera::formats::XBGR8888, QImage::Format_RGBX8888 },
+#endif
+    { libcamera::formats::ARGB8888, QImage::Format_RGB32 },
+    { libcamera::formats::XRGB8888, QImage::Format_RGB32 },
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    { libcamera::formats::RGB888, QImage::Format_BGR888 },
+#endif
+    { libcamera::formats::BGR888, QImage::Format_RGB888 },
+};
+
+namespace {
+
+/*
+ * Formats written through a QImageWriter plugin. Qt's PNG writer takes the
+ * zlib level as its compression, its WebP writer compresses losslessly at
+ * quality 100.
+ */
+class QtStillEncoder : public StillEncoder
+{
+public:
+    QtStillEncoder(const QByteArray &format, int defaultQuality)
+        : m_format(format), m_defaultQuality(defaultQuality)
+    {
+        setParallelism(QThread::idealThreadCount());
+        setQuality(-1);
+    }
+
+    void setQuality(int quality) override
+    {
+        m_quality = quality < 0 ? m_defaultQuality : std::min(quality, 100);
+    }
+
+    void setParallelism(unsigned int threads) override
+    {
+        m_converter.setParallelism(std::max(threads, 1u));
+    }
+
+    void setOrientation(libcamera::Orientation orientation) override
+    {
+        m_converter.setOrientation(orientation);
+    }
+
+    void setProgressHandler(std::function<void(int)> handler) override
+    {
+        m_progress = std::move(handler);
+    }
+
+    bool encode(const libcamera::StreamConfiguration &cfg, libcamera::FrameBuffer *buffer,
+                Image *image, std::string outFileName, const ExifWriter *) override
+    {
+        QImage frame = frameImage(m_converter, cfg, buffer, image);
+        if (frame.isNull())
+            return false;
+
+        // Conversion is the cheap half, Qt writers don't report their own progress
+        if (m_progress)
+            m_progress(50);
+
+        QImageWriter writer(QString::fromStdString(outFileName), m_format);
+        if (m_format == "png") {
+            // 1 to 9, the fastest level by default
+            writer.setCompression(1 + m_quality * 8 / 100);
+        } else {
+            writer.setQuality(m_quality);
+        }
+
+        if (!writer.write(frame)) {
+            qWarning() << "Unable to write" << outFileName.c_str() << writer.errorString();
+            return false;
+        }
+
+        if (m_progress)
+            m_progress(100);
+
+        return true;
+    }
+
+private:
+    const QByteArray m_format;
+    const int m_defaultQuality;
+    int m_quality = 0;
+    FormatConverter m_converter;
+    std::function<void(int)> m_progress;
+};
+
+struct Registration {
+    QString name;
+    QString suffix;
+    int defaultQuality;
+    StillEncoder::Factory factory;
+};
+
+constexpr int PngDefaultQuality = 0;
+constexpr int WebpDefaultQuality = 90;
+
+std::vector<Registration> &registry()
+{
+    static std::vector<Registration> encoders = []() {
+        std::vector<Registration> builtin = {
+            { QStringLiteral("jpeg"), QStringLiteral(".jpg"), EncoderJpeg::DefaultQuality,
+              []() { return std::make_unique<EncoderJpeg>(); } },
+        };
+
+        const QList<QByteArray> writable = QImageWriter::supportedImageFormats();
+        if (writable.contains("png")) {
+            builtin.push_back({ QStringLiteral("png"), QStringLiteral(".png"), PngDefaultQuality,
+                                []() { return std::make_unique<QtStillEncoder>("png", PngDefaultQuality); } });
+        }
+        if (writable.contains("webp")) {
+            builtin.push_back({ QStringLiteral("webp"), QStringLiteral(".webp"), WebpDefaultQuality,
+                                []() { return std::make_unique<QtStillEncoder>("webp", WebpDefaultQuality); } });
+        }
+
+        return builtin;
+    }();
+
+    return encoders;
+}
+
+std::mutex registryMutex;
+
+} // namespace
+
+void StillEncoder::registerEncoder(const QString &name, const QString &suffix, int defaultQuality,
+                                   Factory factory)
+{
+    std::lock_guard<std::mutex> locker(registryMutex);
+    registry().push_back({ name, suffix, defaultQuality, std::move(factory) });
+}
+
+std::unique_ptr<StillEncoder> StillEncoder::create(const QString &name)
+{
+    std::lock_guard<std::mutex> locker(registryMutex);
+    for (const Registration &encoder : registry()) {
+        if (encoder.name == name)
+            return encoder.factory();
+    }
+
+    qWarning() << "No still encoder named" << name;
+    return nullptr;
+}
+
+QStringList StillEncoder::names()
+{
+    std::lock_guard<std::mutex> locker(registryMutex);
+    QStringList names;
+    for (const Registration &encoder : registry()) {
+        names << encoder.name;
+    }
+    return names;
+}
+
+QString StillEncoder::suffix(const QString &name)
+{
+    std::lock_guard<std::mutex> locker(registryMutex);
+    for (const Registration &encoder : registry()) {
+        if (encoder.name == name)
+            return encoder.suffix;
+    }
+    return QStringLiteral(".jpg");
+}
+
+int StillEncoder::defaultQuality(const QString &name)
+{
+    std::lock_guard<std::mutex> locker(registryMutex);
+    for (const Registration &encoder : registry()) {
+        if (encoder.name == name)
+            return encoder.defaultQuality;
+    }
+    return -1;
+}
+
+QImage StillEncoder::frameImage(FormatConverter &converter, const libcamera::StreamConfiguration &cfg,
+                                libcamera::FrameBuffer *buffer, Image *image)
+{
+    size_t size = 0;
+    for (const libcamera::FrameMetadata::Plane &plane : buffer->metadata().planes()) {
+        size += plane.bytesused;
+    }
+
+    QSize qs(cfg.size.width, cfg.size.height);
+
+    if (::nativeFormats.contains(cfg.pixelFormat) && !converter.isOriented()) {
+        qInfo() << "Zero-copy enabled";
+        return QImage(image->data(0).data(), qs.width(), qs.height(), size / qs.height(),
+                      ::nativeFormats[cfg.pixelFormat]);
+    }
+
+    int ret = converter.configure(cfg.pixelFormat, qs, cfg.stride,
+                                  cfg.colorSpace.value_or(libcamera::ColorSpace::Sycc));
+    if (ret < 0) {
+        qDebug() << "Unable to configure converter" << ret << qs << cfg.stride;
+        return QImage();
+    }
+
+    QImage converted(converter.outputSize(), QImage::Format_RGB32);
+
+    qInfo() << "Using software format conversion from" << cfg.pixelFormat.toString().c_str();
+    converter.convert(image, size, &converted);
+
+    return converted;
+}
@@ -0,0 +1,68 @@
+#ifndef STILLENCODER_H
+#define STILLENCODER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <QImage>
+#include <QString>
+#include <QStringList>
+
+#include <libcamera/framebuffer.h>
+#include <libcamera/orientation.h>
+#include <libcamera/stream.h>
+
+class ExifWriter;
+class FormatConverter;
+class Image;
+
+/*
+ * Writes a captured frame to an image file. Encoders are created by name
+ * from a registry, "jpeg" is always available, "png" and "webp" when Qt can
+ * write them. An instance is used by one thread at a time.
+ */
+class StillEncoder
+{
+public:
+    using Factory = std::function<std::unique_ptr<StillEncoder>()>;
+
+    virtual ~StillEncoder() = default;
+
+    /*
+     * 0 to 100, higher keeps more. Lossy formats trade size for fidelity,
+     * lossless ones spend more time on a smaller file. Negative values
+     * select the format's default.
+     */
+    virtual void setQuality(int quality) = 0;
+    /* Threads for conversion and, where the format allows, compression */
+    virtual void setParallelism(unsigned int threads) = 0;
+    virtual void setOrientation(libcamera::Orientation orientation) = 0;
+    /* Called with the percentage of the image encoded so far */
+    virtual void setProgressHandler(std::function<void(int)> handler) = 0;
+    /* exif is written by formats that carry it, others ignore it */
+    virtual bool encode(const libcamera::StreamConfiguration &cfg, libcamera::FrameBuffer *buffer,
+                        Image *image, std::string outFileName,
+                        const ExifWriter *exif = nullptr) = 0;
+
+    /* Register before any encoder is created, names must be unique */
+    static void registerEncoder(const QString &name, const QString &suffix, int defaultQuality,
+                                Factory factory);
+    static std::unique_ptr<StillEncoder> create(const QString &name);
+    static QStringList names();
+    /* File name suffix with the dot, ".jpg" for unknown names */
+    static QString suffix(const QString &name);
+    /* The quality negative values select, -1 for unknown names */
+    static int defaultQuality(const QString &name);
+
+protected:
+    /*
+     * The frame as a QImage in its final orientation. Formats Qt reads are
+     * wrapped without a copy when no orientation is needed, others go
+     * through converter. Null if the converter can't take the format.
+     */
+    static QImage frameImage(FormatConverter &converter, const libcamera::StreamConfiguration &cfg,
+                             libcamera::FrameBuffer *buffer, Image *image);
+};
+
+#endif // STILLENCODER_H
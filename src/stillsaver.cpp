@@ -0,0 +1,172 @@
+#include "stillsaver.h"
+
+#include <algorithm>
+#include <map>
+
+#include <QDebug>
+#include <QFile>
+
+#include "dngwriter.h"
+#include "image.h"
+#include "stillencoder.h"
+#include "writebehindcache.h"
+
+StillSaver::StillSaver(unsigned int maxPending, QObject *parent)
+    : QObject(parent)
+    , m_capacity(std::max(1u, maxPending))
+    , m_slots(m_capacity)
+{
+    m_thread.reset(QThread::create([this]() { run(); }));
+    m_thread->setObjectName(QStringLiteral("StillSaver"));
+    m_thread->start(QThread::LowPriority);
+}
+
+StillSaver::~StillSaver()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+    }
+    m_jobAvailable.wakeAll();
+    m_thread->wait();
+}
+
+void StillSaver::setWriteBehindCache(WriteBehindCache *cache)
+{
+    m_cache = cache;
+}
+
+bool StillSaver::save(const Job &job)
+{
+    if (!m_slots.tryAcquire()) {
+        return false;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_queue.enqueue(job);
+        m_pending++;
+    }
+    m_jobAvailable.wakeOne();
+
+    Q_EMIT pendingChanged();
+    return true;
+}
+
+void StillSaver::waitForIdle()
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_pending > 0) {
+        m_idle.wait(&m_mutex);
+    }
+}
+
+int StillSaver::pending() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_pending;
+}
+
+int StillSaver::capacity() const
+{
+    return m_capacity;
+}
+
+void StillSaver::run()
+{
+    // Encoders keep their buffers between stills, one of each format in use
+    std::map<QString, std::unique_ptr<StillEncoder>> encoders;
+
+    for (;;) {
+        Job job;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_quit) {
+                m_jobAvailable.wait(&m_mutex);
+            }
+            if (m_queue.isEmpty()) {
+                return;
+            }
+            job = m_queue.dequeue();
+        }
+
+        const QString path = job.fileName + StillEncoder::suffix(job.encoder);
+        // Sensor data goes in a DNG raw developers can open
+        const QString rawPath = DngWriter::supports(job.config.pixelFormat)
+                                    ? job.fileName + QStringLiteral(".dng")
+                                    : job.fileName;
+
+        Q_EMIT progress(path, 0);
+
+        std::unique_ptr<StillEncoder> &encoder = encoders[job.encoder];
+        if (!encoder) {
+            encoder = StillEncoder::create(job.encoder);
+        }
+
+        const QString stagedRaw = stage(rawPath);
+        bool ok = encoder && writeRaw(job, stagedRaw);
+        finish(stagedRaw, rawPath, ok);
+        if (ok) {
+            // The raw dump accounts for the first tenth
+            Q_EMIT progress(path, 10);
+
+            encoder->setQuality(job.quality);
+            encoder->setOrientation(job.orientation);
+            encoder->setProgressHandler([this, path](int percent) {
+                Q_EMIT progress(path, 10 + percent * 9 / 10);
+            });
+            const QString staged = stage(path);
+            ok = encoder->encode(job.config, job.buffer, job.image, staged.toStdString(), &job.exif);
+            finish(staged, path, ok);
+        }
+        if (ok) {
+            qDebug() << "Saved still as " << path;
+        } else {
+            qWarning() << "Unable to save" << job.fileName;
+        }
+
+        Q_EMIT progress(path, 100);
+        Q_EMIT saved(job.buffer, path, ok);
+
+        // The slot is free before waitForIdle() returns, so a save after it succeeds
+        m_slots.release();
+        {
+            QMutexLocker locker(&m_mutex);
+            m_pending--;
+            if (m_pending == 0) {
+                m_idle.wakeAll();
+            }
+        }
+
+        Q_EMIT pendingChanged();
+    }
+}
+
+QString StillSaver::stage(const QString &target)
+{
+    return m_cache ? m_cache->stage(target) : target;
+}
+
+void StillSaver::finish(const QString &staged, const QString &target, bool ok)
+{
+    if (!m_cache || staged == target) {
+        return;
+    }
+
+    // A partly written staged file would never be flushed
+    if (ok) {
+        m_cache->commit(staged, target);
+    } else {
+        QFile::remove(staged);
+    }
+}
+
+bool StillSaver::writeRaw(const Job &job, const QString &path)
+{
+    if (DngWriter::supports(job.config.pixelFormat)) {
+        return DngWriter::write(path, job.config, job.image, job.orientation, job.exif);
+    }
+
+    return RawDump::write(path, job.config, job.buffer, job.image, job.exif.metadata(),
+                          job.rawCompression);
+}
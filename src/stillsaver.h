@@ -0,0 +1,98 @@
+#ifndef STILLSAVER_H
+#define STILLSAVER_H
+
+#include <memory>
+
+#include <QMutex>
+#include <QObject>
+#include <QQueue>
+#include <QSemaphore>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <libcamera/framebuffer.h>
+#include <libcamera/orientation.h>
+#include <libcamera/stream.h>
+
+#include "exifwriter.h"
+#include "rawdump.h"
+
+class Image;
+class WriteBehindCache;
+
+/*
+ * Writes captured stills (the raw buffer and an encoded image) on a dedicated thread so
+ * the GUI thread keeps servicing the viewfinder while a still is encoded.
+ * The buffer stays mapped and owned by the saver until saved() is emitted,
+ * after which the caller may recycle it. At most maxPending saves are queued
+ * or running at once, save() refuses jobs beyond that rather than block the
+ * GUI thread, so held buffers and encoder memory stay bounded.
+ */
+class StillSaver : public QObject
+{
+    Q_OBJECT
+public:
+    struct Job {
+        libcamera::StreamConfiguration config;
+        libcamera::FrameBuffer *buffer = nullptr;
+        Image *image = nullptr;
+        libcamera::Orientation orientation = libcamera::Orientation::Rotate0;
+        /*
+         * The raw data goes to fileName as a RawDump, or to fileName +
+         * ".dng" for Bayer formats, the image to fileName + its suffix
+         */
+        QString fileName;
+        /* A StillEncoder name, and its quality or -1 for the default */
+        QString encoder = QStringLiteral("jpeg");
+        int quality = -1;
+        /* Compression of the RawDump, Bayer DNGs are left uncompressed */
+        RawDump::Compression rawCompression = RawDump::Compression::None;
+        /* Capture metadata, taken before the request is reused */
+        ExifWriter exif;
+    };
+
+    explicit StillSaver(unsigned int maxPending = 2, QObject *parent = nullptr);
+    ~StillSaver();
+
+    /* Stage files through cache on their way to slow storage, set before saving */
+    void setWriteBehindCache(WriteBehindCache *cache);
+
+    /* Queue job, or return false when maxPending saves are already pending. */
+    bool save(const Job &job);
+    /* Block until every queued save has completed. */
+    void waitForIdle();
+
+    int pending() const;
+    int capacity() const;
+
+Q_SIGNALS:
+    /*
+     * Emitted from the save thread, connect with queued or auto connections.
+     * Paths are the targets, which files may still be staged from.
+     */
+    void progress(const QString &path, int percent);
+    void saved(libcamera::FrameBuffer *buffer, const QString &path, bool ok);
+    void pendingChanged();
+
+private:
+    void run();
+    bool writeRaw(const Job &job, const QString &path);
+    QString stage(const QString &target);
+    // Hands a written staged file to the cache, or drops it when writing failed
+    void finish(const QString &staged, const QString &target, bool ok);
+
+    std::unique_ptr<QThread> m_thread;
+    const int m_capacity;
+    QSemaphore m_slots;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_jobAvailable;
+    QWaitCondition m_idle;
+    QQueue<Job> m_queue;
+    int m_pending = 0;
+    bool m_quit = false;
+    WriteBehindCache *m_cache = nullptr;
+};
+
+#endif // STILLSAVER_H
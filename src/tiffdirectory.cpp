@@ -0,0 +1,135 @@
+#include "tiffdirectory.h"
+
+#include <algorithm>
+
+void TiffDirectory::put16(std::vector<uint8_t> &out, uint16_t value)
+{
+    out.push_back(value & 0xff);
+    out.push_back(value >> 8);
+}
+
+void TiffDirectory::put32(std::vector<uint8_t> &out, uint32_t value)
+{
+    put16(out, value & 0xffff);
+    put16(out, value >> 16);
+}
+
+void TiffDirectory::addAscii(uint16_t tag, const std::string &value)
+{
+    add(tag, Ascii, value.size() + 1, std::vector<uint8_t>(value.c_str(), value.c_str() + value.size() + 1));
+}
+
+void TiffDirectory::addUndefined(uint16_t tag, const std::string &value)
+{
+    add(tag, Undefined, value.size(), std::vector<uint8_t>(value.begin(), value.end()));
+}
+
+void TiffDirectory::addBytes(uint16_t tag, const std::vector<uint8_t> &values)
+{
+    add(tag, Byte, values.size(), values);
+}
+
+void TiffDirectory::addShort(uint16_t tag, uint16_t value)
+{
+    addShorts(tag, { value });
+}
+
+void TiffDirectory::addShorts(uint16_t tag, const std::vector<uint16_t> &values)
+{
+    std::vector<uint8_t> data;
+    for (uint16_t value : values) {
+        put16(data, value);
+    }
+    add(tag, Short, values.size(), data);
+}
+
+void TiffDirectory::addLong(uint16_t tag, uint32_t value)
+{
+    addLongs(tag, { value });
+}
+
+void TiffDirectory::addLongs(uint16_t tag, const std::vector<uint32_t> &values)
+{
+    std::vector<uint8_t> data;
+    for (uint32_t value : values) {
+        put32(data, value);
+    }
+    add(tag, Long, values.size(), data);
+}
+
+void TiffDirectory::addRational(uint16_t tag, uint32_t numerator, uint32_t denominator)
+{
+    addRationals(tag, { { numerator, denominator } });
+}
+
+void TiffDirectory::addRationals(uint16_t tag, const std::vector<std::pair<uint32_t, uint32_t>> &values)
+{
+    std::vector<uint8_t> data;
+    for (const auto &value : values) {
+        put32(data, value.first);
+        put32(data, value.second);
+    }
+    add(tag, Rational, values.size(), data);
+}
+
+void TiffDirectory::addSRationals(uint16_t tag, const std::vector<std::pair<int32_t, int32_t>> &values)
+{
+    std::vector<uint8_t> data;
+    for (const auto &value : values) {
+        put32(data, value.first);
+        put32(data, value.second);
+    }
+    add(tag, SRational, values.size(), data);
+}
+
+uint32_t TiffDirectory::size() const
+{
+    uint32_t size = 2 + 12 * m_entries.size() + 4;
+    for (const Entry &entry : m_entries) {
+        if (entry.value.size() > 4)
+            size += (entry.value.size() + 1) & ~1u;
+    }
+    return size;
+}
+
+void TiffDirectory::write(std::vector<uint8_t> &tiff, uint32_t nextIfd) const
+{
+    uint32_t valueOffset = tiff.size() + 2 + 12 * m_entries.size() + 4;
+
+    put16(tiff, m_entries.size());
+
+    for (const Entry &entry : m_entries) {
+        put16(tiff, entry.tag);
+        put16(tiff, entry.type);
+        put32(tiff, entry.count);
+
+        if (entry.value.size() <= 4) {
+            tiff.insert(tiff.end(), entry.value.begin(), entry.value.end());
+            tiff.insert(tiff.end(), 4 - entry.value.size(), 0);
+        } else {
+            put32(tiff, valueOffset);
+            valueOffset += (entry.value.size() + 1) & ~1u;
+        }
+    }
+
+    put32(tiff, nextIfd);
+
+    for (const Entry &entry : m_entries) {
+        if (entry.value.size() <= 4)
+            continue;
+
+        tiff.insert(tiff.end(), entry.value.begin(), entry.value.end());
+        if (entry.value.size() & 1)
+            tiff.push_back(0);
+    }
+}
+
+void TiffDirectory::add(uint16_t tag, Type type, uint32_t count, const std::vector<uint8_t> &value)
+{
+    auto it = std::lower_bound(m_entries.begin(), m_entries.end(), tag,
+                               [](const Entry &entry, uint16_t t) { return entry.tag < t; });
+    if (it != m_entries.end() && it->tag == tag)
+        *it = { tag, type, count, value };
+    else
+        m_entries.insert(it, { tag, type, count, value });
+}
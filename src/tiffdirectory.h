@@ -0,0 +1,58 @@
+#ifndef TIFFDIRECTORY_H
+#define TIFFDIRECTORY_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * A little endian TIFF image file directory, as used by EXIF and DNG.
+ * Entries are kept in tag order, adding a tag again replaces its value.
+ */
+class TiffDirectory
+{
+public:
+    enum Type : uint16_t {
+        Byte = 1,
+        Ascii = 2,
+        Short = 3,
+        Long = 4,
+        Rational = 5,
+        Undefined = 7,
+        SRational = 10,
+    };
+
+    void addAscii(uint16_t tag, const std::string &value);
+    void addUndefined(uint16_t tag, const std::string &value);
+    void addBytes(uint16_t tag, const std::vector<uint8_t> &values);
+    void addShort(uint16_t tag, uint16_t value);
+    void addShorts(uint16_t tag, const std::vector<uint16_t> &values);
+    void addLong(uint16_t tag, uint32_t value);
+    void addLongs(uint16_t tag, const std::vector<uint32_t> &values);
+    void addRational(uint16_t tag, uint32_t numerator, uint32_t denominator);
+    void addRationals(uint16_t tag, const std::vector<std::pair<uint32_t, uint32_t>> &values);
+    void addSRationals(uint16_t tag, const std::vector<std::pair<int32_t, int32_t>> &values);
+
+    /* Bytes taken by the directory and the values too large for its entries */
+    uint32_t size() const;
+    /* Append to tiff, which must end at an even offset from the TIFF header */
+    void write(std::vector<uint8_t> &tiff, uint32_t nextIfd) const;
+
+    static void put16(std::vector<uint8_t> &out, uint16_t value);
+    static void put32(std::vector<uint8_t> &out, uint32_t value);
+
+private:
+    struct Entry {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        std::vector<uint8_t> value;
+    };
+
+    void add(uint16_t tag, Type type, uint32_t count, const std::vector<uint8_t> &value);
+
+    std::vector<Entry> m_entries;
+};
+
+#endif // TIFFDIRECTORY_H
@@ -0,0 +1,235 @@
+#include "videorecorder.h"
+
+#include <algorithm>
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+#include "aviwriter.h"
+#include "mjpegcompressor.h"
+
+/* Recording statistics are reported at most this often */
+static constexpr qint64 StatsIntervalMs = 500;
+
+VideoRecorder::VideoRecorder(unsigned int maxQueued, QObject *parent)
+    : QObject(parent)
+    , m_maxQueued(std::max(1u, maxQueued))
+{
+    m_thread.reset(QThread::create([this]() { run(); }));
+    m_thread->setObjectName(QStringLiteral("VideoRecorder"));
+    m_thread->start();
+}
+
+VideoRecorder::~VideoRecorder()
+{
+    stop();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+    }
+    m_frameAvailable.wakeAll();
+    m_thread->wait();
+}
+
+void VideoRecorder::setQuality(int quality)
+{
+    QMutexLocker locker(&m_mutex);
+    m_quality = quality < 0 ? DefaultQuality : std::min(quality, 100);
+}
+
+void VideoRecorder::start(const QString &fileName, double fps)
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_finishing) {
+        m_idle.wait(&m_mutex);
+    }
+
+    qDebug() << "Recording to" << fileName << "at" << fps << "fps";
+
+    m_fileName = fileName;
+    m_fps = fps;
+    m_dropped = 0;
+    m_encoded = 0;
+    m_encodeTime = 0;
+    m_recording = true;
+}
+
+void VideoRecorder::stop()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_recording) {
+            return;
+        }
+        m_recording = false;
+        m_finishing = true;
+    }
+    m_frameAvailable.wakeOne();
+}
+
+bool VideoRecorder::push(const QImage &frame, int64_t timestamp)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_recording) {
+            return false;
+        }
+
+        // The encoder fell behind, keep the queue from growing without bound
+        if (m_queue.size() < m_maxQueued) {
+            m_queue.enqueue({ frame, timestamp });
+            locker.unlock();
+            m_frameAvailable.wakeOne();
+            return true;
+        }
+
+        m_dropped++;
+    }
+
+    Q_EMIT statsChanged();
+    return false;
+}
+
+bool VideoRecorder::isRecording() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_recording;
+}
+
+int VideoRecorder::droppedFrames() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_dropped;
+}
+
+double VideoRecorder::encodeFps() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_encodeTime > 0 ? m_encoded * 1e9 / m_encodeTime : 0;
+}
+
+void VideoRecorder::run()
+{
+    QElapsedTimer statsTimer;
+    statsTimer.start();
+
+    for (;;) {
+        Frame frame;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_finishing && !m_quit) {
+                m_frameAvailable.wait(&m_mutex);
+            }
+            if (m_queue.isEmpty()) {
+                if (m_finishing) {
+                    locker.unlock();
+                    finish();
+                    continue;
+                }
+                return;
+            }
+            frame = m_queue.dequeue();
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        bool encoded = encode(frame);
+        qint64 elapsed = timer.nsecsElapsed();
+
+        {
+            QMutexLocker locker(&m_mutex);
+            if (encoded) {
+                m_encoded++;
+                m_encodeTime += elapsed;
+            } else {
+                m_dropped++;
+            }
+
+            // Storage full or gone, end the recording with what was written
+            if (m_failed && m_recording) {
+                m_recording = false;
+                m_finishing = true;
+            }
+        }
+
+        if (statsTimer.elapsed() >= StatsIntervalMs) {
+            statsTimer.restart();
+            Q_EMIT statsChanged();
+        }
+    }
+}
+
+bool VideoRecorder::encode(const Frame &frame)
+{
+    if (m_failed) {
+        return false;
+    }
+
+    if (!m_writer) {
+        QString fileName;
+        double fps;
+        int quality;
+        {
+            QMutexLocker locker(&m_mutex);
+            fileName = m_fileName;
+            fps = m_fps;
+            quality = m_quality;
+        }
+
+        m_size = frame.image.size();
+        m_writer = std::make_unique<AviWriter>();
+        if (!m_writer->open(fileName, m_size, fps)) {
+            m_failed = true;
+            return false;
+        }
+
+        if (!m_compressor) {
+            m_compressor = std::make_unique<MjpegCompressor>();
+        }
+        m_compressor->setQuality(quality);
+    }
+
+    QImage image = frame.image;
+    if (image.size() != m_size) {
+        image = image.scaled(m_size, Qt::IgnoreAspectRatio, Qt::FastTransformation);
+    }
+
+    if (!m_compressor->compress(image)) {
+        return false;
+    }
+
+    if (!m_writer->writeFrame(m_compressor->data(), m_compressor->size(), frame.timestamp)) {
+        m_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+void VideoRecorder::finish()
+{
+    bool ok = false;
+    QString fileName;
+    int dropped = 0;
+
+    if (m_writer) {
+        ok = m_writer->finish() && !m_failed;
+        dropped = m_writer->skippedFrames();
+        qDebug() << "Recorded" << m_writer->frameCount() << "frames," << m_writer->repeatedFrames()
+                 << "repeated," << m_writer->skippedFrames() << "skipped";
+    }
+
+    m_writer.reset();
+    m_failed = false;
+
+    {
+        QMutexLocker locker(&m_mutex);
+        fileName = m_fileName;
+        m_dropped += dropped;
+        m_finishing = false;
+        m_idle.wakeAll();
+    }
+
+    Q_EMIT statsChanged();
+    Q_EMIT finished(fileName, ok);
+}
@@ -0,0 +1,91 @@
+#ifndef VIDEORECORDER_H
+#define VIDEORECORDER_H
+
+#include <memory>
+
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QQueue>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+class AviWriter;
+class MjpegCompressor;
+
+/*
+ * Records frames as Motion JPEG in an AVI on a dedicated thread. Frames are
+ * queued by push() with their capture timestamp, a full queue drops the
+ * frame rather than holding up the caller, and the muxer times frames by
+ * their timestamps. The video takes the size of its first frame, later
+ * frames of another size are scaled to it.
+ */
+class VideoRecorder : public QObject
+{
+    Q_OBJECT
+public:
+    static constexpr int DefaultQuality = 85;
+
+    explicit VideoRecorder(unsigned int maxQueued = 4, QObject *parent = nullptr);
+    ~VideoRecorder();
+
+    /* libjpeg quality of the frames of the next recording */
+    void setQuality(int quality);
+
+    /* Start recording to fileName at fps, after any recording being finished */
+    void start(const QString &fileName, double fps);
+    /* Finish the recording once queued frames are written, finished() follows */
+    void stop();
+    /*
+     * Queue a frame captured at timestamp nanoseconds. The frame must own its
+     * pixels. Returns false when it was dropped.
+     */
+    bool push(const QImage &frame, int64_t timestamp);
+
+    bool isRecording() const;
+    /* Frames dropped by the queue or skipped by the muxer this recording */
+    int droppedFrames() const;
+    /* Frames the encoder compresses and writes per second of its time */
+    double encodeFps() const;
+
+Q_SIGNALS:
+    /* Emitted from the recording thread, connect with queued or auto connections. */
+    void statsChanged();
+    void finished(const QString &fileName, bool ok);
+
+private:
+    struct Frame {
+        QImage image;
+        int64_t timestamp;
+    };
+
+    void run();
+    bool encode(const Frame &frame);
+    void finish();
+
+    std::unique_ptr<QThread> m_thread;
+    const int m_maxQueued;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_frameAvailable;
+    QWaitCondition m_idle;
+    QQueue<Frame> m_queue;
+    QString m_fileName;
+    bool m_recording = false;
+    bool m_finishing = false;
+    bool m_quit = false;
+    int m_quality = DefaultQuality;
+    double m_fps = 30;
+    int m_dropped = 0;
+    int m_encoded = 0;
+    qint64 m_encodeTime = 0;
+
+    /* Owned by the recording thread */
+    std::unique_ptr<AviWriter> m_writer;
+    std::unique_ptr<MjpegCompressor> m_compressor;
+    QSize m_size;
+    bool m_failed = false;
+};
+
+#endif // VIDEORECORDER_H
@@ -1,6 +1,7 @@
 #include "viewfinder2d.h"
 
 #include <assert.h>
+#include <errno.h>
 
 #include <libcamera/formats.h>
 
@@ -9,11 +10,14 @@
 #include <QMap>
 #include <QMutexLocker>
 #include <QPainter>
+#include <QQuickWindow>
+#include <QThread>
 #include <QtDebug>
 #include <QVideoFrame>
 #include <QVideoFrameFormat>
 
 #include "image.h"
+#include <algorithm>
 #include <string.h>
 
 static const QMap<libcamera::PixelFormat, QImage::Format> nativeFormats
@@ -30,6 +34,7 @@ static const QMap<libcamera::PixelFormat, QImage::Format> nativeFormats
 ViewFinder2D::ViewFinder2D()
     : m_buffer(nullptr)
 {
+    m_converter.setParallelism(QThread::idealThreadCount());
 }
 
 const QList<libcamera::PixelFormat> &ViewFinder2D::nativeFormats() const
@@ -39,24 +44,35 @@ const QList<libcamera::PixelFormat> &ViewFinder2D::nativeFormats() const
 }
 
 int ViewFinder2D::setFormat(const libcamera::PixelFormat &format, const QSize &size,
-                            [[maybe_unused]] const libcamera::ColorSpace &colorSpace, unsigned int stride)
+                            const libcamera::ColorSpace &colorSpace, unsigned int stride)
 {
     qDebug() << "Setting vf pixel format to " << format << size;
 
-    m_image = QImage();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_image = QImage();
+        m_backImage = QImage();
+    }
     m_format = format;
     m_size = size;
 
     /*
      * If format conversion is needed, configure the converter and allocate
-     * the destination image.
+     * the destination image. Native formats are converted too when the
+     * frames need orienting, if the converter supports them.
      */
-    if (!::nativeFormats.contains(format)) {
-        int ret = m_converter.configure(format, size, stride);
-        if (ret < 0)
+    int ret = -EINVAL;
+
+    if (!::nativeFormats.contains(format) || m_converter.isOriented()) {
+        ret = m_converter.configure(format, size, stride, colorSpace);
+        if (ret < 0 && !::nativeFormats.contains(format))
             return ret;
+    }
+
+    m_zeroCopy = ret < 0;
 
-        m_image = QImage(size, QImage::Format_RGB32);
+    if (!m_zeroCopy) {
+        updateOutputSize(displaySize());
 
         qInfo() << "Using software format conversion from"
             << format.toString().c_str();
@@ -67,18 +83,49 @@ int ViewFinder2D::setFormat(const libcamera::PixelFormat &format, const QSize &s
     return 0;
 }
 
+void ViewFinder2D::setOrientation(libcamera::Orientation orientation, bool mirror)
+{
+    m_converter.setOrientation(orientation, mirror);
+
+    QMutexLocker locker(&m_mutex);
+    m_mirror = mirror;
+}
+
+QRectF ViewFinder2D::mapRect(const QRectF &rect) const
+{
+    return m_zeroCopy ? rect : m_converter.mapRect(rect);
+}
+
+void ViewFinder2D::setBayerParameters(const FormatConverter::BayerParameters &params)
+{
+    // The converter only rebuilds its tables for a Bayer format, and only
+    // when the parameters change
+    if (!m_zeroCopy) {
+        m_converter.setBayerParameters(params);
+    }
+}
+
+/*
+ * Called on the capture thread. Frames are converted into the back image
+ * outside the lock, so painting only waits for the swap.
+ */
 void ViewFinder2D::renderImage(libcamera::FrameBuffer *buffer, class Image *image, QList<QRectF> rects)
 {
     size_t size1 = buffer->metadata().planes()[0].bytesused;
 
-    m_rects = rects;
-
     //qDebug() << "Plane size " << size1 << "Planes " <<  buffer->metadata().planes().size() << m_format;
 
+    if (!m_zeroCopy) {
+        updateOutputSize(displaySize());
+        m_converter.convert(image, size1, &m_backImage);
+    }
+
     {
         QMutexLocker locker(&m_mutex);
 
-        if (::nativeFormats.contains(m_format)) {
+        m_rects = rects;
+
+        if (m_zeroCopy) {
             /*
              * If the frame format is identical to the display
              * format, create a QImage that references the frame
@@ -96,20 +143,68 @@ void ViewFinder2D::renderImage(libcamera::FrameBuffer *buffer, class Image *imag
             std::swap(buffer, m_buffer);
         } else {
             /*
-             * Otherwise, convert the format and release the frame
-             * buffer immediately.
+             * Otherwise the format was converted straight to the
+             * on-screen size, and the frame buffer is released
+             * immediately.
              */
-            m_converter.convert(image, size1, &m_image);
+            std::swap(m_image, m_backImage);
         }
     }
-    update();
+
+    // Items are only updated from the GUI thread
+    QMetaObject::invokeMethod(this, [this]() { update(); }, Qt::QueuedConnection);
 
     Q_EMIT renderComplete(buffer);
 }
 
+/*
+ * Follow the on-screen size, so the per-frame conversion cost tracks display
+ * pixels rather than sensor pixels. paint() fits the frame to the item
+ * height, match that here. The converter only rebuilds its scaling when the
+ * target changes, so this is cheap per frame. Only the converter and the back
+ * image are touched, which painting never reads, so m_mutex is not held.
+ */
+void ViewFinder2D::updateOutputSize(const QSize &displaySize)
+{
+    QSize size = m_converter.isTransposed() ? m_size.transposed() : m_size;
+    QSize target = size;
+
+    if (!displaySize.isEmpty() && !size.isEmpty()) {
+        int h = std::min(displaySize.height(), size.height());
+        target = QSize(h * size.width() / size.height(), h);
+    }
+
+    bool box = target.width() * 2 <= size.width();
+    m_converter.setOutputSize(target, box ? FormatConverter::Scaling::Box
+                                          : FormatConverter::Scaling::Bilinear);
+
+    if (m_backImage.size() != m_converter.outputSize()) {
+        m_backImage = QImage(m_converter.outputSize(), QImage::Format_RGB32);
+    }
+}
+
+QSize ViewFinder2D::displaySize()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_displaySize;
+}
+
+void ViewFinder2D::geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+    QQuickPaintedItem::geometryChange(newGeometry, oldGeometry);
+
+    qreal dpr = window() ? window()->effectiveDevicePixelRatio() : 1.0;
+
+    QMutexLocker locker(&m_mutex);
+    m_displaySize = (newGeometry.size() * dpr).toSize();
+}
+
 void ViewFinder2D::stop()
 {
-    m_image = QImage();
+    {
+        QMutexLocker locker(&m_mutex);
+        m_image = QImage();
+    }
 
     if (m_buffer) {
         Q_EMIT renderComplete(m_buffer);
@@ -121,24 +216,49 @@ void ViewFinder2D::stop()
 
 QImage ViewFinder2D::currentImage()
 {
+    QMutexLocker locker(&m_mutex);
     return m_image;
 }
 
+QImage ViewFinder2D::recordingImage()
+{
+    QMutexLocker locker(&m_mutex);
+
+    // Mirroring is only done while converting, zero-copy frames are as the
+    // camera saw them
+    if (m_zeroCopy) {
+        return m_image.copy();
+    }
+
+    // Flipping the mirrored preview back gives the unmirrored conversion.
+    // Otherwise the next conversion detaches the frame by writing to it
+    return m_mirror ? m_image.mirrored(true, false) : m_image;
+}
+
 void ViewFinder2D::paint(QPainter *painter)
 {
+    // The capture thread swaps in new frames, draw the current one
+    QImage image;
+    QList<QRectF> rects;
+    {
+        QMutexLocker locker(&m_mutex);
+        image = m_image;
+        rects = m_rects;
+    }
+
     /* If we have an image, draw it. */
-    int w = height() * ((float)m_image.rect().width() / (float)m_image.rect().height());
+    int w = height() * ((float)image.rect().width() / (float)image.rect().height());
     int offset = (width() - w) / 2;
 
-    //qDebug() << Q_FUNC_INFO << m_image.rect();
+    //qDebug() << Q_FUNC_INFO << image.rect();
 
-    if (!m_image.isNull()) {
-        painter->drawImage(QRectF(QPointF(offset,0), QSizeF(w, height())), m_image, m_image.rect());
+    if (!image.isNull()) {
+        painter->drawImage(QRectF(QPointF(offset,0), QSizeF(w, height())), image, image.rect());
 
         QPen p(Qt::white);
         p.setWidth(4);
         painter->setPen(p);
-        for (QRectF r: m_rects) {
+        for (QRectF r: rects) {
             QRectF scaled(r.x() * width(), r.y() * height(), r.width() * width(), r.height() * height());
             painter->drawRect(scaled);
         }
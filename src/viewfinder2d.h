@@ -10,6 +10,7 @@
 
 #include <libcamera/formats.h>
 #include <libcamera/framebuffer.h>
+#include <libcamera/orientation.h>
 #include <libcamera/pixel_format.h>
 
 #include "viewfinder.h"
@@ -26,29 +27,55 @@ public:
     int setFormat(const libcamera::PixelFormat &format, const QSize &size,
                   const libcamera::ColorSpace &colorSpace,
                   unsigned int stride) override;
+    /* Converts on the calling thread, the item is updated on the GUI thread */
     void renderImage(libcamera::FrameBuffer *buffer, class Image *image, QList<QRectF>) override;
     void stop() override;
 
+    /*
+     * Orientation of the frames to undo, and whether to mirror the upright
+     * image. Takes effect on the next setFormat().
+     */
+    void setOrientation(libcamera::Orientation orientation, bool mirror);
+    QRectF mapRect(const QRectF &rect) const;
+
+    /* Raw Bayer processing of the next frames, called on the converting thread */
+    void setBayerParameters(const FormatConverter::BayerParameters &params);
+
     QImage currentImage();
+    /*
+     * The current frame for recording, owning its pixels and without the
+     * mirroring of front camera previews
+     */
+    QImage recordingImage();
 
 Q_SIGNALS:
     void renderComplete(libcamera::FrameBuffer *buffer);
 
 protected:
     virtual void paint(QPainter *) override;
+    void geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry) override;
 
 private:
+    void updateOutputSize(const QSize &displaySize);
+    QSize displaySize();
+
     FormatConverter m_converter;
     libcamera::PixelFormat m_format;
     QSize m_size;
+    bool m_zeroCopy = false;
+    bool m_mirror = false;
+
+    /* On-screen size in device pixels, converted frames are scaled to it. Guarded by m_mutex */
+    QSize m_displaySize;
 
     /* Camera stopped icon */
     QSizeF m_vfSize;
     QPixmap m_pixmap;
 
-    /* Buffer and render image */
+    /* Buffer and render image, and the image being converted into */
     libcamera::FrameBuffer *m_buffer;
     QImage m_image;
+    QImage m_backImage;
     QMutex m_mutex; /* Prevent concurrent access to image_ */
 
     QList<QRectF> m_rects;
@@ -0,0 +1,68 @@
+#include "wakenotifier.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QSocketNotifier>
+
+WakeNotifier::WakeNotifier(QObject *parent)
+    : QObject(parent)
+{
+    m_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_fd < 0) {
+        qWarning() << "Unable to create eventfd, waking through queued calls:" << strerror(errno);
+        return;
+    }
+
+    // A child, so it follows the notifier to its thread
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &WakeNotifier::activated);
+}
+
+WakeNotifier::~WakeNotifier()
+{
+    delete m_notifier;
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+void WakeNotifier::wake()
+{
+    // Already on its way. Both sides exchange the flag, so a wake finding it
+    // set is ordered before the clear in activated(), and the consumer's
+    // drain after that sees what was queued before this wake
+    if (m_pending.exchange(true, std::memory_order_seq_cst)) {
+        return;
+    }
+
+    if (m_fd < 0) {
+        QMetaObject::invokeMethod(this, &WakeNotifier::activated, Qt::QueuedConnection);
+        return;
+    }
+
+    const uint64_t one = 1;
+    if (::write(m_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        qWarning() << "Unable to wake:" << strerror(errno);
+    }
+}
+
+void WakeNotifier::activated()
+{
+    if (m_fd >= 0) {
+        uint64_t count;
+        if (::read(m_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            qWarning() << "Unable to read eventfd:" << strerror(errno);
+        }
+    }
+
+    // Cleared before the receivers drain, a wake from now on comes again.
+    // A plain store could be reordered after the drain's loads, missing an
+    // entry whose wake saw the flag still set
+    m_pending.exchange(false, std::memory_order_seq_cst);
+    Q_EMIT woken();
+}
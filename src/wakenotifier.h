@@ -0,0 +1,36 @@
+#ifndef WAKENOTIFIER_H
+#define WAKENOTIFIER_H
+
+#include <atomic>
+
+#include <QObject>
+
+class QSocketNotifier;
+
+/*
+ * Wakes the thread the notifier lives in from any other thread, through an
+ * eventfd watched by its event loop. Wakes before the woken() they cause
+ * are coalesced into it, so one woken() should drain everything pending.
+ * wake() neither allocates nor waits.
+ */
+class WakeNotifier : public QObject
+{
+    Q_OBJECT
+public:
+    explicit WakeNotifier(QObject *parent = nullptr);
+    ~WakeNotifier();
+
+    void wake();
+
+Q_SIGNALS:
+    void woken();
+
+private:
+    void activated();
+
+    int m_fd = -1;
+    QSocketNotifier *m_notifier = nullptr;
+    std::atomic<bool> m_pending{false};
+};
+
+#endif // WAKENOTIFIER_H
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#include "workerpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <QSemaphore>
+#include <QThread>
+
+namespace {
+
+struct Job {
+    std::function<void(unsigned int)> fn;
+    unsigned int count;
+    std::atomic<unsigned int> next{ 0 };
+    QSemaphore done;
+
+    void work()
+    {
+        unsigned int index;
+        while ((index = next.fetch_add(1)) < count) {
+            fn(index);
+            done.release();
+        }
+    }
+};
+
+} // namespace
+
+WorkerPool *WorkerPool::instance()
+{
+    static WorkerPool pool;
+    return &pool;
+}
+
+WorkerPool::WorkerPool()
+{
+    /*
+     * Keep the threads alive, spawning them per frame defeats the purpose.
+     * The calling thread works too, so one less worker fills every core.
+     */
+    m_pool.setExpiryTimeout(-1);
+    m_pool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+}
+
+unsigned int WorkerPool::threadCount() const
+{
+    return m_pool.maxThreadCount() + 1;
+}
+
+void WorkerPool::run(unsigned int count, const std::function<void(unsigned int)> &fn)
+{
+    if (count == 0) {
+        return;
+    }
+
+    if (count == 1) {
+        fn(0);
+        return;
+    }
+
+    /*
+     * Workers grab indices from a shared counter, so a worker that only
+     * starts once everything has been claimed returns straight away. The job
+     * is reference counted as such late workers may outlive this call.
+     */
+    auto job = std::make_shared<Job>();
+    job->fn = fn;
+    job->count = count;
+
+    unsigned int helpers = std::min<unsigned int>(count - 1, m_pool.maxThreadCount());
+    for (unsigned int i = 0; i < helpers; ++i) {
+        m_pool.start([job]() { job->work(); });
+    }
+
+    job->work();
+    job->done.acquire(count);
+}
+
+void WorkerPool::start(const std::function<void()> &fn)
+{
+    m_pool.start(fn);
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <functional>
+
+#include <QThreadPool>
+
+/*
+ * Process wide pool of persistent worker threads for data parallel work such
+ * as banded format conversion. The calling thread always takes part in the
+ * work, so run() makes progress even when every worker is busy.
+ */
+class WorkerPool
+{
+public:
+    static WorkerPool *instance();
+
+    unsigned int threadCount() const;
+
+    /* Call fn(0) ... fn(count - 1) in parallel and wait for all of them. */
+    void run(unsigned int count, const std::function<void(unsigned int)> &fn);
+
+    /* Queue fn on a worker and return, the caller tracks its completion. */
+    void start(const std::function<void()> &fn);
+
+private:
+    WorkerPool();
+
+    QThreadPool m_pool;
+};
+
+#endif // WORKERPOOL_H
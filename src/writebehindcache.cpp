@@ -0,0 +1,298 @@
+#include "writebehindcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <utility>
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QStorageInfo>
+
+namespace {
+
+/* Writes of a few MiB keep SD cards on their fast sequential path */
+constexpr size_t CopyBufferSize = 4 * 1024 * 1024;
+
+QString notePath(const QString &staged)
+{
+    return staged + QStringLiteral(".target");
+}
+
+} // namespace
+
+WriteBehindCache::WriteBehindCache(QObject *parent)
+    : QObject(parent)
+    , m_stagingDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/staging"))
+{
+    m_thread.reset(QThread::create([this]() {
+        recover();
+        run();
+    }));
+    m_thread->setObjectName(QStringLiteral("WriteBehind"));
+    m_thread->start(QThread::LowPriority);
+}
+
+WriteBehindCache::~WriteBehindCache()
+{
+    // Staged files are flushed before quitting, the photos are on their way
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+    }
+    m_entryAvailable.wakeAll();
+    m_thread->wait();
+}
+
+void WriteBehindCache::setEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    m_enabled = enabled;
+}
+
+void WriteBehindCache::setBudget(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_budget = bytes;
+}
+
+QString WriteBehindCache::stage(const QString &target)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_enabled || m_pendingBytes >= m_budget || m_staged.contains(target)) {
+        return target;
+    }
+
+    if (m_stagingDevice.isEmpty()) {
+        if (!QDir().mkpath(m_stagingDir)) {
+            qWarning() << "Unable to create" << m_stagingDir << ", writing captures directly";
+            m_enabled = false;
+            return target;
+        }
+        m_stagingDevice = QStorageInfo(m_stagingDir).device();
+    }
+
+    // Nothing to gain when the target is on internal storage too
+    if (QStorageInfo(QFileInfo(target).absolutePath()).device() == m_stagingDevice) {
+        return target;
+    }
+
+    const QString staged = m_stagingDir + QLatin1Char('/') + QFileInfo(target).fileName();
+    for (const QString &path : std::as_const(m_staged)) {
+        if (path == staged) {
+            return target;
+        }
+    }
+
+    return staged;
+}
+
+void WriteBehindCache::commit(const QString &staged, const QString &target)
+{
+    if (staged == target) {
+        return;
+    }
+
+    const qint64 size = QFileInfo(staged).size();
+
+    // Remember where the file goes, should the application die before the flush
+    QFile note(notePath(staged));
+    if (!note.open(QIODevice::WriteOnly) || note.write(target.toUtf8()) < 0) {
+        qWarning() << "Unable to write" << note.fileName();
+    }
+    note.close();
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_queue.enqueue({ staged, target, size });
+        m_staged.insert(target, staged);
+        m_pendingBytes += size;
+    }
+    m_entryAvailable.wakeOne();
+
+    Q_EMIT pendingBytesChanged();
+}
+
+QString WriteBehindCache::location(const QString &target) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_staged.value(target, target);
+}
+
+void WriteBehindCache::waitForIdle()
+{
+    QMutexLocker locker(&m_mutex);
+    while (!m_queue.isEmpty() || m_flushing) {
+        m_idle.wait(&m_mutex);
+    }
+}
+
+qint64 WriteBehindCache::pendingBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_pendingBytes;
+}
+
+int WriteBehindCache::pendingFiles() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_staged.size();
+}
+
+double WriteBehindCache::flushRate() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_flushRate;
+}
+
+void WriteBehindCache::run()
+{
+    for (;;) {
+        Entry entry;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_quit) {
+                m_entryAvailable.wait(&m_mutex);
+            }
+            if (m_queue.isEmpty()) {
+                return;
+            }
+            entry = m_queue.dequeue();
+            m_flushing = true;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        bool ok = flush(entry);
+        qint64 elapsed = timer.nsecsElapsed();
+
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_staged.value(entry.target) == entry.staged) {
+                m_staged.remove(entry.target);
+            }
+            m_pendingBytes -= entry.size;
+            m_flushing = false;
+
+            // Smoothed over a few files, sizes vary from thumbnails to raw dumps
+            if (ok && elapsed > 0) {
+                double rate = entry.size * 1e9 / elapsed;
+                m_flushRate = m_flushRate > 0 ? 0.7 * m_flushRate + 0.3 * rate : rate;
+            }
+            if (m_queue.isEmpty()) {
+                m_idle.wakeAll();
+            }
+        }
+
+        if (ok) {
+            qDebug() << "Flushed" << entry.target << entry.size << "bytes in" << elapsed / 1000000 << "ms";
+        }
+
+        Q_EMIT flushed(entry.staged, entry.target, ok);
+        Q_EMIT pendingBytesChanged();
+        if (ok) {
+            Q_EMIT flushRateChanged();
+        }
+    }
+}
+
+void WriteBehindCache::recover()
+{
+    QDir dir(m_stagingDir);
+    const QFileInfoList notes = dir.entryInfoList({ QStringLiteral("*.target") }, QDir::Files);
+
+    for (const QFileInfo &info : notes) {
+        QFile note(info.filePath());
+        QString target;
+        if (note.open(QIODevice::ReadOnly)) {
+            target = QString::fromUtf8(note.readAll());
+        }
+        note.close();
+
+        const QString staged = info.filePath().chopped(notePath(QString()).size());
+        if (target.isEmpty() || !QFileInfo::exists(staged)) {
+            note.remove();
+            continue;
+        }
+
+        qDebug() << "Recovering staged capture" << staged << "for" << target;
+        commit(staged, target);
+    }
+}
+
+bool WriteBehindCache::flush(const Entry &entry)
+{
+    const QByteArray source = QFile::encodeName(entry.staged);
+    const QByteArray target = QFile::encodeName(entry.target);
+    const QByteArray part = target + ".part";
+
+    int in = ::open(source.constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        // Deleted from the gallery before it got here
+        qDebug() << "Staged capture" << entry.staged << "is gone";
+        QFile::remove(notePath(entry.staged));
+        return false;
+    }
+
+    int out = ::open(part.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        qWarning() << "Unable to open" << part << strerror(errno);
+        ::close(in);
+        return false;
+    }
+
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Allocate the whole file up front, not every filesystem can
+    bool ok = entry.size == 0 || fallocate(out, 0, 0, entry.size) == 0 || errno != ENOSPC;
+
+    m_buffer.resize(CopyBufferSize);
+    while (ok) {
+        ssize_t count = ::read(in, m_buffer.data(), m_buffer.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            ok = count == 0;
+            break;
+        }
+
+        for (ssize_t done = 0; ok && done < count;) {
+            ssize_t written = ::write(out, m_buffer.data() + done, count - done);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = written > 0;
+            done += written;
+        }
+    }
+
+    // On the card before it takes the target name
+    ok = ok && fdatasync(out) == 0;
+    ok = ::close(out) == 0 && ok;
+    ::close(in);
+
+    // A capture deleted while it was copied stays deleted
+    if (ok && ::access(source.constData(), F_OK) != 0) {
+        ::unlink(part.constData());
+        QFile::remove(notePath(entry.staged));
+        return false;
+    }
+
+    if (!ok || ::rename(part.constData(), target.constData()) != 0) {
+        // The staged file and its note stay, to be retried on the next start
+        qWarning() << "Unable to flush" << entry.staged << "to" << entry.target << strerror(errno);
+        ::unlink(part.constData());
+        return false;
+    }
+
+    ::unlink(source.constData());
+    QFile::remove(notePath(entry.staged));
+    return true;
+}
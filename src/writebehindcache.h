@@ -0,0 +1,96 @@
+#ifndef WRITEBEHINDCACHE_H
+#define WRITEBEHINDCACHE_H
+
+#include <memory>
+#include <vector>
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QQueue>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+/*
+ * Stages captures bound for slow removable storage in a directory on
+ * internal flash and moves them to their target on a dedicated thread, so
+ * bursts run at the speed of internal storage rather than the card's.
+ *
+ * A file is staged only when its target is on another device and the staged
+ * files waiting to be flushed are within the budget, otherwise it's written
+ * to its target directly. Flushes copy in large sequential writes into a
+ * preallocated "<target>.part", then rename it over the target, so a partial
+ * file never appears under the target name. Staged files survive a crash:
+ * each has a "<staged>.target" note, and leftovers are flushed on startup.
+ */
+class WriteBehindCache : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(qint64 pendingBytes READ pendingBytes NOTIFY pendingBytesChanged)
+    Q_PROPERTY(int pendingFiles READ pendingFiles NOTIFY pendingBytesChanged)
+    Q_PROPERTY(double flushRate READ flushRate NOTIFY flushRateChanged)
+
+public:
+    explicit WriteBehindCache(QObject *parent = nullptr);
+    ~WriteBehindCache();
+
+    void setEnabled(bool enabled);
+    /* Staged bytes past which files are written to their target directly */
+    void setBudget(qint64 bytes);
+
+    /* The path to write a file bound for target to, a staging path or target */
+    QString stage(const QString &target);
+    /* Queue a completely written staged file to be moved to target */
+    void commit(const QString &staged, const QString &target);
+    /* Where the file bound for target is now, its staging path until flushed */
+    QString location(const QString &target) const;
+    /* Block until every committed file has been flushed. */
+    void waitForIdle();
+
+    /* Bytes staged and not yet flushed */
+    qint64 pendingBytes() const;
+    int pendingFiles() const;
+    /* Bytes per second of recent flushes, averaged */
+    double flushRate() const;
+
+Q_SIGNALS:
+    /* Emitted from the flush thread, the file is at target when ok */
+    void flushed(const QString &staged, const QString &target, bool ok);
+    void pendingBytesChanged();
+    void flushRateChanged();
+
+private:
+    struct Entry {
+        QString staged;
+        QString target;
+        qint64 size;
+    };
+
+    void run();
+    void recover();
+    bool flush(const Entry &entry);
+
+    /* Staging happens in "staging" under the application cache directory */
+    const QString m_stagingDir;
+    std::unique_ptr<QThread> m_thread;
+    mutable QMutex m_mutex;
+    QWaitCondition m_entryAvailable;
+    QWaitCondition m_idle;
+    QQueue<Entry> m_queue;
+    /* Staged paths by target, from commit() until flushed */
+    QHash<QString, QString> m_staged;
+    /* Device of the staging directory, found once it exists */
+    QByteArray m_stagingDevice;
+    bool m_enabled = true;
+    bool m_quit = false;
+    bool m_flushing = false;
+    qint64 m_budget = 512 * 1024 * 1024;
+    qint64 m_pendingBytes = 0;
+    double m_flushRate = 0;
+    /* Copy buffer of the flush thread */
+    std::vector<char> m_buffer;
+};
+
+#endif // WRITEBEHINDCACHE_H